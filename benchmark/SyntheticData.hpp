@@ -0,0 +1,201 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Generate synthetic readout blocks in the raw formats returned by readData()
+ * so the decoding pipeline can be exercised without hardware.
+ *
+ * DPP-QDC layout follows UM5743 (XX740 DPP-QDC), standard layout follows
+ * UM3350 - V1751/VX1751 User Manual rev. 16, page 32ff.
+ *
+ */
+
+#ifndef JADAQ_SYNTHETICDATA_HPP
+#define JADAQ_SYNTHETICDATA_HPP
+
+#include "caen.hpp"
+#include <cstdint>
+#include <random>
+#include <vector>
+
+namespace synthetic {
+
+/* Point a ReadoutBuffer at generated data - the buffer does not own it */
+static inline caen::ReadoutBuffer readoutBuffer(std::vector<uint32_t> &data) {
+  caen::ReadoutBuffer buffer;
+  buffer.data = reinterpret_cast<char *>(data.data());
+  buffer.size = (uint32_t)(data.size() * sizeof(uint32_t));
+  buffer.dataSize = buffer.size;
+  return buffer;
+}
+
+class DPPQDCGenerator {
+private:
+  bool extras;
+  bool waveform;
+  uint32_t samples; // Waveform samples per event - multiple of 8
+  uint32_t meanTicks;
+  std::mt19937 random;
+  uint64_t time[8] = {0, 0, 0, 0, 0, 0, 0, 0}; // 48 bits with extras
+  uint64_t now = 0; // all groups run on the board clock
+
+  std::vector<uint32_t> pulse; // Packed waveform words shared by all events
+
+  /* A slow pulse with trigger, gate and holdoff probes set around it */
+  void makePulse() {
+    const uint32_t trigger = samples / 4;
+    const uint32_t baseline = 0x200;
+    for (uint32_t i = 0; i < samples; i += 2) {
+      uint32_t word = 0;
+      for (uint32_t j = 0; j < 2; ++j) {
+        uint32_t s = i + j;
+        uint32_t v = baseline + (s & 3);
+        if (s >= trigger) {
+          v += (0x600 * 32) / (32 + (s - trigger));
+        }
+        uint32_t probes = 0;
+        if (s == trigger)
+          probes |= 0x2; // trigger
+        if (s + 4 >= trigger && s < trigger + 40)
+          probes |= 0x1; // gate
+        if (s >= trigger && s < trigger + 60)
+          probes |= 0x4; // holdoff
+        word |= ((v & 0x0fffu) | (probes << 12)) << (16 * j);
+      }
+      pulse.push_back(word);
+    }
+  }
+
+  void event(std::vector<uint32_t> &out, uint16_t group) {
+    time[group] += 1 + random() % (2 * meanTicks);
+    out.push_back((uint32_t)time[group]);
+    if (waveform) {
+      out.insert(out.end(), pulse.begin(), pulse.end());
+    }
+    if (extras) {
+      uint32_t baseline = 0x800 + random() % 16;
+      out.push_back((baseline << 16) | ((time[group] >> 32) & 0xffff));
+    }
+    uint32_t subChannel = random() % 8;
+    uint32_t charge = random() % 0x10000;
+    out.push_back((subChannel << 28) | charge);
+  }
+
+public:
+  DPPQDCGenerator(bool extras_, bool waveform_, uint32_t samples_ = 0,
+                  uint32_t meanTicks_ = 1000, uint32_t seed = 1)
+      : extras(extras_), waveform(waveform_),
+        samples(waveform_ ? samples_ : 0), meanTicks(meanTicks_),
+        random(seed) {
+    if (waveform)
+      makePulse();
+  }
+
+  /* Mean number of clock ticks between events in the same group */
+  void setMeanTicks(uint32_t ticks) { meanTicks = ticks > 0 ? ticks : 1; }
+
+  uint32_t eventWords() const { return 2 + extras + samples / 2; }
+
+  /* Append one board aggregate with eventsPerGroup events in each group
+   * enabled in groupMask */
+  void boardAggregate(std::vector<uint32_t> &out, uint8_t groupMask,
+                      uint32_t eventsPerGroup) {
+    size_t begin = out.size();
+    out.push_back(0xa0000000); // size is filled in below
+    out.push_back(groupMask);
+    out.push_back(0);
+    out.push_back(0);
+    uint64_t end = now;
+    for (uint16_t group = 0; group < 8; ++group) {
+      if (!(groupMask & (1 << group)))
+        continue;
+      time[group] = now;
+      uint32_t format = 0x60000000 | (extras << 28) | (waveform << 27) |
+                        ((samples / 8) & 0xfff);
+      out.push_back(0x80000000 | (2 + eventsPerGroup * eventWords()));
+      out.push_back(format);
+      for (uint32_t i = 0; i < eventsPerGroup; ++i) {
+        event(out, group);
+      }
+      if (time[group] > end)
+        end = time[group];
+    }
+    now = end;
+    out[begin] |= (uint32_t)(out.size() - begin);
+  }
+
+  /* Generate a readout block of roughly the given size in bytes */
+  std::vector<uint32_t> block(size_t bytes, uint8_t groupMask = 0xff,
+                              uint32_t eventsPerGroup = 16) {
+    std::vector<uint32_t> out;
+    do {
+      boardAggregate(out, groupMask, eventsPerGroup);
+    } while (out.size() * sizeof(uint32_t) < bytes);
+    return out;
+  }
+};
+
+class StdGenerator751 {
+private:
+  uint8_t channelMask;
+  uint32_t samples; // samples per channel - multiple of 3
+  uint32_t eventNo = 0;
+  uint32_t time = 0;
+  std::mt19937 random;
+
+public:
+  StdGenerator751(uint8_t channelMask_, uint32_t samples_, uint32_t seed = 1)
+      : channelMask(channelMask_), samples(samples_), random(seed) {}
+
+  uint32_t channels() const {
+    uint32_t n = 0;
+    for (uint8_t m = channelMask; m; m >>= 1)
+      n += m & 1;
+    return n;
+  }
+
+  void event(std::vector<uint32_t> &out) {
+    uint32_t words = (samples / 3) * channels();
+    out.push_back(0xa0000000 | (4 + words));
+    out.push_back(channelMask);
+    out.push_back(eventNo++ & 0x00ffffff);
+    time += 1 + random() % 2000;
+    out.push_back(time);
+    for (uint32_t i = 0; i < words; ++i) {
+      uint32_t word = 3u << 30;
+      for (uint32_t s = 0; s < 3; ++s) {
+        word |= ((0x100 + random() % 16) & 0x03ff) << (10 * s);
+      }
+      out.push_back(word);
+    }
+  }
+
+  std::vector<uint32_t> block(size_t bytes) {
+    std::vector<uint32_t> out;
+    do {
+      event(out);
+    } while (out.size() * sizeof(uint32_t) < bytes);
+    return out;
+  }
+};
+
+} // namespace synthetic
+
+#endif // JADAQ_SYNTHETICDATA_HPP
@@ -0,0 +1,385 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * End-to-end throughput and scaling benchmark. Runs the complete pipeline
+ *   emulated digitizers -> decode -> DataHandler -> DataWriter
+ * for every combination of the given board counts, event rates, waveform
+ * settings, thread counts and readout block sizes, and prints one row of
+ * results per combination.
+ *
+ * An emulated board accumulates events at the requested rate in a finite
+ * on-board memory. Events arriving while the memory is full are lost, just
+ * like on a real digitizer that is not read out fast enough.
+ *
+ */
+
+#include "DataFormat.hpp"
+#include "DataHandler.hpp"
+#include "DataWriter.hpp"
+#include "DataWriterHDF5.hpp"
+#include "DataWriterNetwork.hpp"
+#include "DataWriterText.hpp"
+#include "EventIterator.hpp"
+#include "SyntheticData.hpp"
+#include "timer.h"
+#include <atomic>
+#include <boost/program_options.hpp>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+namespace po = boost::program_options;
+
+static constexpr const uint32_t clockHz = 62500000; // XX740 16 ns time tag
+static constexpr const uint32_t eventsPerGroup = 16;
+
+/* CPU time used by the calling thread in nanoseconds */
+static uint64_t threadCPUns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Per thread CPU usage of each pipeline stage */
+struct StageCPU {
+  uint64_t readout = 0;
+  uint64_t decode = 0; // DataHandler excluding time spent in the DataWriter
+  uint64_t write = 0;
+};
+static thread_local StageCPU *stageCPU = nullptr;
+
+/* Forwards to the real DataWriter while accounting the CPU time spent */
+class DataWriterTimed {
+private:
+  DataWriter &dataWriter;
+
+public:
+  explicit DataWriterTimed(DataWriter &dw) : dataWriter(dw) {}
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t n) {
+    dataWriter.addDigitizer<C>(digitizerID, n);
+  }
+  void split(const std::string &id) { dataWriter.split(id); }
+  size_t bufferSize() const { return dataWriter.bufferSize(); }
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    uint64_t start = threadCPUns();
+    dataWriter(buffer, digitizerID, globalTimeStamp);
+    if (stageCPU)
+      stageCPU->write += threadCPUns() - start;
+  }
+};
+
+class EmulatedBoard {
+private:
+  synthetic::DPPQDCGenerator generator;
+  std::vector<uint32_t> data;
+  const double rate;         // events/s
+  const uint64_t memory;     // events the board can hold
+  const size_t maxBlockSize; // bytes per readout
+  double pending = 0;
+  SteadyTimer clock;
+  uint64_t lastus = 0;
+
+public:
+  uint64_t generated = 0;
+  uint64_t lost = 0;
+  uint64_t bytes = 0;
+  DataHandler dataHandler;
+  std::vector<uint32_t> jitter;
+
+  EmulatedBoard(bool waveform, uint32_t samples, double rate_,
+                uint64_t memory_, size_t blockSize, uint32_t seed)
+      : generator(false, waveform, samples, 1000, seed), rate(rate_),
+        memory(memory_), maxBlockSize(blockSize), jitter(8, 0) {
+    generator.setMeanTicks((uint32_t)(clockHz / (rate / 8)));
+    data.reserve(blockSize / sizeof(uint32_t) + generator.eventWords() * 128);
+  }
+
+  /* Emulate readData(): hand out what has accumulated since the last call */
+  caen::ReadoutBuffer readout() {
+    uint64_t now = clock.elapsedus();
+    pending += rate * (now - lastus) * 1e-6;
+    lastus = now;
+    if (pending > memory) {
+      lost += (uint64_t)(pending - memory);
+      pending = (double)memory;
+    }
+    data.clear();
+    const size_t aggregateEvents = 8 * eventsPerGroup;
+    const size_t aggregateBytes =
+        (4 + 8 * (2 + eventsPerGroup * generator.eventWords())) *
+        sizeof(uint32_t);
+    size_t aggregates = std::min((size_t)pending / aggregateEvents,
+                                 std::max<size_t>(1, maxBlockSize / aggregateBytes));
+    for (size_t i = 0; i < aggregates; ++i) {
+      generator.boardAggregate(data, 0xff, eventsPerGroup);
+    }
+    pending -= aggregates * aggregateEvents;
+    generated += aggregates * aggregateEvents;
+    caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data);
+    bytes += buffer.dataSize;
+    return buffer;
+  }
+};
+
+struct Setup {
+  uint32_t boards;
+  double rate;
+  bool waveform;
+  uint32_t threads;
+  size_t blockSize;
+};
+
+struct Result {
+  uint64_t generated = 0;
+  uint64_t processed = 0;
+  uint64_t lost = 0;
+  uint64_t bytes = 0;
+  StageCPU cpu;
+  double seconds = 0;
+  long peakRSSkB = 0;
+};
+
+static struct {
+  double duration = 5.0;
+  uint32_t samples = 448;
+  uint64_t memory = 1 << 16;
+  std::string writer = "null";
+  std::string path = "/tmp/";
+  std::string basename = "jadaq-bench-";
+  std::string network = "127.0.0.1";
+  std::string port = "9000";
+  char separator = ',';
+} conf;
+
+/* Reset the peak RSS (Linux >= 4.0), so every setup is measured on its own */
+static void resetPeakRSS() {
+  std::ofstream clearRefs("/proc/self/clear_refs");
+  if (clearRefs.good())
+    clearRefs << "5" << std::endl;
+}
+
+static long peakRSSkB() {
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0)
+      return std::stol(line.substr(6));
+  }
+  return -1;
+}
+
+static void createWriter(DataWriter &dataWriter) {
+  if (conf.writer == "null") {
+    dataWriter = new DataWriterNull();
+  } else if (conf.writer == "hdf5") {
+    dataWriter = new DataWriterHDF5(conf.path, conf.basename, "");
+  } else if (conf.writer == "text") {
+    dataWriter = new DataWriterText(conf.path, conf.basename, "");
+  } else if (conf.writer == "network") {
+    dataWriter = new DataWriterNetwork(conf.network, conf.port, 0);
+  } else {
+    throw std::invalid_argument("Unknown writer: " + conf.writer);
+  }
+}
+
+static Result run(const Setup &setup) {
+  Result result;
+  resetPeakRSS();
+  DataWriter dataWriter;
+  createWriter(dataWriter);
+  DataWriter timedWriter;
+  timedWriter = new DataWriterTimed(dataWriter);
+
+  std::vector<std::unique_ptr<EmulatedBoard>> boards;
+  for (uint32_t i = 0; i < setup.boards; ++i) {
+    boards.emplace_back(new EmulatedBoard(setup.waveform, conf.samples,
+                                          setup.rate, conf.memory,
+                                          setup.blockSize, i + 1));
+    EmulatedBoard &board = *boards.back();
+    if (setup.waveform)
+      board.dataHandler
+          .initialize<Data::DPPQDCWaveformElement<Data::ListElement422>>(
+              timedWriter, i, 8, conf.samples, board.jitter.data());
+    else
+      board.dataHandler.initialize<Data::ListElement422>(
+          timedWriter, i, 8, 0, board.jitter.data());
+  }
+
+  std::atomic<bool> stop{false};
+  std::vector<StageCPU> cpu(setup.threads);
+  std::vector<uint64_t> processed(setup.threads, 0);
+  std::vector<std::thread> threads;
+  SteadyTimer timer;
+  for (uint32_t t = 0; t < setup.threads; ++t) {
+    threads.emplace_back([&, t]() {
+      stageCPU = &cpu[t];
+      while (!stop.load(std::memory_order_relaxed)) {
+        bool idle = true;
+        for (size_t i = t; i < boards.size(); i += setup.threads) {
+          EmulatedBoard &board = *boards[i];
+          uint64_t start = threadCPUns();
+          caen::ReadoutBuffer buffer = board.readout();
+          uint64_t read = threadCPUns();
+          cpu[t].readout += read - start;
+          if (buffer.dataSize == 0)
+            continue;
+          idle = false;
+          uint64_t write = cpu[t].write;
+          DPPQDCEventIterator iterator{buffer};
+          processed[t] += board.dataHandler(iterator);
+          cpu[t].decode +=
+              (threadCPUns() - read) - (cpu[t].write - write);
+        }
+        if (idle)
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+      stageCPU = nullptr;
+    });
+  }
+  std::this_thread::sleep_for(
+      std::chrono::milliseconds((uint64_t)(conf.duration * 1000)));
+  stop = true;
+  for (std::thread &thread : threads)
+    thread.join();
+  result.seconds = timer.elapsedus() * 1e-6;
+
+  for (auto &board : boards) {
+    result.generated += board->generated;
+    result.lost += board->lost;
+    result.bytes += board->bytes;
+  }
+  for (uint32_t t = 0; t < setup.threads; ++t) {
+    result.processed += processed[t];
+    result.cpu.readout += cpu[t].readout;
+    result.cpu.decode += cpu[t].decode;
+    result.cpu.write += cpu[t].write;
+  }
+  boards.clear(); // flushes the DataHandlers
+  result.peakRSSkB = peakRSSkB();
+  return result;
+}
+
+template <typename T>
+static std::vector<T> parseList(const std::string &s) {
+  std::vector<T> values;
+  std::stringstream ss(s);
+  std::string item;
+  while (std::getline(ss, item, ',')) {
+    std::stringstream is(item);
+    T v;
+    is >> v;
+    if (is.fail())
+      throw std::invalid_argument("Invalid list value: " + item);
+    values.push_back(v);
+  }
+  return values;
+}
+
+int main(int argc, const char *argv[]) {
+  std::string boards = "1";
+  std::string rates = "100000";
+  std::string waveforms = "0";
+  std::string threads = "1";
+  std::string blocks = "65536";
+  std::string format = "csv";
+  po::options_description desc{"Usage: " + std::string(argv[0]) +
+                               " [<options>]\n"
+                               "Lists are comma separated; every combination "
+                               "is run"};
+  desc.add_options()
+     ("help,h", "Display help information")
+     ("boards,n", po::value<std::string>(&boards)->value_name("<list>")->default_value(boards),
+      "Number of emulated boards")
+     ("rate,r", po::value<std::string>(&rates)->value_name("<list>")->default_value(rates),
+      "Event rate per board in events/s")
+     ("waveform,w", po::value<std::string>(&waveforms)->value_name("<list>")->default_value(waveforms),
+      "Acquire waveforms (0 or 1)")
+     ("threads,j", po::value<std::string>(&threads)->value_name("<list>")->default_value(threads),
+      "Number of acquisition threads")
+     ("block,B", po::value<std::string>(&blocks)->value_name("<list>")->default_value(blocks),
+      "Maximum readout block size in bytes")
+     ("duration,t", po::value<double>(&conf.duration)->value_name("<seconds>")->default_value(conf.duration),
+      "Run time of each setup")
+     ("samples", po::value<uint32_t>(&conf.samples)->value_name("<count>")->default_value(conf.samples),
+      "Waveform samples per event (multiple of 8)")
+     ("memory", po::value<uint64_t>(&conf.memory)->value_name("<events>")->default_value(conf.memory),
+      "On-board memory of each emulated board in events")
+     ("writer,W", po::value<std::string>(&conf.writer)->value_name("<writer>")->default_value(conf.writer),
+      "DataWriter to use: null, hdf5, text or network")
+     ("path,p", po::value<std::string>(&conf.path)->value_name("<path>")->default_value(conf.path),
+      "Output path for file writers")
+     ("network,N", po::value<std::string>(&conf.network)->value_name("<address>")->default_value(conf.network),
+      "Address for the network writer")
+     ("port,P", po::value<std::string>(&conf.port)->value_name("<port>")->default_value(conf.port),
+      "Port for the network writer")
+     ("format,f", po::value<std::string>(&format)->value_name("<format>")->default_value(format),
+      "Output format: csv or tsv");
+  po::variables_map vm;
+  po::store(po::parse_command_line(argc, argv, desc), vm);
+  po::notify(vm);
+  if (vm.count("help")) {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+  if (!conf.path.empty() && *conf.path.rbegin() != '/')
+    conf.path += '/';
+  conf.separator = format == "tsv" ? '\t' : ',';
+  conf.samples -= conf.samples % 8;
+
+  const char s = conf.separator;
+  std::cout << "boards" << s << "rate" << s << "waveform" << s << "threads"
+            << s << "block" << s << "writer" << s << "seconds" << s
+            << "generated" << s << "processed" << s << "lost" << s
+            << "loss_fraction" << s << "events_per_s" << s << "bytes_per_s"
+            << s << "readout_cpu_s" << s << "decode_cpu_s" << s
+            << "write_cpu_s" << s << "cpu_ns_per_event" << s << "peak_rss_kb"
+            << std::endl;
+  for (uint32_t nBoards : parseList<uint32_t>(boards))
+    for (double rate : parseList<double>(rates))
+      for (int waveform : parseList<int>(waveforms))
+        for (uint32_t nThreads : parseList<uint32_t>(threads))
+          for (size_t block : parseList<size_t>(blocks)) {
+            Setup setup{nBoards, rate, waveform != 0,
+                        std::max<uint32_t>(1, std::min(nThreads, nBoards)),
+                        block};
+            Result r = run(setup);
+            uint64_t total = r.generated + r.lost;
+            double cpu = r.cpu.readout + r.cpu.decode + r.cpu.write;
+            std::cout << setup.boards << s << setup.rate << s
+                      << setup.waveform << s << setup.threads << s
+                      << setup.blockSize << s << conf.writer << s
+                      << r.seconds << s << r.generated << s << r.processed
+                      << s << r.lost << s
+                      << (total ? (double)r.lost / total : 0.0) << s
+                      << r.processed / r.seconds << s << r.bytes / r.seconds
+                      << s << r.cpu.readout * 1e-9 << s
+                      << r.cpu.decode * 1e-9 << s << r.cpu.write * 1e-9 << s
+                      << (r.processed ? cpu / r.processed : 0.0) << s
+                      << r.peakRSSkB << std::endl;
+          }
+  return 0;
+}
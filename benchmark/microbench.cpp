@@ -0,0 +1,870 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Microbenchmarks for the hot components of the acquisition path: event
+ * iteration, waveform decoding, DataHandler buffering, jadaq::buffer and the
+ * DataWriters. Every benchmark reports events/s, bytes/s and time/event.
+ *
+ * Besides synthetic data, raw readout blocks captured with
+ *   jadaq --capture <file> ...
+ * can be replayed with
+ *   jadaq-microbench --capture=<file>
+ *
+ */
+
+#include "DataFormat.hpp"
+#include "DataHandler.hpp"
+#include "DataWriter.hpp"
+#include "DataWriterFeatures.hpp"
+#include "DataWriterHDF5.hpp"
+#include "DataWriterHistogram.hpp"
+#include "DataWriterMerger.hpp"
+#include "DataWriterNetwork.hpp"
+#include "DataWriterText.hpp"
+#include "EventIterator.hpp"
+#include "ReadoutCapture.hpp"
+#include "SyntheticData.hpp"
+#include "WaveformCodec.hpp"
+#include "container.hpp"
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+static constexpr const size_t blockBytes = 64 * 1024;
+static constexpr const uint32_t samples = 448; // close to RecordLength=450
+
+static void setCounters(benchmark::State &state, int64_t events,
+                        int64_t bytes) {
+  state.SetItemsProcessed(events);
+  state.SetBytesProcessed(bytes);
+  state.counters["time/event"] =
+      benchmark::Counter((double)events, benchmark::Counter::kIsRate |
+                                             benchmark::Counter::kInvert);
+}
+
+/* Element type matching a DPP-QDC readout format */
+template <bool extras, bool waveform> struct DPPQDCElement;
+template <> struct DPPQDCElement<false, false> {
+  typedef Data::ListElement422 type;
+};
+template <> struct DPPQDCElement<true, false> {
+  typedef Data::ListElement8222 type;
+};
+template <> struct DPPQDCElement<false, true> {
+  typedef Data::DPPQDCWaveformElement<Data::ListElement422> type;
+};
+template <> struct DPPQDCElement<true, true> {
+  typedef Data::DPPQDCWaveformElement<Data::ListElement8222> type;
+};
+
+static std::vector<uint32_t> dppqdcBlock(bool extras, bool waveform) {
+  synthetic::DPPQDCGenerator generator(extras, waveform, samples);
+  return generator.block(blockBytes);
+}
+
+/* A stream of consecutive blocks with increasing time tags */
+static std::vector<std::vector<uint32_t>> dppqdcBlocks(bool extras,
+                                                       bool waveform,
+                                                       size_t count = 32) {
+  synthetic::DPPQDCGenerator generator(extras, waveform, samples);
+  std::vector<std::vector<uint32_t>> blocks;
+  for (size_t i = 0; i < count; ++i) {
+    blocks.push_back(generator.block(blockBytes));
+  }
+  return blocks;
+}
+
+template <typename Iterator>
+static size_t countEvents(const caen::ReadoutBuffer &buffer) {
+  size_t events = 0;
+  for (Iterator it{buffer}; it != it.end(); ++it) {
+    ++events;
+  }
+  return events;
+}
+
+/*
+ * DPPQDCEventIterator: walk board/group aggregates and touch every event
+ */
+template <bool extras, bool waveform>
+static void BM_DPPQDCEventIterator(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, waveform>::type E;
+  std::vector<uint32_t> data = dppqdcBlock(extras, waveform);
+  caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data);
+  int64_t events = 0;
+  for (auto _ : state) {
+    uint32_t sum = 0;
+    for (DPPQDCEventIterator it{buffer}; it != it.end(); ++it) {
+      typename E::EventType event = it.event<typename E::EventType>();
+      sum += event.timeTag() + event.charge();
+      ++events;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  setCounters(state, events, state.iterations() * buffer.dataSize);
+}
+BENCHMARK_TEMPLATE(BM_DPPQDCEventIterator, false, false);
+BENCHMARK_TEMPLATE(BM_DPPQDCEventIterator, true, false);
+BENCHMARK_TEMPLATE(BM_DPPQDCEventIterator, false, true);
+BENCHMARK_TEMPLATE(BM_DPPQDCEventIterator, true, true);
+
+static void BM_StdBLTEventIterator(benchmark::State &state) {
+  synthetic::StdGenerator751 generator(0xff, 300);
+  std::vector<uint32_t> data = generator.block(blockBytes);
+  caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data);
+  int64_t events = 0;
+  for (auto _ : state) {
+    uint32_t sum = 0;
+    for (StdBLTEventIterator it{buffer}; it != it.end(); ++it) {
+      StdEvent751 event = it.event<StdEvent751>();
+      sum += event.timeTag();
+      ++events;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  setCounters(state, events, state.iterations() * buffer.dataSize);
+}
+BENCHMARK(BM_StdBLTEventIterator);
+
+/*
+ * waveform_(): unpack DPP-QDC mixed-mode samples and digital probes
+ */
+template <bool extras> static void BM_DPPQDCWaveform(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, true>::type E;
+  std::vector<uint32_t> data = dppqdcBlock(extras, true);
+  caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data);
+  std::vector<uint64_t> scratch(DPPQDCWaveform::size(samples) / 8 + 1);
+  DPPQDCWaveform *waveform = reinterpret_cast<DPPQDCWaveform *>(scratch.data());
+  int64_t events = 0;
+  for (auto _ : state) {
+    for (DPPQDCEventIterator it{buffer}; it != it.end(); ++it) {
+      typename E::EventType event = it.event<typename E::EventType>();
+      event.waveform(*waveform);
+      benchmark::DoNotOptimize((uint16_t)waveform->trigger);
+      ++events;
+    }
+  }
+  setCounters(state, events, state.iterations() * buffer.dataSize);
+}
+BENCHMARK_TEMPLATE(BM_DPPQDCWaveform, false);
+BENCHMARK_TEMPLATE(BM_DPPQDCWaveform, true);
+
+static void BM_StdWaveform(benchmark::State &state) {
+  synthetic::StdGenerator751 generator(0xff, 300);
+  std::vector<uint32_t> data = generator.block(blockBytes);
+  caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data);
+  std::vector<uint64_t> scratch(StdWaveform::size(300 * 8) / 8 + 1);
+  StdWaveform *waveform = reinterpret_cast<StdWaveform *>(scratch.data());
+  int64_t events = 0;
+  for (auto _ : state) {
+    for (StdBLTEventIterator it{buffer}; it != it.end(); ++it) {
+      it.event<StdEventWaveform<StdEvent751>>().waveform(*waveform);
+      benchmark::DoNotOptimize((uint16_t)waveform->num_samples);
+      ++events;
+    }
+  }
+  setCounters(state, events, state.iterations() * buffer.dataSize);
+}
+BENCHMARK(BM_StdWaveform);
+
+/*
+ * jadaq::buffer::emplace_back: element construction into the output buffer
+ */
+template <typename E>
+static void runEmplace(benchmark::State &state, bool extras, bool waveform) {
+  std::vector<uint32_t> data = dppqdcBlock(extras, waveform);
+  caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data);
+  jadaq::buffer<E> out(Data::maxBufferSize, E::size(samples),
+                       sizeof(Data::Header));
+  int64_t events = 0;
+  for (auto _ : state) {
+    for (DPPQDCEventIterator it{buffer}; it != it.end(); ++it) {
+      if (out.size() == out.capacity())
+        out.clear();
+      out.emplace_back(it.event<typename E::EventType>(), it.group());
+      ++events;
+    }
+    benchmark::ClobberMemory();
+  }
+  setCounters(state, events, state.iterations() * buffer.dataSize);
+}
+
+template <bool extras, bool waveform>
+static void BM_BufferEmplace(benchmark::State &state) {
+  runEmplace<typename DPPQDCElement<extras, waveform>::type>(state, extras, waveform);
+}
+BENCHMARK_TEMPLATE(BM_BufferEmplace, false, false);
+BENCHMARK_TEMPLATE(BM_BufferEmplace, true, false);
+BENCHMARK_TEMPLATE(BM_BufferEmplace, false, true);
+BENCHMARK_TEMPLATE(BM_BufferEmplace, true, true);
+
+/* Waveform words copied as read out (--raw-waveforms) instead of decoded */
+template <bool extras> static void BM_BufferEmplaceRaw(benchmark::State &state) {
+  runEmplace<Data::DPPQDCRawWaveformElement<typename DPPQDCElement<extras, false>::type>>(
+      state, extras, true);
+}
+BENCHMARK_TEMPLATE(BM_BufferEmplaceRaw, false);
+BENCHMARK_TEMPLATE(BM_BufferEmplaceRaw, true);
+
+/*
+ * DataHandler::Implementation: decode, time-bucket and buffer events into a
+ * DataWriterNull
+ */
+template <typename E, typename Iterator>
+static void runDataHandler(benchmark::State &state,
+                           std::vector<caen::ReadoutBuffer> &buffers,
+                           size_t groups, size_t waveformSamples,
+                           EventFilter *filter = nullptr,
+                           const WaveformWindow *window = nullptr,
+                           bool records = false) {
+  std::vector<uint32_t> jitter(groups, 0);
+  DataWriter dataWriter;
+  dataWriter = new DataWriterNull();
+  DataHandler dataHandler;
+  dataHandler.setFilter(filter);
+  dataHandler.setWindow(window);
+  dataHandler.setRecords(records);
+  dataHandler.initialize<E>(dataWriter, 0, groups, waveformSamples,
+                            jitter.data());
+  int64_t events = 0;
+  int64_t bytes = 0;
+  size_t i = 0;
+  for (auto _ : state) {
+    caen::ReadoutBuffer &buffer = buffers[i++ % buffers.size()];
+    Iterator iterator{buffer};
+    events += dataHandler(iterator);
+    bytes += buffer.dataSize;
+  }
+  setCounters(state, events, bytes);
+}
+
+template <bool extras, bool waveform>
+static void BM_DataHandler(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, waveform>::type E;
+  std::vector<std::vector<uint32_t>> data = dppqdcBlocks(extras, waveform);
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (auto &d : data)
+    buffers.push_back(synthetic::readoutBuffer(d));
+  runDataHandler<E, DPPQDCEventIterator>(state, buffers, 8,
+                                         waveform ? samples : 0);
+}
+BENCHMARK_TEMPLATE(BM_DataHandler, false, false);
+BENCHMARK_TEMPLATE(BM_DataHandler, true, false);
+BENCHMARK_TEMPLATE(BM_DataHandler, false, true);
+BENCHMARK_TEMPLATE(BM_DataHandler, true, true);
+
+/* Two rules over all channels - roughly half the events are dropped */
+template <bool extras>
+static void BM_DataHandlerFiltered(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, false>::type E;
+  std::vector<std::vector<uint32_t>> data = dppqdcBlocks(extras, false);
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (auto &d : data)
+    buffers.push_back(synthetic::readoutBuffer(d));
+  EventFilter filter;
+  EventFilter::Rule rule;
+  rule.name = "dead";
+  rule.channels = 0x0f0f0f0f0f0f0f0full;
+  filter.add(rule);
+  rule.name = "charge";
+  rule.channels = ~0ull;
+  rule.field = EventFilter::Charge;
+  rule.low = 0x100;
+  rule.high = 0xf000;
+  filter.add(rule);
+  runDataHandler<E, DPPQDCEventIterator>(state, buffers, 8, 0, &filter);
+}
+BENCHMARK_TEMPLATE(BM_DataHandlerFiltered, false);
+BENCHMARK_TEMPLATE(BM_DataHandlerFiltered, true);
+
+/* Waveforms cut to 64 samples around the trigger */
+template <bool extras>
+static void BM_DataHandlerWindow(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, true>::type E;
+  std::vector<std::vector<uint32_t>> data = dppqdcBlocks(extras, true);
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (auto &d : data)
+    buffers.push_back(synthetic::readoutBuffer(d));
+  WaveformWindow window;
+  WaveformWindow::Window w;
+  w.pre = 16;
+  w.post = 48;
+  window.set(~0ull, w);
+  runDataHandler<E, DPPQDCEventIterator>(state, buffers, 8, samples, nullptr, &window);
+}
+BENCHMARK_TEMPLATE(BM_DataHandlerWindow, false);
+BENCHMARK_TEMPLATE(BM_DataHandlerWindow, true);
+
+/* Waveforms stored as variable length records instead of fixed size elements */
+template <bool extras>
+static void BM_DataHandlerRecords(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, true>::type E;
+  std::vector<std::vector<uint32_t>> data = dppqdcBlocks(extras, true);
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (auto &d : data)
+    buffers.push_back(synthetic::readoutBuffer(d));
+  runDataHandler<E, DPPQDCEventIterator>(state, buffers, 8, samples, nullptr, nullptr, true);
+}
+BENCHMARK_TEMPLATE(BM_DataHandlerRecords, false);
+BENCHMARK_TEMPLATE(BM_DataHandlerRecords, true);
+
+/* The sorter must see time moving forward, so instead of cycling through the
+ * same blocks the generator keeps going (untimed) after each pass */
+template <bool extras, bool waveform>
+static void BM_DataHandlerSorted(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, waveform>::type E;
+  synthetic::DPPQDCGenerator generator(extras, waveform, samples);
+  std::vector<std::vector<uint32_t>> data(32);
+  std::vector<uint32_t> jitter(8, 0);
+  DataWriter dataWriter;
+  dataWriter = new DataWriterNull();
+  DataHandler dataHandler;
+  dataHandler.setSortWindow(state.range(0));
+  dataHandler.initialize<E>(dataWriter, 0, 8, waveform ? samples : 0,
+                            jitter.data());
+  int64_t events = 0;
+  int64_t bytes = 0;
+  size_t i = 0;
+  for (auto _ : state) {
+    if (i % data.size() == 0) {
+      state.PauseTiming();
+      for (auto &d : data)
+        d = generator.block(blockBytes);
+      state.ResumeTiming();
+    }
+    caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data[i++ % data.size()]);
+    DPPQDCEventIterator iterator{buffer};
+    events += dataHandler(iterator);
+    bytes += buffer.dataSize;
+  }
+  setCounters(state, events, bytes);
+}
+BENCHMARK_TEMPLATE(BM_DataHandlerSorted, false, false)->Arg(100000)->Arg(1000000);
+BENCHMARK_TEMPLATE(BM_DataHandlerSorted, true, true)->Arg(100000)->Arg(1000000);
+
+static void BM_DataHandlerStd751(benchmark::State &state) {
+  synthetic::StdGenerator751 generator(0xff, 300);
+  std::vector<std::vector<uint32_t>> data;
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (int i = 0; i < 32; ++i)
+    data.push_back(generator.block(blockBytes));
+  for (auto &d : data)
+    buffers.push_back(synthetic::readoutBuffer(d));
+  runDataHandler<Data::StdElement751, StdBLTEventIterator>(state, buffers, 8,
+                                                           300 * 8);
+}
+BENCHMARK(BM_DataHandlerStd751);
+
+/*
+ * DataWriters: cost of handing one full jadaq::buffer to each writer
+ */
+template <typename E>
+static jadaq::buffer<E> *fullBuffer(bool extras, bool waveform, size_t bufferSize) {
+  std::vector<uint32_t> data = dppqdcBlock(extras, waveform);
+  caen::ReadoutBuffer readout = synthetic::readoutBuffer(data);
+  auto *buffer = new jadaq::buffer<E>(bufferSize, E::size(waveform ? samples : 0),
+                                      sizeof(Data::Header));
+  while (buffer->size() < buffer->capacity()) {
+    for (DPPQDCEventIterator it{readout};
+         it != it.end() && buffer->size() < buffer->capacity(); ++it) {
+      buffer->emplace_back(it.event<typename E::EventType>(), it.group());
+    }
+  }
+  return buffer;
+}
+
+/* The back to back layout written out, from elements padded to alignment */
+template <bool extras, bool waveform>
+static void BM_BufferSerialize(benchmark::State &state) {
+  typedef typename DPPQDCElement<extras, waveform>::type E;
+  std::unique_ptr<jadaq::buffer<E>> buffer(
+      fullBuffer<E>(extras, waveform, Data::maxBufferSize));
+  std::vector<char> out(buffer->data_size());
+  int64_t events = 0;
+  int64_t bytes = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(buffer->serialize(out.data()));
+    benchmark::ClobberMemory();
+    events += buffer->size();
+    bytes += buffer->data_size();
+  }
+  setCounters(state, events, bytes);
+}
+BENCHMARK_TEMPLATE(BM_BufferSerialize, false, false);
+BENCHMARK_TEMPLATE(BM_BufferSerialize, true, false);
+BENCHMARK_TEMPLATE(BM_BufferSerialize, true, true);
+
+/* A fresh output buffer per write: allocated (0) or from a pool (1) */
+static void BM_BufferPool(benchmark::State &state) {
+  typedef DPPQDCElement<false, false>::type E;
+  std::shared_ptr<jadaq::buffer_pool<E>> pool =
+      jadaq::buffer_pool<E>::create(Data::maxBufferSize, E::size(0), sizeof(Data::Header), 2);
+  const E element{};
+  for (auto _ : state) {
+    jadaq::buffer<E> *buffer =
+        state.range(0) ? pool->acquire()
+                       : new jadaq::buffer<E>(Data::maxBufferSize, E::size(0), sizeof(Data::Header));
+    buffer->push_back(element);
+    benchmark::DoNotOptimize(buffer->data());
+    if (state.range(0))
+      buffer->release();
+    else
+      delete buffer;
+  }
+  state.counters["allocated"] = pool->allocated();
+}
+BENCHMARK(BM_BufferPool)->Arg(0)->Arg(1);
+
+static std::string tmpPath() {
+  static std::string path;
+  if (path.empty()) {
+    char tmpl[] = "/tmp/jadaq-microbench-XXXXXX";
+    path = std::string(mkdtemp(tmpl)) + "/";
+  }
+  return path;
+}
+
+/* Writers are split (i.e. files truncated) after about splitBytes to keep
+ * disk usage bounded */
+template <typename E>
+static void runWriter(benchmark::State &state, DataWriter &dataWriter,
+                      bool extras, bool waveform, int64_t splitBytes) {
+  std::unique_ptr<jadaq::buffer<E>> buffer(
+      fullBuffer<E>(extras, waveform, dataWriter.bufferSize()));
+  dataWriter.addDigitizer<jadaq::buffer<E>>(0, waveform ? samples : 0);
+  const int64_t splitEvery =
+      splitBytes > 0 ? std::max<int64_t>(1, splitBytes / buffer->data_size()) : 0;
+  int64_t events = 0;
+  int64_t bytes = 0;
+  uint64_t globalTimeStamp = 0;
+  for (auto _ : state) {
+    dataWriter(buffer.get(), 0, globalTimeStamp++ / 16);
+    events += buffer->size();
+    bytes += buffer->data_size();
+    if (splitEvery > 0 && globalTimeStamp % splitEvery == 0) {
+      state.PauseTiming();
+      dataWriter.split("");
+      state.ResumeTiming();
+    }
+  }
+  setCounters(state, events, bytes);
+}
+
+template <bool extras, bool waveform>
+static void BM_DataWriterNull(benchmark::State &state) {
+  DataWriter dataWriter;
+  dataWriter = new DataWriterNull();
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 0);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterNull, false, false);
+
+template <bool extras, bool waveform>
+static void BM_DataWriterText(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "text";
+  DataWriter dataWriter;
+  dataWriter = new DataWriterText(path, basename, "");
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 2 << 20);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterText, false, false);
+BENCHMARK_TEMPLATE(BM_DataWriterText, true, false);
+BENCHMARK_TEMPLATE(BM_DataWriterText, false, true);
+
+template <bool extras, bool waveform>
+static void BM_DataWriterHDF5(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "hdf5";
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "");
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 32 << 20);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5, false, false);
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5, true, false);
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5, false, true);
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5, true, true);
+
+/* One dataset per digitizer and type, indexed by time stamp */
+template <bool extras, bool waveform>
+static void BM_DataWriterHDF5Indexed(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "indexed";
+  DataWriterHDF5::Options options;
+  options.layout = DataWriterHDF5::Indexed;
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "", DataWriterHDF5::defaultBufferSize, options);
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 32 << 20);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5Indexed, false, false);
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5Indexed, false, true);
+
+/* A dataset per field, chunks shuffled and deflated at level range(0) by
+ * range(1) threads (0 for the HDF5 filter pipeline) */
+template <bool extras, bool waveform>
+static void BM_DataWriterHDF5Columns(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "columns";
+  DataWriterHDF5::Options options;
+  options.layout = DataWriterHDF5::Columns;
+  options.filter = state.range(0) ? ChunkCompressor::Deflate : ChunkCompressor::None;
+  options.level = state.range(0);
+  options.threads = state.range(1);
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "", DataWriterHDF5::defaultBufferSize, options);
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 32 << 20);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5Columns, true, false)
+    ->Args({0, 0})->Args({1, 0})->Args({1, 1})->Args({1, 4})->UseRealTime();
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5Columns, false, true)
+    ->Args({0, 0})->Args({1, 0})->Args({1, 1})->Args({1, 4})->UseRealTime();
+
+/* List events written to HDF5 in buffers of range(0) bytes */
+static void BM_DataWriterHDF5Batch(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "batch";
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "", state.range(0));
+  runWriter<DPPQDCElement<false, false>::type>(state, dataWriter, false, false, 32 << 20);
+}
+BENCHMARK(BM_DataWriterHDF5Batch)->Arg(Data::maxBufferSize)->Arg(1 << 20)->Arg(4 << 20);
+
+/* The stall of a split after every buffer - with the next file opened in
+ * advance if range(0), else opened by split() */
+static void BM_DataWriterHDF5Split(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "split";
+  DataWriterHDF5::Options options;
+  options.layout = DataWriterHDF5::Indexed;
+  options.split = state.range(0) != 0;
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "0", DataWriterHDF5::defaultBufferSize, options);
+  typedef DPPQDCElement<false, false>::type E;
+  std::unique_ptr<jadaq::buffer<E>> buffer(fullBuffer<E>(false, false, dataWriter.bufferSize()));
+  dataWriter.addDigitizer<jadaq::buffer<E>>(0, 0);
+  uint64_t splits = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    dataWriter(buffer.get(), 0, splits);
+    if (splits >= 2)
+      unlink((path + basename + std::to_string(splits - 2) + ".h5").c_str());
+    state.ResumeTiming();
+    dataWriter.split(std::to_string(++splits));
+  }
+}
+BENCHMARK(BM_DataWriterHDF5Split)->Arg(0)->Arg(1);
+
+/* The first write after a split, while the worker closes the file before:
+ * how long the readout stalls on a split. Without a thread safe HDF5 it
+ * waits for the whole close. */
+static void BM_DataWriterHDF5SplitStall(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "stall";
+  DataWriterHDF5::Options options;
+  options.layout = DataWriterHDF5::Columns;
+  options.filter = ChunkCompressor::Deflate;
+  options.split = state.range(0) != 0;
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "0", DataWriterHDF5::defaultBufferSize, options);
+  typedef DPPQDCElement<false, false>::type E;
+  std::unique_ptr<jadaq::buffer<E>> buffer(fullBuffer<E>(false, false, dataWriter.bufferSize()));
+  dataWriter.addDigitizer<jadaq::buffer<E>>(0, 0);
+  uint64_t splits = 0;
+  double longest = 0.0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (int i = 0; i < 8; ++i)
+      dataWriter(buffer.get(), 0, splits);
+    if (splits >= 2)
+      unlink((path + basename + std::to_string(splits - 2) + ".h5").c_str());
+    dataWriter.split(std::to_string(++splits));
+    auto start = std::chrono::steady_clock::now();
+    state.ResumeTiming();
+    dataWriter(buffer.get(), 0, splits);
+    state.PauseTiming();
+    longest = std::max(longest, std::chrono::duration<double, std::micro>(
+                                    std::chrono::steady_clock::now() - start).count());
+    state.ResumeTiming();
+  }
+  state.counters["max_us"] = longest;
+}
+BENCHMARK(BM_DataWriterHDF5SplitStall)->Arg(0)->Arg(1);
+
+template <bool extras, bool waveform>
+static void BM_DataWriterNetwork(benchmark::State &state) {
+  DataWriter dataWriter;
+  // Nobody listens on the discard port - we only measure the send path
+  dataWriter = new DataWriterNetwork("127.0.0.1", "9", 0);
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 0);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterNetwork, false, false);
+BENCHMARK_TEMPLATE(BM_DataWriterNetwork, true, true);
+
+/* Waveform output with the samples packed by WaveformCodec */
+template <bool extras>
+static void BM_DataWriterNetworkPacked(benchmark::State &state) {
+  DataWriter dataWriter;
+  dataWriter = new DataWriterNetwork("127.0.0.1", "9", 0, JUMBO_PAYLOAD, true);
+  runWriter<typename DPPQDCElement<extras, true>::type>(state, dataWriter, extras, true, 0);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterNetworkPacked, false);
+BENCHMARK_TEMPLATE(BM_DataWriterNetworkPacked, true);
+
+template <bool extras>
+static void BM_DataWriterHDF5Packed(benchmark::State &state) {
+  static const std::string path = tmpPath();
+  static const std::string basename = "packed";
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHDF5(path, basename, "", DataWriterHDF5::defaultBufferSize, true);
+  runWriter<typename DPPQDCElement<extras, true>::type>(state, dataWriter, extras, true, 32 << 20);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5Packed, false);
+BENCHMARK_TEMPLATE(BM_DataWriterHDF5Packed, true);
+
+/*
+ * WaveformCodec: pack and unpack the elements of a full waveform buffer.
+ * "ratio" is the unpacked over the packed size.
+ */
+typedef DPPQDCElement<false, true>::type PackedElement;
+static const Data::ElementType packedType = Data::packedType(PackedElement::type());
+
+static void BM_WaveformPack(benchmark::State &state) {
+  std::unique_ptr<jadaq::buffer<PackedElement>> buffer(
+      fullBuffer<PackedElement>(false, true, Data::maxBufferSize));
+  size_t fixed, countOffset;
+  Data::packedLayout(packedType, fixed, countOffset);
+  std::vector<char> out(WaveformCodec::maxRecordSize(fixed, samples) * buffer->size());
+  int64_t events = 0;
+  size_t packed = 0;
+  for (auto _ : state) {
+    char *next = out.data();
+    for (const PackedElement &e : *buffer)
+      next += WaveformCodec::packRecord((const char *)&e, fixed, countOffset, next);
+    benchmark::DoNotOptimize(out.data());
+    packed = next - out.data();
+    events += buffer->size();
+  }
+  setCounters(state, events, state.iterations() * (buffer->data_size() - sizeof(Data::Header)));
+  state.counters["ratio"] = (double)(buffer->data_size() - sizeof(Data::Header)) / packed;
+}
+BENCHMARK(BM_WaveformPack);
+
+static void BM_WaveformUnpack(benchmark::State &state) {
+  std::unique_ptr<jadaq::buffer<PackedElement>> buffer(
+      fullBuffer<PackedElement>(false, true, Data::maxBufferSize));
+  size_t fixed, countOffset;
+  Data::packedLayout(packedType, fixed, countOffset);
+  std::vector<char> in(WaveformCodec::maxRecordSize(fixed, samples) * buffer->size());
+  char *end = in.data();
+  for (const PackedElement &e : *buffer)
+    end += WaveformCodec::packRecord((const char *)&e, fixed, countOffset, end);
+  const size_t elementSize = PackedElement::size(samples);
+  std::vector<char> element(elementSize);
+  int64_t events = 0;
+  for (auto _ : state) {
+    for (const char *next = in.data(); next < end;) {
+      size_t record = WaveformCodec::unpackRecord(next, end - next, fixed, countOffset,
+                                                  element.data(), elementSize);
+      if (record == 0) {
+        state.SkipWithError("Corrupt record");
+        break;
+      }
+      benchmark::DoNotOptimize(element.data());
+      next += record;
+      ++events;
+    }
+  }
+  setCounters(state, events, events * elementSize);
+}
+BENCHMARK(BM_WaveformUnpack);
+
+/* Waveforms reduced to pulse features on the way to a null writer,
+ * range(0) is 1 in N waveforms kept */
+template <bool extras>
+static void BM_DataWriterFeatures(benchmark::State &state) {
+  DataWriterFeatures::Settings settings;
+  settings.defaults.negative = false;
+  settings.defaults.traces = state.range(0);
+  DataWriter output;
+  output = new DataWriterNull(1 << 20);
+  DataWriter traces;
+  traces = new DataWriterNull(1 << 20);
+  DataWriter dataWriter;
+  dataWriter = new DataWriterFeatures(std::move(output), std::move(traces), settings);
+  runWriter<typename DPPQDCElement<extras, true>::type>(state, dataWriter, extras, true, 0);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterFeatures, false)->Arg(0)->Arg(100);
+BENCHMARK_TEMPLATE(BM_DataWriterFeatures, true)->Arg(0);
+
+/* Charge spectra filled on the way to a null writer */
+template <bool extras, bool waveform>
+static void BM_DataWriterHistogram(benchmark::State &state) {
+  DataWriter output;
+  output = new DataWriterNull(1 << 20);
+  DataWriter dataWriter;
+  dataWriter = new DataWriterHistogram(std::move(output), std::make_shared<ChargeHistograms>());
+  runWriter<typename DPPQDCElement<extras, waveform>::type>(
+      state, dataWriter, extras, waveform, 0);
+}
+BENCHMARK_TEMPLATE(BM_DataWriterHistogram, false, false);
+BENCHMARK_TEMPLATE(BM_DataWriterHistogram, true, false);
+
+/* range(0) digitizers, each time sorted, merged into one stream */
+static void BM_DataWriterMerger(benchmark::State &state) {
+  typedef DPPQDCElement<false, false>::type E;
+  const size_t digitizers = state.range(0);
+  std::vector<synthetic::DPPQDCGenerator> generators;
+  for (size_t d = 0; d < digitizers; ++d)
+    generators.emplace_back(false, false, 0, 1000, d + 1);
+  std::vector<std::vector<uint32_t>> data(digitizers);
+  std::vector<uint32_t> jitter(8, 0);
+  DataWriter output;
+  output = new DataWriterNull();
+  DataWriter dataWriter;
+  dataWriter = new DataWriterMerger(std::move(output), std::chrono::milliseconds(1000));
+  std::vector<DataHandler> dataHandlers(digitizers);
+  for (size_t d = 0; d < digitizers; ++d) {
+    dataHandlers[d].setSortWindow(100000);
+    dataHandlers[d].initialize<E>(dataWriter, d, 8, 0, jitter.data());
+  }
+  int64_t events = 0;
+  int64_t bytes = 0;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (size_t d = 0; d < digitizers; ++d)
+      data[d] = generators[d].block(blockBytes / digitizers);
+    state.ResumeTiming();
+    for (size_t d = 0; d < digitizers; ++d) {
+      caen::ReadoutBuffer buffer = synthetic::readoutBuffer(data[d]);
+      DPPQDCEventIterator iterator{buffer};
+      events += dataHandlers[d](iterator);
+      bytes += buffer.dataSize;
+    }
+  }
+  setCounters(state, events, bytes);
+}
+BENCHMARK(BM_DataWriterMerger)->Arg(2)->Arg(8);
+
+/*
+ * Captured data: replay raw readout blocks through iterator and DataHandler
+ */
+static std::vector<ReadoutCapture::Block> captured;
+
+static void BM_CapturedEventIterator(benchmark::State &state) {
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (auto &block : captured) {
+    caen::ReadoutBuffer b;
+    b.data = block.data.data();
+    b.size = b.dataSize = block.header.size;
+    buffers.push_back(b);
+  }
+  int64_t events = 0;
+  int64_t bytes = 0;
+  size_t i = 0;
+  for (auto _ : state) {
+    caen::ReadoutBuffer &buffer = buffers[i++ % buffers.size()];
+    events += countEvents<DPPQDCEventIterator>(buffer);
+    bytes += buffer.dataSize;
+  }
+  setCounters(state, events, bytes);
+}
+
+template <bool extras, bool waveform>
+static void BM_CapturedDataHandler(benchmark::State &state,
+                                   uint32_t waveformSamples) {
+  std::vector<caen::ReadoutBuffer> buffers;
+  for (auto &block : captured) {
+    caen::ReadoutBuffer b;
+    b.data = block.data.data();
+    b.size = b.dataSize = block.header.size;
+    buffers.push_back(b);
+  }
+  runDataHandler<typename DPPQDCElement<extras, waveform>::type,
+                 DPPQDCEventIterator>(state, buffers, 8, waveformSamples);
+}
+
+/* Captured DPP-QDC data is self describing: read the format word of the
+ * first group aggregate to learn the element type */
+static void registerCaptured(const std::string &filename) {
+  std::vector<ReadoutCapture::Block> blocks = ReadoutCapture::read(filename);
+  for (auto &block : blocks) {
+    if (block.header.familyCode == CAEN_DGTZ_XX740_FAMILY_CODE &&
+        block.header.firmware == CAEN_DGTZ_DPPFirmware_QDC &&
+        block.header.size >= 6 * sizeof(uint32_t)) {
+      captured.push_back(block);
+    }
+  }
+  if (captured.empty()) {
+    std::cerr << "No DPP-QDC readout blocks found in " << filename
+              << std::endl;
+    return;
+  }
+  const uint32_t *ptr =
+      reinterpret_cast<const uint32_t *>(captured[0].data.data());
+  uint32_t format = ptr[5];
+  bool extras = ((format >> 28) & 1) == 1;
+  bool waveform = ((format >> 27) & 1) == 1;
+  uint32_t waveformSamples = waveform ? (format & 0xfff) << 3 : 0;
+
+  benchmark::RegisterBenchmark("BM_CapturedEventIterator",
+                               BM_CapturedEventIterator);
+  if (extras && waveform)
+    benchmark::RegisterBenchmark("BM_CapturedDataHandler",
+                                 BM_CapturedDataHandler<true, true>,
+                                 waveformSamples);
+  else if (extras)
+    benchmark::RegisterBenchmark("BM_CapturedDataHandler",
+                                 BM_CapturedDataHandler<true, false>,
+                                 waveformSamples);
+  else if (waveform)
+    benchmark::RegisterBenchmark("BM_CapturedDataHandler",
+                                 BM_CapturedDataHandler<false, true>,
+                                 waveformSamples);
+  else
+    benchmark::RegisterBenchmark("BM_CapturedDataHandler",
+                                 BM_CapturedDataHandler<false, false>,
+                                 waveformSamples);
+}
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg(argv[i]);
+    const std::string option("--capture=");
+    if (arg.compare(0, option.size(), option) == 0) {
+      registerCaptured(arg.substr(option.size()));
+    } else {
+      std::cerr << "Unknown argument: " << arg << std::endl;
+      return 1;
+    }
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -0,0 +1,133 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Per channel charge spectra of every digitizer.
+ *
+ */
+
+#include "ChargeHistograms.hpp"
+#include "HDF5Lock.hpp"
+#include <H5Cpp.h>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+constexpr const size_t ChargeHistograms::defaultChannels;
+constexpr const size_t ChargeHistograms::defaultBins;
+
+ChargeHistograms::ChargeHistograms(size_t channels_, size_t bins) : channels(channels_) {
+  if (bins == 0 || (bins & (bins - 1)) != 0 || bins > 65536)
+    throw std::invalid_argument("Histogram bins must be a power of two no larger than 65536");
+  while (((size_t)1 << binBits) < bins)
+    ++binBits;
+  shift = 16 - binBits;
+}
+
+ChargeHistograms::Spectra &ChargeHistograms::find(uint32_t digitizerID) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::unique_ptr<Spectra> &spectra = digitizers[digitizerID];
+  if (!spectra)
+    spectra.reset(new Spectra(channels, binBits, shift));
+  last = spectra.get();
+  lastID = digitizerID;
+  return *last;
+}
+
+std::string ChargeHistograms::json() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  const size_t bins = getBins();
+  std::ostringstream out;
+  out << "{\"bins\":" << bins << ",\"bin_width\":" << getBinWidth() << ",\"digitizers\":[";
+  bool first = true;
+  for (const auto &itr : digitizers) {
+    const Spectra &s = *itr.second;
+    out << (first ? "" : ",") << "{\"id\":" << itr.first << ",\"entries\":" << s.entries.load()
+        << ",\"outside\":" << s.outside.load() << ",\"channels\":[";
+    first = false;
+    bool firstChannel = true;
+    for (size_t c = 0; c < s.channels; ++c) {
+      const std::atomic<uint32_t> *row = &s.counts[c * bins];
+      size_t end = bins;
+      while (end > 0 && row[end - 1].load(std::memory_order_relaxed) == 0)
+        --end;
+      if (end == 0)
+        continue;
+      out << (firstChannel ? "" : ",") << "{\"channel\":" << c << ",\"counts\":[";
+      firstChannel = false;
+      for (size_t b = 0; b < end; ++b)
+        out << (b ? "," : "") << row[b].load(std::memory_order_relaxed);
+      out << "]}";
+    }
+    out << "]}";
+  }
+  out << "]}";
+  return out.str();
+}
+
+template <typename T>
+static void writeAttribute(H5::H5Object &location, const std::string &name,
+                           const H5::PredType &type, const T &value) {
+  H5::Attribute a = location.createAttribute(name, type, H5::DataSpace(H5S_SCALAR));
+  a.write(type, &value);
+}
+
+/* Written to a temporary file first, so a reader never sees half a snapshot.
+ * From the service thread, while the acquisition thread may be writing HDF5
+ * output - hence the HDF5Lock. */
+void ChargeHistograms::write(const std::string &filename) const {
+  const std::string tmp = filename + ".tmp";
+  const size_t bins = getBins();
+  std::vector<uint32_t> counts;
+  HDF5Lock hdf5;
+  try {
+    H5::H5File file(tmp, H5F_ACC_TRUNC);
+    H5::Group root = file.openGroup("/");
+    double time = std::chrono::duration<double>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    uint32_t binWidth = getBinWidth();
+    writeAttribute(root, "time", H5::PredType::NATIVE_DOUBLE, time);
+    writeAttribute(root, "bin_width", H5::PredType::NATIVE_UINT32, binWidth);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto &itr : digitizers) {
+      const Spectra &s = *itr.second;
+      counts.resize(s.channels * bins);
+      for (size_t i = 0; i < counts.size(); ++i)
+        counts[i] = s.counts[i].load(std::memory_order_relaxed);
+      hsize_t dims[2] = {s.channels, bins};
+      H5::DataSpace space(2, dims);
+      // named like the groups of DataWriterHDF5
+      H5::DataSet dataset = file.createDataSet(std::to_string(itr.first & 0xFFFF),
+                                               H5::PredType::NATIVE_UINT32, space);
+      dataset.write(counts.data(), H5::PredType::NATIVE_UINT32);
+      uint64_t entries = s.entries.load();
+      uint64_t outside = s.outside.load();
+      writeAttribute(dataset, "digitizer", H5::PredType::NATIVE_UINT32, itr.first);
+      writeAttribute(dataset, "entries", H5::PredType::NATIVE_UINT64, entries);
+      writeAttribute(dataset, "outside", H5::PredType::NATIVE_UINT64, outside);
+    }
+  } catch (H5::Exception &e) {
+    throw std::runtime_error("Could not write histograms to \"" + tmp + "\": " + e.getDetailMsg());
+  }
+  if (std::rename(tmp.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error("Could not rename \"" + tmp + "\" to \"" + filename + "\"");
+}
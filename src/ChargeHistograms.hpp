@@ -0,0 +1,105 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Per channel charge spectra of every digitizer.
+ *
+ * The spectra of one digitizer are a single channels x bins block of 32 bit
+ * counts, so filling from a buffer touches one contiguous array. Bins are a
+ * power of two wide and the bin is the charge shifted right.
+ *
+ * Only the acquisition thread fills. Like Counter, a count is bumped with a
+ * relaxed load and store, so other threads can take snapshots (json(),
+ * write()) at any time without stopping it - a snapshot may just be a few
+ * events behind in some bins.
+ *
+ */
+
+#ifndef JADAQ_CHARGEHISTOGRAMS_HPP
+#define JADAQ_CHARGEHISTOGRAMS_HPP
+
+#include "Counter.hpp"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class ChargeHistograms {
+public:
+  static constexpr const size_t defaultChannels = 64;
+  static constexpr const size_t defaultBins = 4096;
+
+  class Spectra {
+  public:
+    Spectra(size_t channels_, unsigned binBits_, unsigned shift_)
+        : channels(channels_), binBits(binBits_), shift(shift_),
+          counts(new std::atomic<uint32_t>[channels_ << binBits_]()) {}
+
+    void add(uint16_t channel, uint16_t charge) {
+      if (channel >= channels) {
+        ++outside;
+        return;
+      }
+      std::atomic<uint32_t> &count = counts[((size_t)channel << binBits) | (charge >> shift)];
+      count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    const size_t channels;
+    const unsigned binBits;
+    const unsigned shift;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts;
+    Counter entries;
+    Counter outside; // events from channels beyond the histogrammed ones
+  };
+
+  /* bins must be a power of two no larger than 65536 */
+  explicit ChargeHistograms(size_t channels = defaultChannels, size_t bins = defaultBins);
+  ChargeHistograms(const ChargeHistograms &) = delete;
+
+  /* The spectra of a digitizer - created on first use. Acquisition thread only. */
+  Spectra &spectra(uint32_t digitizerID) {
+    if (last && lastID == digitizerID)
+      return *last;
+    return find(digitizerID);
+  }
+
+  size_t getBins() const { return (size_t)1 << binBits; }
+  unsigned getBinWidth() const { return 1u << shift; }
+
+  /* Latest spectra of every digitizer, channels without entries left out */
+  std::string json() const;
+  /* Write the spectra to an HDF5 file - replaced as a whole */
+  void write(const std::string &filename) const;
+
+private:
+  const size_t channels;
+  unsigned binBits = 0;
+  unsigned shift = 0;
+  mutable std::mutex mutex; // guards the map, not the counts
+  std::map<uint32_t, std::unique_ptr<Spectra>> digitizers;
+  Spectra *last = nullptr;
+  uint32_t lastID = 0;
+
+  Spectra &find(uint32_t digitizerID);
+};
+
+#endif // JADAQ_CHARGEHISTOGRAMS_HPP
@@ -0,0 +1,208 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Compression of HDF5 chunks on a pool of worker threads.
+ *
+ * The chunks are filtered the way the HDF5 filter pipeline would - byte
+ * shuffle, then deflate (zlib) or zstd (the registered filter 32015) - so
+ * the writer can store them with H5Dwrite_chunk and any HDF5 reader
+ * decodes them with the filters of the dataset. A chunk that does not get
+ * smaller is stored shuffled only, with the compression filter masked out,
+ * as HDF5 does for an optional filter that fails.
+ *
+ * Chunks are handed back in the order they were submitted. Only the
+ * thread submitting them touches HDF5.
+ *
+ */
+
+#ifndef JADAQ_CHUNKCOMPRESSOR_HPP
+#define JADAQ_CHUNKCOMPRESSOR_HPP
+
+#include <H5Cpp.h>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#ifdef JADAQ_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+class ChunkCompressor {
+public:
+  enum Filter { None, Deflate, Zstd };
+  static constexpr const H5Z_filter_t zstdFilter = 32015;
+
+  struct Chunk {
+    hid_t dataset;
+    hsize_t offset[2];
+    size_t elementSize; // shuffled in units of
+    std::vector<char> data; // the raw chunk, compressed when done
+    uint32_t filterMask = 0;
+    bool done = false;
+  };
+
+  static bool available(Filter filter) {
+#ifdef JADAQ_HAVE_ZSTD
+    return true;
+#else
+    return filter != Zstd;
+#endif
+  }
+
+  /* Add shuffle and the filter to a dataset creation property list */
+  static void setFilters(H5::DSetCreatPropList &create, Filter filter, int level) {
+    if (filter == None)
+      return;
+    create.setShuffle();
+    if (filter == Deflate) {
+      create.setDeflate(level);
+    } else {
+      const unsigned values[1] = {(unsigned)level};
+      create.setFilter(zstdFilter, H5Z_FLAG_OPTIONAL, 1, values);
+    }
+  }
+
+  ChunkCompressor(Filter filter_, int level_, unsigned threads) : filter(filter_), level(level_) {
+    if (!available(filter))
+      throw std::runtime_error("ChunkCompressor: zstd support not built in");
+    for (unsigned i = 0; i < threads; ++i)
+      workers.emplace_back(&ChunkCompressor::work, this);
+  }
+  ChunkCompressor(const ChunkCompressor &) = delete;
+
+  ~ChunkCompressor() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    submitted.notify_all();
+    for (std::thread &worker : workers)
+      worker.join();
+  }
+
+  size_t threads() const { return workers.size(); }
+
+  void submit(std::unique_ptr<Chunk> chunk) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.push_back(std::move(chunk));
+    }
+    submitted.notify_one();
+  }
+
+  /* The oldest chunk if it is compressed - waiting for it with wait set.
+   * nullptr when there is none (yet). */
+  std::unique_ptr<Chunk> next(bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (wait)
+      finished.wait(lock, [this]() { return queue.empty() || queue.front()->done; });
+    if (queue.empty() || !queue.front()->done)
+      return nullptr;
+    std::unique_ptr<Chunk> chunk = std::move(queue.front());
+    queue.pop_front();
+    --claimed;
+    return chunk;
+  }
+
+  size_t pending() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+  }
+
+  /* Shuffle n bytes in elements of size bytes: all first bytes, then all
+   * second bytes, ... like H5Z_FILTER_SHUFFLE */
+  static void shuffle(const char *in, size_t n, size_t size, char *out) {
+    const size_t elements = n / size;
+    for (size_t b = 0; b < size; ++b) {
+      const char *src = in + b;
+      char *dst = out + b * elements;
+      for (size_t i = 0; i < elements; ++i, src += size)
+        dst[i] = *src;
+    }
+    // a trailing partial element is left as it is
+    memcpy(out + elements * size, in + elements * size, n - elements * size);
+  }
+
+  /* Filter the chunk in place, using scratch */
+  static void compress(Filter filter, int level, Chunk &chunk, std::vector<char> &scratch) {
+    const size_t n = chunk.data.size();
+    scratch.resize(n);
+    shuffle(chunk.data.data(), n, chunk.elementSize, scratch.data());
+    size_t size = 0;
+    if (filter == Deflate) {
+      uLongf length = compressBound(n);
+      chunk.data.resize(length);
+      if (compress2((Bytef *)chunk.data.data(), &length, (const Bytef *)scratch.data(), n,
+                    level) == Z_OK)
+        size = length;
+    }
+#ifdef JADAQ_HAVE_ZSTD
+    if (filter == Zstd) {
+      chunk.data.resize(ZSTD_compressBound(n));
+      size_t length = ZSTD_compress(chunk.data.data(), chunk.data.size(), scratch.data(), n, level);
+      if (!ZSTD_isError(length))
+        size = length;
+    }
+#endif
+    if (size == 0 || size >= n) {
+      // the compression filter (second in the pipeline) is skipped
+      chunk.data.swap(scratch);
+      chunk.data.resize(n);
+      chunk.filterMask = 1u << 1;
+    } else {
+      chunk.data.resize(size);
+    }
+  }
+
+private:
+  const Filter filter;
+  const int level;
+  mutable std::mutex mutex;
+  std::condition_variable submitted;
+  std::condition_variable finished;
+  std::deque<std::unique_ptr<Chunk>> queue; // in submission order
+  size_t claimed = 0; // chunks at the front of the queue taken by a worker
+  bool stop = false;
+  std::vector<std::thread> workers;
+
+  void work() {
+    std::vector<char> scratch;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      submitted.wait(lock, [this]() { return stop || claimed < queue.size(); });
+      if (stop)
+        return;
+      Chunk *chunk = queue[claimed++].get();
+      lock.unlock();
+      compress(filter, level, *chunk, scratch);
+      lock.lock();
+      chunk->done = true;
+      finished.notify_all();
+    }
+  }
+};
+
+#endif // JADAQ_CHUNKCOMPRESSOR_HPP
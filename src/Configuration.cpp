@@ -27,7 +27,10 @@
 
 #include "Configuration.hpp"
 #include "StringConversion.hpp"
+#include <algorithm>
 #include <cstdint>
+#include <map>
+#include <sstream>
 #include <iostream>
 #include <regex>
 #include "xtrace.h"
@@ -119,6 +122,8 @@ pt::ptree Configuration::readBack() {
     }
     dPtree.put("VME", hex_string(digitizer.VMEBaseAddress));
     dPtree.put("CONET", digitizer.conetNode);
+    if (digitizer.getTimeOffset() != 0)
+      dPtree.put("TimeOffset", digitizer.getTimeOffset());
 
     for (FunctionID id = functionIDbegin(); id < functionIDend(); ++id) {
       if (!takeIndex(id)) {
@@ -222,6 +227,21 @@ void Configuration::apply() {
     if (conf.empty()) {
       continue; // Skip top level keys i.e. not in a [section]
     }
+    if (name == "Coincidence") {
+      coincidence = true;
+      continue; // applied once all digitizers are known
+    }
+    if (name == "Filter") {
+      continue; // applied once all digitizers are known
+    }
+    if (name == "Features") {
+      features = true;
+      continue; // applied once all digitizers are known
+    }
+    if (name == "Window") {
+      continue; // applied once all digitizers are known
+    }
+    sections.push_back(name);
 
     uint32_t vme = 0;
     int conet = 0;
@@ -233,6 +253,8 @@ void Configuration::apply() {
     conf.erase("VME");
     conet = conf.get<int>("CONET", 0);
     conf.erase("CONET");
+    int64_t timeOffset = conf.get<int64_t>("TimeOffset", 0);
+    conf.erase("TimeOffset");
     Digitizer *digitizer = nullptr;
     if (usb < 0 && optical < 0) {
       XTRACE(CONF, ERR, "ERROR: [%s] contains neither USB nor OPTICAL number. One is REQUIRED.", name.c_str());
@@ -250,12 +272,317 @@ void Configuration::apply() {
         digitizers.emplace_back(CAEN_DGTZ_USB, usb, conet, vme);
       }
       digitizer = &*digitizers.rbegin();
+      digitizer->setTimeOffset(timeOffset);
     // } catch (caen::Error &e) {
     //   XTRACE(MAIN, ERR, "ERROR: Unable to open digitizer [%s]:", name.c_str(), e.what());
     //   throw;
     // }
     configure(*digitizer, conf, getVerbose());
   }
+  if (coincidence) {
+    applyCoincidence(in.get_child("Coincidence"));
+  }
+  auto filter = in.find("Filter");
+  if (filter != in.not_found() && !filter->second.empty()) {
+    applyFilter(filter->second);
+  }
+  if (features) {
+    applyFeatures(in.get_child("Features"));
+  }
+  auto window = in.find("Window");
+  if (window != in.not_found() && !window->second.empty()) {
+    applyWindow(window->second);
+  }
+}
+
+/*
+ * [Coincidence]
+ * Window=<ticks>
+ * MinMultiplicity=<n>
+ * MaxMultiplicity=<n>
+ * MaxHits=<n>
+ * Group[<name>]=<section>:<channels> [<section>:<channels> ...]
+ * Require=<name> [<name> ...]
+ */
+void Configuration::applyCoincidence(const pt::ptree &conf) {
+  DataWriterCoincidence::Settings &settings = coincidenceSettings;
+  std::vector<std::string> require;
+  for (auto &setting : conf) {
+    const std::string &key = setting.first;
+    if (key == "Window") {
+      settings.window = setting.second.get_value<uint64_t>();
+    } else if (key == "MinMultiplicity") {
+      settings.minMultiplicity = setting.second.get_value<unsigned>();
+    } else if (key == "MaxMultiplicity") {
+      settings.maxMultiplicity = setting.second.get_value<unsigned>();
+    } else if (key == "MaxHits") {
+      settings.maxHits = setting.second.get_value<unsigned>();
+    } else if (key == "Require") {
+      std::istringstream names(setting.second.data());
+      std::string name;
+      while (names >> name)
+        require.push_back(name);
+    } else if (key == "Group") {
+      for (auto &groupSetting : setting.second) {
+        DataWriterCoincidence::Group group;
+        group.name = groupSetting.first;
+        std::istringstream members(groupSetting.second.data());
+        std::string member;
+        while (members >> member) {
+          size_t colon = member.rfind(':');
+          std::string section = member.substr(0, colon);
+          auto itr = std::find(sections.begin(), sections.end(), section);
+          if (colon == std::string::npos || itr == sections.end()) {
+            throw std::runtime_error("Coincidence group " + group.name +
+                                     ": no digitizer section \"" + section + "\"");
+          }
+          Range range{member.substr(colon + 1)};
+          Digitizer &digitizer = digitizers[itr - sections.begin()];
+          group.channels.push_back({digitizer.digitizerID(), range.begin(), range.end() - 1});
+        }
+        settings.groups.push_back(group);
+      }
+    } else {
+      throw std::runtime_error("Unknown coincidence setting: " + key);
+    }
+  }
+  for (const std::string &name : require) {
+    auto itr = std::find_if(settings.groups.begin(), settings.groups.end(),
+                            [&name](const DataWriterCoincidence::Group &g) { return g.name == name; });
+    if (itr == settings.groups.end())
+      throw std::runtime_error("Coincidence requires unknown group " + name);
+    itr->required = true;
+  }
+  if (settings.maxHits == 0 || settings.maxHits > 0xffff || settings.window > 0x7fffffff)
+    throw std::runtime_error("Coincidence MaxHits or Window out of range");
+}
+
+/*
+ * [Filter]
+ * Rule[<name>]=<section>:<channels> [<section>:<channels> ...] Charge=<low>-<high>
+ * Rule[<name>]=<section>:<channels> [...] Baseline=<low>-<high>
+ * Rule[<name>]=<section>:<channels> [...] Reject
+ */
+void Configuration::applyFilter(const pt::ptree &conf) {
+  for (auto &setting : conf) {
+    if (setting.first != "Rule" || setting.second.empty()) {
+      throw std::runtime_error("Unknown filter setting: " + setting.first);
+    }
+    for (auto &ruleSetting : setting.second) {
+      EventFilter::Rule rule;
+      rule.name = ruleSetting.first;
+      bool condition = false;
+      std::map<size_t, uint64_t> channels; // per digitizer
+      std::istringstream words(ruleSetting.second.data());
+      std::string word;
+      while (words >> word) {
+        size_t equals = word.find('=');
+        if (word == "Reject" || equals != std::string::npos) {
+          if (condition) {
+            throw std::runtime_error("Filter rule " + rule.name + ": more than one condition");
+          }
+          condition = true;
+          if (word == "Reject")
+            continue;
+          std::string key = word.substr(0, equals);
+          if (key == "Charge") {
+            rule.field = EventFilter::Charge;
+          } else if (key == "Baseline") {
+            rule.field = EventFilter::Baseline;
+          } else {
+            throw std::runtime_error("Filter rule " + rule.name + ": unknown condition " + key);
+          }
+          Range window{word.substr(equals + 1)};
+          if (window.begin() < 0 || window.end() > 0x10000 || window.end() <= window.begin()) {
+            throw std::runtime_error("Filter rule " + rule.name + ": invalid window " + word);
+          }
+          rule.low = (uint16_t)window.begin();
+          rule.high = (uint16_t)(window.end() - 1);
+          continue;
+        }
+        size_t colon = word.rfind(':');
+        std::string section = word.substr(0, colon);
+        auto itr = std::find(sections.begin(), sections.end(), section);
+        if (colon == std::string::npos || itr == sections.end()) {
+          throw std::runtime_error("Filter rule " + rule.name + ": no digitizer section \"" +
+                                   section + "\"");
+        }
+        Range range{word.substr(colon + 1)};
+        if (range.begin() < 0 || range.end() > EventFilter::maxChannels) {
+          throw std::runtime_error("Filter rule " + rule.name + ": channels out of range in " + word);
+        }
+        uint64_t &mask = channels[itr - sections.begin()];
+        for (int c = range.begin(); c != range.end(); ++c)
+          mask |= 1ull << c;
+      }
+      if (!condition || channels.empty()) {
+        throw std::runtime_error("Filter rule " + rule.name + " needs channels and a condition");
+      }
+      for (auto &digitizer : channels) {
+        rule.channels = digitizer.second;
+        digitizers[digitizer.first].addFilterRule(rule);
+      }
+    }
+  }
+}
+
+/* A waveform feature setting - false if key is not one */
+static bool featureSetting(WaveformFeatures::Parameters &p, const std::string &key,
+                           const std::string &value) {
+  if (key == "Baseline") {
+    p.baseline = std::stoul(value);
+  } else if (key == "Rise") {
+    Configuration::Range rise{value};
+    if (rise.begin() < 0 || rise.end() - 1 > 100 || rise.end() - 1 <= rise.begin())
+      throw std::runtime_error("Invalid feature rise time levels " + value);
+    p.riseLow = rise.begin();
+    p.riseHigh = rise.end() - 1;
+  } else if (key == "Polarity") {
+    if (value != "Negative" && value != "Positive")
+      throw std::runtime_error("Invalid feature polarity " + value);
+    p.negative = value == "Negative";
+  } else if (key == "Traces") {
+    p.traces = std::stoul(value);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * [Features]
+ * Baseline=<samples>
+ * Rise=<low>-<high>
+ * Polarity=Negative|Positive
+ * Traces=<n>
+ * Channels[<name>]=<section>:<channels> [...] [Baseline=..] [Rise=..] [Polarity=..] [Traces=..]
+ */
+void Configuration::applyFeatures(const pt::ptree &conf) {
+  DataWriterFeatures::Settings &settings = featuresSettings;
+  for (auto &setting : conf) {
+    const bool channels = setting.first == "Channels" && !setting.second.empty();
+    if (!channels && !featureSetting(settings.defaults, setting.first, setting.second.data()))
+      throw std::runtime_error("Unknown features setting: " + setting.first);
+  }
+  // channel settings start from the defaults, wherever these are given
+  for (auto &setting : conf) {
+    if (setting.first != "Channels")
+      continue;
+    for (auto &channelsSetting : setting.second) {
+      const std::string &name = channelsSetting.first;
+      WaveformFeatures::Parameters parameters = settings.defaults;
+      std::map<size_t, uint64_t> channels; // per digitizer
+      std::istringstream words(channelsSetting.second.data());
+      std::string word;
+      while (words >> word) {
+        size_t equals = word.find('=');
+        if (equals != std::string::npos) {
+          if (!featureSetting(parameters, word.substr(0, equals), word.substr(equals + 1)))
+            throw std::runtime_error("Features channels " + name + ": unknown setting " + word);
+          continue;
+        }
+        size_t colon = word.rfind(':');
+        std::string section = word.substr(0, colon);
+        auto itr = std::find(sections.begin(), sections.end(), section);
+        if (colon == std::string::npos || itr == sections.end()) {
+          throw std::runtime_error("Features channels " + name + ": no digitizer section \"" +
+                                   section + "\"");
+        }
+        Range range{word.substr(colon + 1)};
+        if (range.begin() < 0 || range.end() > (int)DataWriterFeatures::maxChannels) {
+          throw std::runtime_error("Features channels " + name + ": channels out of range in " + word);
+        }
+        uint64_t &mask = channels[itr - sections.begin()];
+        for (int c = range.begin(); c != range.end(); ++c)
+          mask |= 1ull << c;
+      }
+      if (channels.empty())
+        throw std::runtime_error("Features channels " + name + " needs channels");
+      for (auto &digitizer : channels) {
+        settings.channels.push_back(
+            {digitizers[digitizer.first].digitizerID(), digitizer.second, parameters});
+      }
+    }
+  }
+  if (settings.channels.size() > 127)
+    throw std::runtime_error("Too many features channel settings");
+}
+
+/* A waveform window setting - false if key is not one */
+static bool windowSetting(WaveformWindow::Window &w, const std::string &key,
+                          const std::string &value) {
+  if (key == "Anchor") {
+    if (value != "Trigger" && value != "Gate")
+      throw std::runtime_error("Invalid waveform window anchor " + value);
+    w.anchor = value == "Gate" ? WaveformWindow::Gate : WaveformWindow::Trigger;
+  } else if (key == "Pre" || key == "Post") {
+    unsigned long samples = std::stoul(value);
+    if (samples > 0x7fff)
+      throw std::runtime_error("Waveform window too long: " + key + "=" + value);
+    (key == "Pre" ? w.pre : w.post) = (uint16_t)samples;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * [Window]
+ * Anchor=Trigger|Gate
+ * Pre=<samples>
+ * Post=<samples>
+ * Channels[<name>]=<section>:<channels> [...] [Anchor=..] [Pre=..] [Post=..]
+ */
+void Configuration::applyWindow(const pt::ptree &conf) {
+  WaveformWindow::Window defaults;
+  bool everywhere = false; // the defaults cover every channel
+  for (auto &setting : conf) {
+    const bool channels = setting.first == "Channels" && !setting.second.empty();
+    if (!channels && !windowSetting(defaults, setting.first, setting.second.data()))
+      throw std::runtime_error("Unknown window setting: " + setting.first);
+    everywhere |= setting.first == "Pre" || setting.first == "Post";
+  }
+  if (everywhere) {
+    for (Digitizer &digitizer : digitizers)
+      digitizer.setWaveformWindow(~0ull, defaults);
+  }
+  for (auto &setting : conf) {
+    if (setting.first != "Channels")
+      continue;
+    for (auto &channelsSetting : setting.second) {
+      const std::string &name = channelsSetting.first;
+      WaveformWindow::Window window = defaults;
+      std::map<size_t, uint64_t> channels; // per digitizer
+      std::istringstream words(channelsSetting.second.data());
+      std::string word;
+      while (words >> word) {
+        size_t equals = word.find('=');
+        if (equals != std::string::npos) {
+          if (!windowSetting(window, word.substr(0, equals), word.substr(equals + 1)))
+            throw std::runtime_error("Window channels " + name + ": unknown setting " + word);
+          continue;
+        }
+        size_t colon = word.rfind(':');
+        std::string section = word.substr(0, colon);
+        auto itr = std::find(sections.begin(), sections.end(), section);
+        if (colon == std::string::npos || itr == sections.end()) {
+          throw std::runtime_error("Window channels " + name + ": no digitizer section \"" +
+                                   section + "\"");
+        }
+        Range range{word.substr(colon + 1)};
+        if (range.begin() < 0 || range.end() > (int)WaveformWindow::maxChannels) {
+          throw std::runtime_error("Window channels " + name + ": channels out of range in " + word);
+        }
+        uint64_t &mask = channels[itr - sections.begin()];
+        for (int c = range.begin(); c != range.end(); ++c)
+          mask |= 1ull << c;
+      }
+      if (channels.empty() || window.length() == 0)
+        throw std::runtime_error("Window channels " + name + " needs channels and a window");
+      for (auto &digitizer : channels)
+        digitizers[digitizer.first].setWaveformWindow(digitizer.second, window);
+    }
+  }
 }
 
 Configuration::Range::Range(std::string s) {
@@ -28,6 +28,8 @@
 #ifndef JADAQ_CONFIGURATION_HPP
 #define JADAQ_CONFIGURATION_HPP
 
+#include "DataWriterCoincidence.hpp"
+#include "DataWriterFeatures.hpp"
 #include "Digitizer.hpp"
 #include "ini_parser.hpp"
 #include <fstream>
@@ -38,13 +40,28 @@ class Configuration {
 private:
   pt::ptree in;
   std::vector<Digitizer> digitizers;
+  std::vector<std::string> sections; // section name of each digitizer
+  bool coincidence = false;
+  DataWriterCoincidence::Settings coincidenceSettings;
+  bool features = false;
+  DataWriterFeatures::Settings featuresSettings;
   pt::ptree readBack();
   void apply();
+  void applyCoincidence(const pt::ptree &conf);
+  void applyFilter(const pt::ptree &conf);
+  void applyFeatures(const pt::ptree &conf);
+  void applyWindow(const pt::ptree &conf);
   bool verbose_;
 
 public:
   explicit Configuration(std::ifstream &file, bool verbose);
   std::vector<Digitizer> &getDigitizers();
+  /* From the [Coincidence] section - if there is one */
+  bool hasCoincidence() const { return coincidence; }
+  const DataWriterCoincidence::Settings &getCoincidence() const { return coincidenceSettings; }
+  /* From the [Features] section - if there is one */
+  bool hasFeatures() const { return features; }
+  const DataWriterFeatures::Settings &getFeatures() const { return featuresSettings; }
   void write(std::ofstream &file);
   void setVerbose(bool verbose) { verbose_ = verbose; }
   bool getVerbose() const { return verbose_; }
@@ -0,0 +1,59 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Statistics counter owned by a single writer thread and read by others.
+ *
+ * Incrementing is a relaxed load and store - no locked instruction - which is
+ * only correct as long as one thread writes. Each counter fills a cache line
+ * of its own so readers polling one counter do not keep pulling the lines
+ * the acquisition thread is writing to.
+ *
+ */
+
+#ifndef JADAQ_COUNTER_HPP
+#define JADAQ_COUNTER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+class Counter {
+public:
+  static constexpr const size_t cacheLine = 64;
+
+  Counter() : value(0) {}
+  Counter(const Counter &) = delete;
+
+  Counter &operator+=(uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    return *this;
+  }
+  Counter &operator++() { return *this += 1; }
+  /* For values that go up and down - still single writer */
+  void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+  uint64_t load() const { return value.load(std::memory_order_relaxed); }
+
+private:
+  std::atomic<uint64_t> value;
+  char pad[cacheLine - sizeof(std::atomic<uint64_t>)];
+};
+
+#endif // JADAQ_COUNTER_HPP
@@ -29,28 +29,46 @@
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
+#include <string>
+#include <vector>
 
 constexpr uint8_t version_maj {1};
-constexpr uint8_t version_min {3};
+constexpr uint8_t version_min {4};
 
 #define JUMBO_PAYLOAD 9000
 #define IP_HEADER 20
 #define UDP_HEADER 8
 
+/* The elements are packed: their layout is the one sent and stored. In
+ * memory jadaq::buffer starts every element on an 8 byte boundary, so the
+ * fields of all but StdElement751 are naturally aligned while processed. */
 namespace Data {
      // store version as Big Endian for backwards compatibility
     const uint16_t currentVersion = (version_min << 8) + version_maj;
     const constexpr uint16_t WaveformBase = 1<<8;
+    const constexpr uint16_t PackedBase = 1<<9; // samples packed by WaveformCodec
+    const constexpr uint16_t RawBase = 1<<10; // sample words as read out, not decoded
+    const constexpr uint16_t RecordsBase = 1<<11; // length prefixed records (jadaq::records)
     enum ElementType: uint16_t
     {
         None,
         List422,
         List8222,
         Standard, // non-DPP standard data with waveform
+        Coincidence, // hits from several channels/digitizers within a time window
+        Features, // waveform reduced to pulse features
         Waveform422 = WaveformBase | List422,
         Waveform8222 = WaveformBase | List8222,
+        PackedStandard = PackedBase | Standard,
+        PackedWaveform422 = PackedBase | Waveform422,
+        PackedWaveform8222 = PackedBase | Waveform8222,
+        RawWaveform422 = RawBase | Waveform422,
+        RawWaveform8222 = RawBase | Waveform8222,
+        RecordsWaveform422 = RecordsBase | Waveform422,
+        RecordsWaveform8222 = RecordsBase | Waveform8222,
     };
     /* Shared meta data for the entire data package */
     struct __attribute__ ((__packed__)) Header // 32 bytes
@@ -59,11 +77,18 @@ namespace Data {
         uint64_t globalTime;
         uint32_t digitizerID;
         uint16_t elementType;
-        uint16_t numElements;
+        uint16_t numElements; // low 16 bits of the element count
         uint16_t version;
         uint32_t seqNum;
-        uint8_t __pad[2];
+        uint16_t numElementsHigh; // since 1.4 - was padding, zero before
+        void setElements(uint32_t n)
+        {
+            numElements = (uint16_t)n;
+            numElementsHigh = (uint16_t)(n >> 16);
+        }
+        uint32_t elements() const { return ((uint32_t)numElementsHigh << 16) | numElements; }
     };
+    static_assert(sizeof(Header) == 32, "Data::Header must be 32 bytes");
     static_assert(std::is_pod<Header>::value, "Data::Header must be POD");
 
     struct __attribute__ ((__packed__)) ListElement422
@@ -84,6 +109,8 @@ namespace Data {
         {
             return time < rhs.time || (time == rhs.time && channel < rhs.channel) ;
         };
+        static constexpr unsigned timeBits = 32;
+        uint64_t timeStamp() const { return time; }
         void printOn(std::ostream& os) const
         {
             os << PRINTD(channel) << " " << PRINTD(time) << " " << PRINTD(charge);
@@ -130,6 +157,8 @@ namespace Data {
         {
             return time < rhs.time || (time == rhs.time && channel < rhs.channel) ;
         };
+        static constexpr unsigned timeBits = 48;
+        uint64_t timeStamp() const { return time; }
         void printOn(std::ostream& os) const
         {
             os << PRINTD(channel) << " " << PRINTD(time) << " " << PRINTD(charge) << " " << PRINTD(baseline) ;
@@ -177,6 +206,9 @@ namespace Data {
         {
             return time < rhs.time;
         };
+        // bit 31 of the trigger time tag is the roll over flag
+        static constexpr unsigned timeBits = 31;
+        uint64_t timeStamp() const { return time & 0x7fffffffu; }
         void printOn(std::ostream& os) const
         {
             os << PRINTD(channelMask) << " " << PRINTD(time) << " " << PRINTD(eventNo) << " ";
@@ -223,6 +255,8 @@ namespace Data {
                 , waveform{event} {}
         bool operator< (const DPPQDCWaveformElement& rhs) const
         { return listElement < rhs.listElement; }
+        static constexpr unsigned timeBits = ListElementType::timeBits;
+        uint64_t timeStamp() const { return listElement.timeStamp(); }
         void printOn(std::ostream& os) const
         {
             listElement.printOn(os); os << " ";
@@ -240,6 +274,10 @@ namespace Data {
             waveform.insertMembers(datatype,offsetof(DPPQDCWaveformElement,waveform));
         }
         static size_t size(size_t samples) { return ListElementType::size() + DPPQDCWaveform::size(samples); }
+        /* Size of the element built from event - record lengths may differ
+         * between groups */
+        static size_t size(const EventType& event) { return size((event.size - (2 + event.extras)) << 1); }
+        size_t bytes() const { return size(waveform.num_samples); }
         H5::CompType h5type() const
         {
             H5::CompType datatype(size(waveform.num_samples));
@@ -250,6 +288,290 @@ namespace Data {
     static_assert(std::is_pod<DPPQDCWaveformElement<Data::ListElement422> >::value, "Data::DPPQDCWaveformElement<Data::ListElement422> > must be POD");
     static_assert(std::is_pod<DPPQDCWaveformElement<Data::ListElement8222> >::value, "Data::DPPQDCWaveformElement<Data::ListElement8222> > must be POD");
 
+    /* A DPP-QDC waveform element with the mixed-mode sample words copied as
+     * read out - two 12 bit samples and their digital probes per word. The
+     * samples and probe intervals are decoded by the reader library
+     * (jadaq_unpack) to the layout of DPPQDCWaveformElement. */
+    template <typename ListElementType>
+    struct __attribute__ ((__packed__)) DPPQDCRawWaveformElement
+    {
+        typedef DPPQDCEventWaveform<typename ListElementType::EventType> EventType;
+        ListElementType listElement;
+        uint16_t num_samples;
+        uint32_t words[]; // num_samples / 2
+        DPPQDCRawWaveformElement() = default;
+        DPPQDCRawWaveformElement(const EventType& event, uint16_t group)
+                : listElement(event,group)
+        {
+            const size_t count = event.size - (2 + event.extras);
+            num_samples = (uint16_t)(count << 1);
+            memcpy(words, event.ptr + 1, count * sizeof(uint32_t));
+        }
+        bool operator< (const DPPQDCRawWaveformElement& rhs) const
+        { return listElement < rhs.listElement; }
+        static constexpr unsigned timeBits = ListElementType::timeBits;
+        uint64_t timeStamp() const { return listElement.timeStamp(); }
+        void printOn(std::ostream& os) const
+        {
+            listElement.printOn(os); os << " " << PRINTD(num_samples);
+            std::ios::fmtflags flags = os.flags();
+            for (uint16_t i = 0; i < num_samples / 2; ++i)
+                os << " " << std::hex << std::setw(8) << std::setfill('0') << words[i];
+            os.flags(flags);
+            os << std::setfill(' ');
+        }
+        static void headerOn(std::ostream& os)
+        {
+            ListElementType::headerOn(os);
+            os << " " << PRINTH(num_samples) << " " << "words";
+        }
+        static ElementType type() { return (ElementType)(RawBase | WaveformBase | ListElementType::type()); }
+        void insertMembers(H5::CompType& datatype) const
+        {
+            listElement.insertMembers(datatype);
+            datatype.insertMember("num_samples", offsetof(DPPQDCRawWaveformElement, num_samples), H5::PredType::NATIVE_UINT16);
+            const hsize_t n[1] = {(hsize_t)(num_samples / 2)};
+            datatype.insertMember("words", offsetof(DPPQDCRawWaveformElement, words), H5::ArrayType(H5::PredType::NATIVE_UINT32,1,n));
+        }
+        static size_t size(size_t samples) { return ListElementType::size() + sizeof(uint16_t) + sizeof(uint16_t)*samples; }
+        H5::CompType h5type() const
+        {
+            H5::CompType datatype(size(num_samples));
+            insertMembers(datatype);
+            return datatype;
+        }
+    };
+    static_assert(std::is_pod<DPPQDCRawWaveformElement<Data::ListElement422> >::value, "Data::DPPQDCRawWaveformElement<Data::ListElement422> > must be POD");
+    static_assert(std::is_pod<DPPQDCRawWaveformElement<Data::ListElement8222> >::value, "Data::DPPQDCRawWaveformElement<Data::ListElement8222> > must be POD");
+
+    /* One member hit of a CoincidenceElement */
+    struct __attribute__ ((__packed__)) CoincidenceHit
+    {
+        int32_t dt; // clock ticks relative to the coincidence time
+        uint16_t digitizer; // low 16 bits of the digitizer ID
+        uint16_t channel;
+        uint16_t charge;
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(digitizer) << " " << PRINTD(channel) << " " << PRINTD(dt) << " " << PRINTD(charge);
+        }
+        static void insertMembers(H5::CompType& datatype, size_t offset)
+        {
+            datatype.insertMember("dt", HOFFSET(CoincidenceHit, dt) + offset, H5::PredType::NATIVE_INT32);
+            datatype.insertMember("digitizer", HOFFSET(CoincidenceHit, digitizer) + offset, H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("channel", HOFFSET(CoincidenceHit, channel) + offset, H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("charge", HOFFSET(CoincidenceHit, charge) + offset, H5::PredType::NATIVE_UINT16);
+        }
+        static H5::CompType h5type()
+        {
+            H5::CompType datatype(sizeof(CoincidenceHit));
+            insertMembers(datatype, 0);
+            return datatype;
+        }
+    };
+    static_assert(std::is_pod<CoincidenceHit>::value, "Data::CoincidenceHit must be POD");
+
+    /* Hits within a coincidence window. Room for max_hits hits is reserved in
+     * every element - multiplicity can be larger if hits were left out. */
+    struct __attribute__ ((__packed__)) CoincidenceElement
+    {
+        uint64_t time; // unwrapped time of the first hit, board offset applied
+        uint16_t multiplicity;
+        uint16_t num_hits;
+        uint16_t max_hits;
+        CoincidenceHit hits[];
+        static constexpr unsigned timeBits = 64;
+        uint64_t timeStamp() const { return time; }
+        bool operator< (const CoincidenceElement& rhs) const
+        {
+            return time < rhs.time;
+        };
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(time) << " " << PRINTD(multiplicity) << " " << PRINTD(num_hits);
+            for (uint16_t i = 0; i < num_hits; ++i)
+            {
+                os << " ";
+                hits[i].printOn(os);
+            }
+        }
+        static void headerOn(std::ostream& os)
+        {
+            os << PRINTH(time) << " " << PRINTH(multiplicity) << " " << PRINTH(num_hits) << " " << "hits";
+        }
+        static ElementType type() { return Coincidence; }
+        void insertMembers(H5::CompType& datatype) const
+        {
+            datatype.insertMember("time", HOFFSET(CoincidenceElement, time), H5::PredType::NATIVE_UINT64);
+            datatype.insertMember("multiplicity", HOFFSET(CoincidenceElement, multiplicity), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("num_hits", HOFFSET(CoincidenceElement, num_hits), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("max_hits", HOFFSET(CoincidenceElement, max_hits), H5::PredType::NATIVE_UINT16);
+            const hsize_t n[1] = {max_hits};
+            datatype.insertMember("hits", HOFFSET(CoincidenceElement, hits), H5::ArrayType(CoincidenceHit::h5type(),1,n));
+        }
+        static size_t size(size_t maxHits) { return sizeof(CoincidenceElement) + sizeof(CoincidenceHit)*maxHits; }
+        H5::CompType h5type() const
+        {
+            H5::CompType datatype(size(max_hits));
+            insertMembers(datatype);
+            return datatype;
+        }
+    };
+    static_assert(std::is_pod<CoincidenceElement>::value, "Data::CoincidenceElement must be POD");
+
+    /* Pulse features of a waveform - see WaveformFeatures.hpp */
+    struct __attribute__ ((__packed__)) FeatureElement
+    {
+        uint64_t time; // unwrapped board time
+        uint16_t channel;
+        uint16_t charge; // from the DPP firmware, 0 for standard firmware
+        uint16_t baseline;
+        uint16_t amplitude; // above the baseline
+        uint16_t peak; // sample of the peak
+        uint16_t rise; // rise time in 1/16 samples
+        int32_t integral; // baseline subtracted sum over the gate
+        static constexpr unsigned timeBits = 64;
+        uint64_t timeStamp() const { return time; }
+        bool operator< (const FeatureElement& rhs) const
+        {
+            return time < rhs.time || (time == rhs.time && channel < rhs.channel) ;
+        };
+        void printOn(std::ostream& os) const
+        {
+            os << PRINTD(channel) << " " << PRINTD(time) << " " << PRINTD(charge) << " " << PRINTD(baseline)
+               << " " << PRINTD(amplitude) << " " << PRINTD(peak) << " " << PRINTD(rise) << " " << PRINTD(integral);
+        }
+        static void headerOn(std::ostream& os)
+        {
+            os << PRINTH(channel) << " " << PRINTH(time) << " " << PRINTH(charge) << " " << PRINTH(baseline)
+               << " " << PRINTH(amplitude) << " " << PRINTH(peak) << " " << PRINTH(rise) << " " << PRINTH(integral);
+        }
+        static ElementType type() { return Features; }
+        static void insertMembers(H5::CompType& datatype)
+        {
+            datatype.insertMember("time", HOFFSET(FeatureElement, time), H5::PredType::NATIVE_UINT64);
+            datatype.insertMember("channel", HOFFSET(FeatureElement, channel), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("charge", HOFFSET(FeatureElement, charge), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("baseline", HOFFSET(FeatureElement, baseline), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("amplitude", HOFFSET(FeatureElement, amplitude), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("peak", HOFFSET(FeatureElement, peak), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("rise", HOFFSET(FeatureElement, rise), H5::PredType::NATIVE_UINT16);
+            datatype.insertMember("integral", HOFFSET(FeatureElement, integral), H5::PredType::NATIVE_INT32);
+        }
+        static size_t size() { return sizeof(FeatureElement); }
+        static size_t size(size_t) { return size(); }
+        static H5::CompType h5type()
+        {
+            H5::CompType datatype(size());
+            insertMembers(datatype);
+            return datatype;
+        }
+    };
+    static_assert(std::is_pod<FeatureElement>::value, "Data::FeatureElement must be POD");
+
+    /* Layout of the elements of a packed type: the bytes before the samples
+     * are kept as they are and num_samples is at countOffset. Returns false
+     * for types that are not packed. */
+    static inline bool packedLayout(uint16_t type, size_t& fixed, size_t& countOffset)
+    {
+        switch (type)
+        {
+        case PackedStandard:
+            countOffset = offsetof(StdElement751, waveform);
+            fixed = countOffset + sizeof(StdWaveform);
+            return true;
+        case PackedWaveform422:
+            countOffset = sizeof(ListElement422);
+            fixed = countOffset + sizeof(DPPQDCWaveform);
+            return true;
+        case PackedWaveform8222:
+            countOffset = sizeof(ListElement8222);
+            fixed = countOffset + sizeof(DPPQDCWaveform);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /* Size of the list element in front of the sample words of a raw type */
+    static inline bool rawLayout(uint16_t type, size_t& list)
+    {
+        switch (type)
+        {
+        case RawWaveform422:
+            list = sizeof(ListElement422);
+            return true;
+        case RawWaveform8222:
+            list = sizeof(ListElement8222);
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    /* The packed type of an element type, None if it has no samples to pack */
+    static inline ElementType packedType(ElementType type)
+    {
+        switch (type)
+        {
+        case Standard:
+        case Waveform422:
+        case Waveform8222:
+            return (ElementType)(PackedBase | type);
+        default:
+            return None;
+        }
+    }
+
+    /* Name of an element type, used for the datasets of the indexed HDF5 layout */
+    static inline std::string typeName(uint16_t type)
+    {
+        std::string name;
+        if (type & RecordsBase)
+            name += "Records";
+        if (type & PackedBase)
+            name += "Packed";
+        if (type & RawBase)
+            name += "Raw";
+        if (type & WaveformBase)
+            name += "Waveform";
+        switch (type & 0xFF)
+        {
+        case List422:
+            return name + (type & WaveformBase ? "422" : "List422");
+        case List8222:
+            return name + (type & WaveformBase ? "8222" : "List8222");
+        case Standard:
+            return name + "Standard";
+        case Coincidence:
+            return name + "Coincidence";
+        case Features:
+            return name + "Features";
+        default:
+            return "Type" + std::to_string(type);
+        }
+    }
+
+    /* The sample (hit) count of an element, which sets its size */
+    template <typename E>
+    static inline void setCount(E&, size_t) {}
+    static inline void setCount(StdElement751& e, size_t n) { e.waveform.num_samples = (uint16_t)n; }
+    template <typename L>
+    static inline void setCount(DPPQDCWaveformElement<L>& e, size_t n) { e.waveform.num_samples = (uint16_t)n; }
+    template <typename L>
+    static inline void setCount(DPPQDCRawWaveformElement<L>& e, size_t n) { e.num_samples = (uint16_t)n; }
+    static inline void setCount(CoincidenceElement& e, size_t n) { e.max_hits = (uint16_t)n; }
+
+    /* HDF5 type of the elements of E::size(n) bytes, without one at hand */
+    template <typename E>
+    static inline H5::CompType h5type(size_t n)
+    {
+        std::vector<char> blank(E::size(n), 0);
+        E& e = *reinterpret_cast<E*>(blank.data());
+        setCount(e, n);
+        return e.h5type();
+    }
+
 static constexpr const size_t maxBufferSize = JUMBO_PAYLOAD - (UDP_HEADER + IP_HEADER);
 
 } // namespace Data
@@ -263,5 +585,13 @@ static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCWave
 { e.printOn(os); return os; }
 static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCWaveformElement<Data::ListElement8222>& e)
 { e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCRawWaveformElement<Data::ListElement422>& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::DPPQDCRawWaveformElement<Data::ListElement8222>& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::CoincidenceElement& e)
+{ e.printOn(os); return os; }
+static inline std::ostream& operator<< (std::ostream& os, const Data::FeatureElement& e)
+{ e.printOn(os); return os; }
 
 #endif // JADAQ_DATAFORMAT_HPP
@@ -27,17 +27,61 @@
 
 #include "DataFormat.hpp"
 #include "DataWriter.hpp"
+#include "EventFilter.hpp"
 #include "EventIterator.hpp"
+#include "LatencyHistogram.hpp"
+#include "TimeSorter.hpp"
+#include "WaveformWindow.hpp"
 #include "container.hpp"
+#include "timer.h"
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
 
 class DataHandler {
 public:
     template<typename E>
-    void initialize(DataWriter& dataWriter, uint32_t digitizerID, size_t groups, size_t samples, const uint32_t* maxJitter)
+    void initialize(DataWriter& dataWriter, uint32_t digitizerID, size_t groups, size_t samples, const uint32_t* maxJitter,
+                    StageLatency* latency = nullptr)
     {
-        instance.reset(new Implementation<E>(dataWriter,digitizerID,groups,samples,maxJitter));
+        const WaveformWindow* activeWindow = (window && !window->empty()) ? window : nullptr;
+        if (activeWindow && !QDCWaveform<E>::value) {
+            XTRACE(DATAH, WAR, "Waveform windows only apply to DPP-QDC waveforms - ignored");
+            activeWindow = nullptr;
+        }
+        EventFilter* activeFilter = (filter && !filter->empty()) ? filter : nullptr;
+        if (activeFilter && !Filterable<typename E::EventType>::value)
+            throw std::runtime_error("Event filters need DPP-QDC list data");
+        if (activeFilter && activeFilter->needsBaseline() && !Filterable<typename E::EventType>::baseline)
+            throw std::runtime_error("Baseline filters need the extras word (EXTRAS=1)");
+        if (records && !QDCWaveform<E>::value)
+            XTRACE(DATAH, WAR, "Variable length records only apply to DPP-QDC waveforms - ignored");
+        if (records)
+            create<E>(QDCWaveform<E>(), dataWriter, digitizerID, groups, samples, maxJitter, latency,
+                      activeFilter, activeWindow);
+        else
+            create<E>(std::false_type(), dataWriter, digitizerID, groups, samples, maxJitter, latency,
+                      activeFilter, activeWindow);
     }
+    /* Emit events in time order, reordering within window clock ticks.
+     * Takes effect at the next initialize(). Zero disables sorting. */
+    void setSortWindow(uint64_t window) { sortWindow = window; }
+    /* Write sorted events held for msecs even if their buffer is not full,
+     * so a downstream merger does not take the board for quiet. Takes effect
+     * at the next initialize(). Zero holds them until the buffer is full. */
+    void setSortHold(int64_t msecs) { sortHold = msecs; }
+    /* Drop the events failing filter before they are buffered - must outlive
+     * this. Takes effect at the next initialize(). */
+    void setFilter(EventFilter* filter_) { filter = filter_; }
+    /* Cut waveforms to window - must outlive this. Takes effect at the next
+     * initialize(). */
+    void setWindow(const WaveformWindow* window_) { window = window_; }
+    /* Store waveforms as variable length records (jadaq::records), so a
+     * buffer holds as many as their actual sizes allow. Takes effect at the
+     * next initialize(). */
+    void setRecords(bool records_) { records = records_; }
     void flush() { instance->flush(); }
     size_t operator()(DataBlockBaseIterator& it) { return instance->operator()(it); }
     static int64_t getTimeMsecs()
@@ -46,6 +90,156 @@ public:
                 std::chrono::system_clock::now().time_since_epoch()).count();
     }
 private:
+    uint64_t sortWindow = 0;
+    int64_t sortHold = 0;
+    EventFilter* filter = nullptr;
+    const WaveformWindow* window = nullptr;
+    bool records = false;
+
+    template <typename E, typename... Args>
+    void create(std::true_type, Args&&... args) { instantiate<E, jadaq::records<E>>(args...); }
+    template <typename E, typename... Args>
+    void create(std::false_type, Args&&... args) { instantiate<E, jadaq::buffer<E>>(args...); }
+    template <typename E, typename C>
+    void instantiate(DataWriter& dataWriter, uint32_t digitizerID, size_t groups, size_t samples,
+                     const uint32_t* maxJitter, StageLatency* latency, EventFilter* filter,
+                     const WaveformWindow* window)
+    {
+        const size_t stored = window ? window->samples(samples) : samples;
+        if (C::stride(E::size(stored)) > dataWriter.bufferSize() - sizeof(Data::Header))
+            throw std::runtime_error("Writer buffer size can not hold a single event");
+        dataWriter.addDigitizer<C>(digitizerID, stored);
+        if (sortWindow > 0)
+            instance.reset(new SortedImplementation<E,C>(dataWriter,digitizerID,groups,samples,sortWindow,sortHold,latency,filter,window));
+        else
+            instance.reset(new Implementation<E,C>(dataWriter,digitizerID,groups,samples,maxJitter,latency,filter,window));
+    }
+
+    /* Build the element of event in either kind of container - false if it
+     * is full */
+    template <typename E>
+    static bool emplace(jadaq::buffer<E>& buffer, const typename E::EventType& event, uint16_t group)
+    {
+        if (buffer.full())
+            return false;
+        buffer.emplace_back(event, group);
+        return true;
+    }
+    template <typename E>
+    static bool emplace(jadaq::records<E>& records, const typename E::EventType& event, uint16_t group)
+    {
+        return records.emplace_back(E::size(event), event, group);
+    }
+
+    /* Events with the values the filter looks at */
+    template <typename T, bool = std::is_base_of<DPPQDCEvent, T>::value>
+    struct Filterable {
+        static constexpr const bool value = false;
+        static constexpr const bool baseline = false;
+    };
+    template <typename T>
+    struct Filterable<T, true> {
+        static constexpr const bool value = true;
+        static constexpr const bool baseline = T::extras;
+    };
+    template <typename T>
+    static uint16_t baseline(const T& event, std::true_type) { return event.baseline(); }
+    template <typename T>
+    static uint16_t baseline(const T&, std::false_type) { return 0; }
+
+    /* Call handle(event, group) for every event in the block that passes the
+     * filter. Events are decoded a batch at a time into the filter's struct of
+     * arrays, filtered, and then handled. Returns the number decoded. */
+    template <typename EventType, typename F>
+    static size_t decode(DataBlockBaseIterator& it, EventFilter* filter, F handle, std::true_type)
+    {
+        if (!filter)
+            return decode<EventType>(it, filter, handle, std::false_type());
+        EventFilter::Batch batch;
+        uint32_t* ptr[EventFilter::batchSize];
+        size_t size[EventFilter::batchSize];
+        uint16_t group[EventFilter::batchSize];
+        size_t events = 0;
+        while (it != it.end())
+        {
+            size_t n = 0;
+            for (; it != it.end() && n < EventFilter::batchSize; ++it, ++n)
+            {
+                EventType event = it.event<EventType>();
+                ptr[n] = event.ptr;
+                size[n] = event.size;
+                group[n] = it.group();
+                batch.channel[n] = event.channel(group[n]);
+                batch.charge[n] = event.charge();
+                batch.baseline[n] = baseline(event, std::integral_constant<bool, EventType::extras>());
+            }
+            events += n;
+            (*filter)(batch, n);
+            /* compacted first - a branch on keep would mispredict */
+            uint16_t kept[EventFilter::batchSize];
+            size_t k = 0;
+            for (size_t i = 0; i < n; ++i)
+            {
+                kept[k] = (uint16_t)i;
+                k += batch.keep[i];
+            }
+            for (size_t j = 0; j < k; ++j)
+            {
+                EventType event{ptr[kept[j]], size[kept[j]]};
+                handle(event, group[kept[j]]);
+            }
+        }
+        return events;
+    }
+    template <typename EventType, typename F>
+    static size_t decode(DataBlockBaseIterator& it, EventFilter*, F handle, std::false_type)
+    {
+        size_t events = 0;
+        for (;it != it.end(); ++it)
+        {
+            events += 1;
+            EventType event = it.event<EventType>();
+            handle(event, it.group());
+        }
+        return events;
+    }
+    template <typename EventType, typename F>
+    static size_t decode(DataBlockBaseIterator& it, EventFilter* filter, F handle)
+    {
+        return decode<EventType>(it, filter, handle,
+                                 std::integral_constant<bool, Filterable<EventType>::value>());
+    }
+
+    /* The elements cut to windows and stored as records */
+    template <typename E>
+    struct QDCWaveform : std::false_type {};
+    template <typename L>
+    struct QDCWaveform<Data::DPPQDCWaveformElement<L>> : std::true_type {};
+
+    /* Builds elements with their waveform cut to the window. The event is
+     * decoded in full to a scratch element first, as a buffered element only
+     * has room for the window. */
+    template <typename E>
+    class Cutter {
+    private:
+        const WaveformWindow* window;
+        std::vector<char> scratch;
+        void cut(E& e, std::true_type) { (*window)(e.listElement.channel, e.waveform); }
+        void cut(E&, std::false_type) {}
+    public:
+        /* window is nullptr unless waveforms are cut */
+        Cutter(const WaveformWindow* window_, size_t samples)
+            : window(window_), scratch(window_ ? E::size(samples) : 0) {}
+        explicit operator bool() const { return window != nullptr; }
+        size_t samples(size_t n) const { return window ? window->samples(n) : n; }
+        const E& operator()(const typename E::EventType& event, uint16_t group)
+        {
+            E* e = new (scratch.data()) E(event, group);
+            cut(*e, QDCWaveform<E>());
+            return *e;
+        }
+    };
+
     struct Interface
     {
         virtual ~Interface() = default;
@@ -53,9 +247,9 @@ private:
         virtual void flush() = 0;
     };
     /* E is element type e.g. Data::ListElementxxx
-     * C is containertype i.e. jadaq::vector, jadaq::set, jadaq::buffer
+     * C is containertype i.e. jadaq::buffer, jadaq::records
     */
-    template <typename E>
+    template <typename E, typename C>
     class Implementation: public Interface
     {
         static_assert(std::is_pod<E>::value, "E must be POD");
@@ -63,10 +257,15 @@ private:
         DataWriter& dataWriter;
         uint32_t digitizerID;
         const uint32_t* maxJitter;
+        StageLatency* latency; // nullptr unless latency is recorded
+        EventFilter* filter;   // nullptr unless filtering
+        Cutter<E> cut;
+        uint64_t writeTicks = 0;
+        std::shared_ptr<jadaq::pool<C>> pool;
 
     struct Buffer {
       size_t groups;
-      jadaq::buffer<E> *buffer;
+      C *buffer;
       uint32_t *maxLocalTime; // Array containing MaxLocalTime from the previous
                               // insertion needed to detect reset
       uint64_t globalTimeStamp = 0;
@@ -79,39 +278,64 @@ private:
       }
       Buffer(size_t numGroups) : groups(numGroups) {}
 
-      void malloc(DataWriter &dataWriter, size_t samples) {
-        buffer = new jadaq::buffer<E>(Data::maxBufferSize, E::size(samples),
-                                        sizeof(Data::Header));
+      void malloc(jadaq::pool<C> &pool) {
+        buffer = pool.acquire();
         maxLocalTime = new uint32_t[groups];
         clear();
       }
       void free() {
-        delete buffer;
+        buffer->release();
         delete[] maxLocalTime;
       }
 
     } previous, current, next;
 
+    /* Hand the buffer to the writer and continue in a fresh one */
+    void inline write(Buffer &buffer) {
+      if (latency) {
+        uint64_t start = TSCTimer::rdtsc();
+        dataWriter(buffer.buffer, digitizerID, buffer.globalTimeStamp);
+        uint64_t ticks = TSCTimer::rdtsc() - start;
+        latency->write.record(ticks);
+        writeTicks += ticks;
+      } else {
+        dataWriter(buffer.buffer, digitizerID, buffer.globalTimeStamp);
+      }
+      buffer.buffer->release();
+      buffer.buffer = pool->acquire();
+    }
+
     void inline store(Buffer &buffer, typename E::EventType &event,
                       uint16_t group) {
       buffer.maxLocalTime[group] = event.timeTag();
-      try {
-        buffer.buffer->emplace_back(event, group);
-      } catch (std::length_error &) {
-        dataWriter(buffer.buffer, digitizerID, buffer.globalTimeStamp);
-        buffer.buffer->clear();
-        buffer.buffer->emplace_back(event, group);
+      if (cut) {
+        const E &element = cut(event, group);
+        if (!jadaq::append(*buffer.buffer, element)) {
+          write(buffer);
+          jadaq::append(*buffer.buffer, element);
+        }
+        return;
+      }
+      if (!emplace(*buffer.buffer, event, group)) {
+        write(buffer);
+        emplace(*buffer.buffer, event, group);
       }
     }
 
   public:
     Implementation(DataWriter &dw, uint32_t digID, size_t groups,
-                   size_t samples, const uint32_t *jitter)
+                   size_t samples, const uint32_t *jitter,
+                   StageLatency *latency_, EventFilter *filter_,
+                   const WaveformWindow *window)
         : dataWriter(dw), digitizerID(digID), maxJitter(jitter),
+          latency(latency_), filter(filter_), cut(window, samples),
+          pool(jadaq::pool<C>::create(dataWriter.bufferSize(),
+                                      E::size(cut.samples(samples)),
+                                      sizeof(Data::Header), 4)),
           previous(groups), current(groups), next(groups) {
-      previous.malloc(dataWriter, samples);
-      current.malloc(dataWriter, samples);
-      next.malloc(dataWriter, samples);
+      previous.malloc(*pool);
+      current.malloc(*pool);
+      next.malloc(*pool);
       previous.globalTimeStamp = DataHandler::getTimeMsecs();
       current.globalTimeStamp = DataHandler::getTimeMsecs();
     }
@@ -122,55 +346,174 @@ private:
       next.free();
     }
 
-      size_t operator()(DataBlockBaseIterator& eventIterator)
-        {
-            size_t events = 0;
-            for (;eventIterator != eventIterator.end(); ++eventIterator)
-            {
-                events += 1;
-                typename E::EventType event = eventIterator.event<typename E::EventType>();
-                uint16_t group = eventIterator.group();
-                XTRACE(DATAH, DEB, "Digitizer: %d_%d, time: 0x%04x", digitizerID>>16, digitizerID & 0xFFFF, event.timeTag());
-                if (current.maxLocalTime[group] < event.timeTag() + maxJitter[group]) {
-                  if (current.maxLocalTime[group] > 0 ||
-                      previous.maxLocalTime[group] == 0 ||
-                      previous.maxLocalTime[group] >=
-                      event.timeTag() + maxJitter[group]) {
-                    store(current, event, group);
-                  } else {
-                    store(previous, event, group);
-                  }
-                } else {
-                  if (next.globalTimeStamp == 0) {
-                    next.globalTimeStamp = DataHandler::getTimeMsecs();
-                  }
-                  store(next, event, group);
+    /* Put the event in the buffer of the time window it belongs to */
+    void inline place(typename E::EventType &event, uint16_t group) {
+      XTRACE(DATAH, DEB, "Digitizer: %d_%d, time: 0x%04x", digitizerID>>16, digitizerID & 0xFFFF, event.timeTag());
+      if (current.maxLocalTime[group] < event.timeTag() + maxJitter[group]) {
+        if (current.maxLocalTime[group] > 0 ||
+            previous.maxLocalTime[group] == 0 ||
+            previous.maxLocalTime[group] >=
+            event.timeTag() + maxJitter[group]) {
+          store(current, event, group);
+        } else {
+          store(previous, event, group);
+        }
+      } else {
+        if (next.globalTimeStamp == 0) {
+          next.globalTimeStamp = DataHandler::getTimeMsecs();
         }
+        store(next, event, group);
       }
+    }
+
+      size_t operator()(DataBlockBaseIterator& eventIterator)
+        {
+            uint64_t start = latency ? TSCTimer::rdtsc() : 0;
+            writeTicks = 0;
+            size_t events = decode<typename E::EventType>(eventIterator, filter,
+                [this](typename E::EventType &event, uint16_t group) { place(event, group); });
+      uint64_t decoded = latency ? TSCTimer::rdtsc() : 0;
+      uint64_t decodeWriteTicks = writeTicks;
       if (!next.buffer->empty()) {
         if (previous.buffer->size() > 0) {
-          dataWriter(previous.buffer, digitizerID, previous.globalTimeStamp);
+          write(previous);
         }
         previous.clear();
         std::swap(current, previous);
         std::swap(next, current);
       }
+      if (latency) {
+        latency->decode.record(decoded - start - decodeWriteTicks);
+        latency->buffer.record(TSCTimer::rdtsc() - decoded -
+                               (writeTicks - decodeWriteTicks));
+      }
       XTRACE(DATAH, DEB, "events parsed %d", events);
       return events;
     }
 
     void flush() {
       if (previous.buffer->size() > 0) {
-        dataWriter(previous.buffer, digitizerID, previous.globalTimeStamp);
+        write(previous);
         previous.clear();
       }
       if (current.buffer->size() > 0) {
-        dataWriter(current.buffer, digitizerID, current.globalTimeStamp);
+        write(current);
         current.clear();
       }
       assert(next.buffer->size() == 0);
     }
   };
+
+  /* Events are time sorted by a TimeSorter before being buffered. Like the
+   * unsorted buffers, a buffer is written when full, when the board time
+   * rolls over or when held for the sort hold - so a slow trickle through the
+   * window does not give a buffer (a packet table) per readout. */
+  template <typename E, typename C>
+  class SortedImplementation: public Interface
+  {
+    static_assert(std::is_pod<E>::value, "E must be POD");
+  private:
+    DataWriter& dataWriter;
+    uint32_t digitizerID;
+    StageLatency* latency; // nullptr unless latency is recorded
+    EventFilter* filter;   // nullptr unless filtering
+    Cutter<E> cut;
+    uint64_t writeTicks = 0;
+    TimeSorter<E> sorter;
+    std::shared_ptr<jadaq::pool<C>> pool;
+    C *buffer;
+    uint64_t globalTimeStamp = 0;
+    uint64_t period = 0; // of the board time rollover, in the buffer
+    int64_t hold;
+    uint64_t late = 0;
+    uint64_t overflows = 0;
+    /* The time tag of the board rolls over at 32 bits at most */
+    static constexpr const unsigned rolloverBits = E::timeBits < 32 ? E::timeBits : 32;
+
+    void write() {
+      if (latency) {
+        uint64_t start = TSCTimer::rdtsc();
+        dataWriter(buffer, digitizerID, globalTimeStamp);
+        uint64_t ticks = TSCTimer::rdtsc() - start;
+        latency->write.record(ticks);
+        writeTicks += ticks;
+      } else {
+        dataWriter(buffer, digitizerID, globalTimeStamp);
+      }
+      buffer->release();
+      buffer = pool->acquire();
+    }
+
+    void store(const E &element, uint64_t time) {
+      if (!buffer->empty() && (time >> rolloverBits) != period)
+        write();
+      if (buffer->empty()) {
+        globalTimeStamp = DataHandler::getTimeMsecs();
+        period = time >> rolloverBits;
+      }
+      if (!jadaq::append(*buffer, element)) {
+        write();
+        globalTimeStamp = DataHandler::getTimeMsecs();
+        jadaq::append(*buffer, element);
+      }
+    }
+
+    void emit(bool all) {
+      sorter.emit([this](const E &element, uint64_t time) { store(element, time); }, all);
+      if (!buffer->empty() &&
+          (all || (hold > 0 && DataHandler::getTimeMsecs() - (int64_t)globalTimeStamp >= hold)))
+        write();
+      if (sorter.late() != late) {
+        if (late == 0)
+          XTRACE(DATAH, WAR, "Events arriving later than the sort window - output is not strictly ordered");
+        XTRACE(DATAH, INF, "%d events arrived later than the sort window", sorter.late() - late);
+        late = sorter.late();
+      }
+      if (sorter.overflows() != overflows) {
+        XTRACE(DATAH, WAR, "Sort staging full - events written without waiting for the window");
+        overflows = sorter.overflows();
+      }
+    }
+
+  public:
+    SortedImplementation(DataWriter &dw, uint32_t digID, size_t groups,
+                         size_t samples, uint64_t window, int64_t hold_, StageLatency *latency_,
+                         EventFilter *filter_, const WaveformWindow *waveformWindow)
+        : dataWriter(dw), digitizerID(digID), latency(latency_), filter(filter_),
+          cut(waveformWindow, samples),
+          sorter(E::size(cut.samples(samples)), window),
+          pool(jadaq::pool<C>::create(dataWriter.bufferSize(),
+                                      E::size(cut.samples(samples)),
+                                      sizeof(Data::Header), 2)),
+          buffer(pool->acquire()), hold(hold_) {}
+    ~SortedImplementation() {
+      flush();
+      buffer->release();
+    }
+
+    size_t operator()(DataBlockBaseIterator& eventIterator)
+    {
+      uint64_t start = latency ? TSCTimer::rdtsc() : 0;
+      writeTicks = 0;
+      size_t events = decode<typename E::EventType>(eventIterator, filter,
+          [this](typename E::EventType &event, uint16_t group) {
+            if (cut)
+              sorter.push(cut(event, group));
+            else
+              sorter.add(event, group);
+          });
+      uint64_t decoded = latency ? TSCTimer::rdtsc() : 0;
+      emit(false);
+      if (latency) {
+        latency->decode.record(decoded - start);
+        latency->buffer.record(TSCTimer::rdtsc() - decoded - writeTicks);
+      }
+      XTRACE(DATAH, DEB, "events parsed %d", events);
+      return events;
+    }
+
+    void flush() { emit(true); }
+  };
   std::unique_ptr<Interface> instance;
 };
 
@@ -28,6 +28,7 @@
 #include "DataFormat.hpp"
 #include "container.hpp"
 #include <cstdint>
+#include <memory>
 
 class DataWriter {
 public:
@@ -37,16 +38,24 @@ public:
     return *this;
   }
 
-  void addDigitizer(uint32_t digitizerID) {
-    instance->addDigitizer(digitizerID);
+  /* The digitizer writes buffers of type C, of elements of
+   * C::value_type::size(n) bytes - before the first one, so a writer can
+   * lay out its output up front */
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t n) {
+    instance->addDigitizer(static_cast<const C *>(nullptr), digitizerID, n);
   }
 
   void split(const std::string& id) {
     instance->split(id);
   }
 
-  template <typename E>
-  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID,
+  /* Bytes of the buffers handed to this writer - header included */
+  size_t bufferSize() const { return instance->bufferSize(); }
+
+  /* The buffer is reused once this returns - a writer that needs the data
+   * longer copies it */
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
                   uint64_t globalTimeStamp) {
     //XTRACE(UDP, DEB, "DataWriter op()");
     instance->operator()(buffer, digitizerID, globalTimeStamp);
@@ -56,23 +65,62 @@ private:
     struct Concept
     {
         virtual ~Concept() = default;
-        virtual void addDigitizer(uint32_t digitizerID) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::ListElement422>*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::ListElement8222>*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::StdElement751>*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement422> >*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement422> >*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement8222> >*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::CoincidenceElement>*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::buffer<Data::FeatureElement>*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement422> >*, uint32_t digitizerID, size_t n) = 0;
+        virtual void addDigitizer(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement8222> >*, uint32_t digitizerID, size_t n) = 0;
         virtual void split(const std::string& id) = 0;
+        virtual size_t bufferSize() const = 0;
         virtual void operator()(const jadaq::buffer<Data::ListElement422>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
         virtual void operator()(const jadaq::buffer<Data::ListElement8222>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
         virtual void operator()(const jadaq::buffer<Data::StdElement751>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
         virtual void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
         virtual void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::CoincidenceElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::buffer<Data::FeatureElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
+        virtual void operator()(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) = 0;
     };
     template <typename DW>
     struct Model : Concept
     {
         explicit Model(DW* value) : val(value) {}
         ~Model() { delete val; }
-        void addDigitizer(uint32_t digitizerID) override
-        { val->addDigitizer(digitizerID); }
+        void addDigitizer(const jadaq::buffer<Data::ListElement422>*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::ListElement422>>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::ListElement8222>*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::ListElement8222>>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::StdElement751>*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::StdElement751>>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement422> >*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement422> >>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement422> >*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement422> >>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement8222> >*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement8222> >>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::CoincidenceElement>*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::CoincidenceElement>>(digitizerID, n); }
+        void addDigitizer(const jadaq::buffer<Data::FeatureElement>*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::buffer<Data::FeatureElement>>(digitizerID, n); }
+        void addDigitizer(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement422> >*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement422> >>(digitizerID, n); }
+        void addDigitizer(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement8222> >*, uint32_t digitizerID, size_t n) final
+        { val->template addDigitizer<jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement8222> >>(digitizerID, n); }
         void split(const std::string& id) override
         { return val->split(id); }
+        size_t bufferSize() const override
+        { return val->bufferSize(); }
         void operator()(const jadaq::buffer<Data::ListElement422>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
         { val->operator()(buffer,digitizerID,globalTimeStamp); }
         void operator()(const jadaq::buffer<Data::ListElement8222>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
@@ -83,6 +131,18 @@ private:
         { val->operator()(buffer,digitizerID,globalTimeStamp); }
         void operator()(const jadaq::buffer<Data::DPPQDCWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
         { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::DPPQDCRawWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::CoincidenceElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::buffer<Data::FeatureElement>* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement422> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
+        void operator()(const jadaq::records<Data::DPPQDCWaveformElement<Data::ListElement8222> >* buffer, uint32_t digitizerID, uint64_t globalTimeStamp) final
+        { val->operator()(buffer,digitizerID,globalTimeStamp); }
         DW* val;
     };
 
@@ -90,12 +150,15 @@ private:
 };
 
 class DataWriterNull {
+private:
+  size_t bufferSize_;
 public:
-  DataWriterNull() = default;
-  void addDigitizer(uint32_t) {}
+  explicit DataWriterNull(size_t bufferSize = Data::maxBufferSize) : bufferSize_(bufferSize) {}
+  template <typename C> void addDigitizer(uint32_t, size_t) {}
   void split(const std::string&) { }
-  template <typename E>
-  void operator()(const jadaq::buffer<E> *, uint32_t, uint64_t) const {}
+  size_t bufferSize() const { return bufferSize_; }
+  template <typename C>
+  void operator()(const C *, uint32_t, uint64_t) const {}
 };
 
 #endif // JADAQ_DATAWRITERNULL_HPP
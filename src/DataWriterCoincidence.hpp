@@ -0,0 +1,256 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Build coincidence events from a time ordered stream of list data and pass
+ * them on to another DataWriter as Data::CoincidenceElement.
+ *
+ * A coincidence opens with a hit and collects the hits up to window clock
+ * ticks after it. Channels can be put in named groups; only channels in a
+ * group take part, and a coincidence is only written if it has a hit in
+ * every required group and its multiplicity is within the limits.
+ *
+ * The input must be time ordered - DataWriterMerger output for more than
+ * one digitizer.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERCOINCIDENCE_HPP
+#define JADAQ_DATAWRITERCOINCIDENCE_HPP
+
+#include "DataFormat.hpp"
+#include "DataWriter.hpp"
+#include "TimeSorter.hpp"
+#include "container.hpp"
+#include "xtrace.h"
+#include <cinttypes>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class DataWriterCoincidence {
+public:
+  /* Digitizer ID the coincidences are written with */
+  static constexpr const uint32_t outputID = 0;
+  static constexpr const size_t maxGroups = 32;
+
+  struct Channels {
+    uint32_t digitizerID;
+    int first;
+    int last;
+  };
+  struct Group {
+    std::string name;
+    bool required = false;
+    std::vector<Channels> channels;
+  };
+  struct Settings {
+    uint64_t window = 0; // clock ticks after the first hit
+    unsigned minMultiplicity = 1;
+    unsigned maxMultiplicity = 0xffff;
+    unsigned maxHits = 16; // hits stored per coincidence
+    std::vector<Group> groups; // without groups every channel takes part
+  };
+
+private:
+  typedef Data::CoincidenceElement Element;
+
+  struct Input {
+    TimeUnwrapper unwrap;
+    int64_t offset;
+    std::vector<int8_t> group; // per channel, -1 if in no group
+    Input(unsigned timeBits, int64_t offset_) : unwrap(timeBits), offset(offset_) {}
+  };
+
+  DataWriter output;
+  const Settings settings;
+  uint32_t required = 0; // mask of the required groups
+  std::map<uint32_t, int64_t> offsets;
+  std::map<uint32_t, Input> inputs;
+
+  std::vector<char> current; // the open coincidence
+  bool open = false;
+  int64_t start = 0;
+  uint32_t groupsHit = 0;
+  uint64_t openStamp = 0;
+
+  std::shared_ptr<jadaq::buffer_pool<Element>> pool;
+  jadaq::buffer<Element> *out;
+  uint64_t outStamp = 0;
+
+  uint64_t built = 0;
+  uint64_t written = 0;
+  uint64_t truncated = 0;
+  uint64_t ungrouped = 0;
+
+  Element &element() { return *reinterpret_cast<Element *>(current.data()); }
+
+  Input &input(uint32_t digitizerID, unsigned timeBits) {
+    auto itr = inputs.find(digitizerID);
+    if (itr != inputs.end())
+      return itr->second;
+    Input in(timeBits, offsets[digitizerID]);
+    if (settings.groups.empty()) {
+      in.group.assign(1 << 16, 0);
+    } else {
+      for (size_t g = 0; g < settings.groups.size(); ++g) {
+        for (const Channels &channels : settings.groups[g].channels) {
+          if (channels.digitizerID != digitizerID)
+            continue;
+          if ((int)in.group.size() <= channels.last)
+            in.group.resize(channels.last + 1, -1);
+          for (int c = channels.first; c <= channels.last; ++c)
+            in.group[c] = (int8_t)g;
+        }
+      }
+    }
+    return inputs.emplace(digitizerID, std::move(in)).first->second;
+  }
+
+  void write() {
+    if (out->empty())
+      return;
+    output(out, outputID, outStamp);
+    out->release();
+    out = pool->acquire();
+  }
+
+  void close() {
+    open = false;
+    ++built;
+    const Element &e = element();
+    if ((groupsHit & required) != required || e.multiplicity < settings.minMultiplicity ||
+        e.multiplicity > settings.maxMultiplicity)
+      return;
+    ++written;
+    if (e.num_hits < e.multiplicity)
+      ++truncated;
+    if (out->size() == out->capacity())
+      write();
+    if (out->empty())
+      outStamp = openStamp;
+    out->push_back(e);
+  }
+
+  void add(int64_t time, uint32_t digitizerID, uint16_t channel, uint16_t charge,
+           int group, uint64_t globalTimeStamp) {
+    if (open && time > start + (int64_t)settings.window)
+      close();
+    Element &e = element();
+    if (!open) {
+      open = true;
+      start = time;
+      groupsHit = 0;
+      openStamp = globalTimeStamp;
+      e.time = (uint64_t)time;
+      e.multiplicity = 0;
+      e.num_hits = 0;
+    }
+    if (e.num_hits < e.max_hits) {
+      Data::CoincidenceHit &hit = e.hits[e.num_hits++];
+      hit.dt = (int32_t)(time - start);
+      hit.digitizer = (uint16_t)digitizerID;
+      hit.channel = channel;
+      hit.charge = charge;
+    }
+    if (e.multiplicity < 0xffff)
+      ++e.multiplicity;
+    groupsHit |= 1u << group;
+  }
+
+  static const Data::ListElement422 &list(const Data::ListElement422 &e) { return e; }
+  static const Data::ListElement8222 &list(const Data::ListElement8222 &e) { return e; }
+  static const Data::FeatureElement &list(const Data::FeatureElement &e) { return e; }
+  template <typename L>
+  static const L &list(const Data::DPPQDCWaveformElement<L> &e) { return e.listElement; }
+  template <typename L>
+  static const L &list(const Data::DPPQDCRawWaveformElement<L> &e) { return e.listElement; }
+
+public:
+  DataWriterCoincidence(DataWriter &&output_, const Settings &settings_)
+      : output(std::move(output_)), settings(settings_),
+        current(Element::size(settings_.maxHits)) {
+    if (settings.groups.size() > maxGroups)
+      throw std::runtime_error("Too many coincidence groups");
+    if (Element::size(settings.maxHits) > output.bufferSize() - sizeof(Data::Header))
+      throw std::runtime_error("Coincidence MaxHits does not fit in an output buffer");
+    pool = jadaq::buffer_pool<Element>::create(output.bufferSize(), Element::size(settings.maxHits),
+                                               sizeof(Data::Header), 1);
+    out = pool->acquire();
+    for (size_t g = 0; g < settings.groups.size(); ++g) {
+      if (settings.groups[g].required)
+        required |= 1u << g;
+    }
+    element().max_hits = (uint16_t)settings.maxHits;
+    output.addDigitizer<jadaq::buffer<Element>>(outputID, settings.maxHits);
+  }
+  ~DataWriterCoincidence() {
+    if (open)
+      close();
+    write();
+    out->release();
+    XTRACE(DATAH, NOTE, "Coincidences built: %" PRIu64 ", written: %" PRIu64 ", truncated: %" PRIu64
+           ", hits outside groups: %" PRIu64,
+           built, written, truncated, ungrouped);
+  }
+
+  /* Board time offset in clock ticks */
+  void setTimeOffset(uint32_t digitizerID, int64_t offset) { offsets[digitizerID] = offset; }
+
+  /* Only coincidences are written - under outputID */
+  template <typename C> void addDigitizer(uint32_t, size_t) {}
+
+  void split(const std::string &id) {
+    write();
+    output.split(id);
+  }
+
+  size_t bufferSize() const { return output.bufferSize(); }
+
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    typedef typename C::value_type E;
+    if (buffer->empty())
+      return;
+    Input &in = input(digitizerID, E::timeBits);
+    for (const E &e : *buffer) {
+      const auto &l = list(e);
+      int group = (size_t)l.channel < in.group.size() ? in.group[l.channel] : -1;
+      int64_t time = (int64_t)in.unwrap(l.timeStamp()) + in.offset;
+      if (group < 0) {
+        ++ungrouped;
+        continue;
+      }
+      add(time, digitizerID, l.channel, l.charge, group, globalTimeStamp);
+    }
+  }
+
+  void operator()(const jadaq::buffer<Data::StdElement751> *, uint32_t, uint64_t) {
+    throw std::runtime_error("Coincidences need DPP list data - not standard firmware events");
+  }
+  void operator()(const jadaq::buffer<Data::CoincidenceElement> *, uint32_t, uint64_t) {
+    throw std::runtime_error("Coincidences can not be built from coincidences");
+  }
+};
+
+#endif // JADAQ_DATAWRITERCOINCIDENCE_HPP
@@ -0,0 +1,289 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Reduce waveforms to their pulse features (Data::FeatureElement) on the
+ * way to another DataWriter, optionally keeping 1 in N full waveforms per
+ * channel for validation. The kept waveforms go to a separate writer, so
+ * both outputs hold a single element type per digitizer.
+ *
+ * DPP-QDC waveforms use the gate and holdoff intervals of the firmware; a
+ * standard firmware waveform, which holds all enabled channels after each
+ * other, gives one feature element per channel. List data is passed on.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERFEATURES_HPP
+#define JADAQ_DATAWRITERFEATURES_HPP
+
+#include "DataFormat.hpp"
+#include "DataWriter.hpp"
+#include "TimeSorter.hpp"
+#include "WaveformFeatures.hpp"
+#include "container.hpp"
+#include "xtrace.h"
+#include <bitset>
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class DataWriterFeatures {
+public:
+  static constexpr const size_t maxChannels = 64;
+
+  struct Channels {
+    uint32_t digitizerID;
+    uint64_t mask;
+    WaveformFeatures::Parameters parameters;
+  };
+  struct Settings {
+    WaveformFeatures::Parameters defaults;
+    std::vector<Channels> channels; // later entries take precedence
+    bool keepsTraces() const {
+      if (defaults.traces > 0)
+        return true;
+      for (const Channels &c : channels) {
+        if (c.parameters.traces > 0)
+          return true;
+      }
+      return false;
+    }
+  };
+
+private:
+  typedef Data::FeatureElement Element;
+
+  /* The containers whose waveforms are reduced - the rest pass through */
+  template <typename C> static constexpr bool reduces(const C *) { return false; }
+  template <typename L>
+  static constexpr bool reduces(const jadaq::buffer<Data::DPPQDCWaveformElement<L>> *) {
+    return true;
+  }
+  template <typename L>
+  static constexpr bool reduces(const jadaq::records<Data::DPPQDCWaveformElement<L>> *) {
+    return true;
+  }
+  static constexpr bool reduces(const jadaq::buffer<Data::StdElement751> *) { return true; }
+
+  struct Input {
+    TimeUnwrapper unwrap;
+    int8_t settings[maxChannels]; // index in Settings::channels, -1 for the defaults
+    uint32_t count[maxChannels] = {}; // waveforms since the last kept one
+    jadaq::buffer<Element> *out;
+    uint64_t outStamp = 0;
+    Input(unsigned timeBits, jadaq::buffer<Element> *out_) : unwrap(timeBits), out(out_) {}
+  };
+
+  DataWriter output;
+  DataWriter traces; // empty unless traces are kept
+  const Settings settings;
+  std::map<uint32_t, Input> inputs;
+  std::shared_ptr<jadaq::buffer_pool<Element>> pool;
+  WaveformFeatures::Extractor extract;
+  std::vector<const char *> kept;
+
+  uint64_t reduced = 0;
+  uint64_t keptTotal = 0;
+
+  Input &input(uint32_t digitizerID, unsigned timeBits) {
+    auto itr = inputs.find(digitizerID);
+    if (itr != inputs.end())
+      return itr->second;
+    Input &in = inputs.emplace(digitizerID, Input(timeBits, pool->acquire())).first->second;
+    for (size_t c = 0; c < maxChannels; ++c)
+      in.settings[c] = -1;
+    for (size_t i = 0; i < settings.channels.size(); ++i) {
+      const Channels &channels = settings.channels[i];
+      if (channels.digitizerID != digitizerID)
+        continue;
+      for (size_t c = 0; c < maxChannels; ++c) {
+        if (channels.mask >> c & 1)
+          in.settings[c] = (int8_t)i;
+      }
+    }
+    return in;
+  }
+
+  const WaveformFeatures::Parameters &parameters(const Input &in, uint16_t channel) const {
+    const int8_t i = in.settings[channel];
+    return i < 0 ? settings.defaults : settings.channels[i].parameters;
+  }
+
+  void write(uint32_t digitizerID, Input &in) {
+    if (in.out->empty())
+      return;
+    output(in.out, digitizerID, in.outStamp);
+    in.out->release();
+    in.out = pool->acquire();
+  }
+
+  void add(uint32_t digitizerID, Input &in, uint64_t globalTimeStamp, const Element &e) {
+    if (globalTimeStamp != in.outStamp) {
+      write(digitizerID, in);
+      in.outStamp = globalTimeStamp;
+    }
+    if (in.out->size() == in.out->capacity())
+      write(digitizerID, in);
+    in.out->push_back(e);
+    ++reduced;
+  }
+
+  bool keep(Input &in, uint16_t channel) {
+    const unsigned n = parameters(in, channel).traces;
+    if (n == 0 || ++in.count[channel] < n)
+      return false;
+    in.count[channel] = 0;
+    return true;
+  }
+
+  /* The kept waveforms of a buffer, in a container of their own */
+  template <typename C>
+  void writeTraces(const C *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    typedef typename C::value_type E;
+    if (kept.empty())
+      return;
+    const size_t elementSize = buffer->object_size();
+    C out(sizeof(Data::Header) + kept.size() * C::stride(elementSize), elementSize,
+          sizeof(Data::Header));
+    for (const char *e : kept)
+      jadaq::append(out, *reinterpret_cast<const E *>(e));
+    traces(&out, digitizerID, globalTimeStamp);
+    keptTotal += kept.size();
+    kept.clear();
+  }
+
+  template <typename L>
+  void reduce(const jadaq::buffer<Data::DPPQDCWaveformElement<L>> *buffer, uint32_t digitizerID,
+              uint64_t globalTimeStamp) {
+    reduceWaveforms<L>(buffer, digitizerID, globalTimeStamp);
+  }
+  template <typename L>
+  void reduce(const jadaq::records<Data::DPPQDCWaveformElement<L>> *buffer, uint32_t digitizerID,
+              uint64_t globalTimeStamp) {
+    reduceWaveforms<L>(buffer, digitizerID, globalTimeStamp);
+  }
+  template <typename L, typename C>
+  void reduceWaveforms(const C *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    Input &in = input(digitizerID, L::timeBits);
+    for (const Data::DPPQDCWaveformElement<L> &e : *buffer) {
+      const L &l = e.listElement;
+      const DPPQDCWaveform &w = e.waveform;
+      const uint16_t channel = l.channel < maxChannels ? l.channel : 0;
+      const WaveformFeatures::Parameters &p = parameters(in, channel);
+      // intervals not seen in the waveform are 0xffff
+      WaveformFeatures::Window gate = {w.gate.start, w.gate.end};
+      if (w.gate.start == 0xffff)
+        gate = {p.baseline, w.num_samples};
+      else if (w.gate.end == 0xffff || w.gate.end <= w.gate.start)
+        gate.end = w.num_samples;
+      WaveformFeatures::Window peak = gate;
+      if (w.holdoff.start != 0xffff && w.holdoff.end != 0xffff && w.holdoff.end > peak.end)
+        peak.end = w.holdoff.end;
+      WaveformFeatures::Result r = extract(p, w.samples, w.num_samples, gate, peak);
+      add(digitizerID, in, globalTimeStamp,
+          {in.unwrap(l.timeStamp()), l.channel, l.charge, r.baseline, r.amplitude, r.peak, r.rise,
+           r.integral});
+      if (keep(in, channel))
+        kept.push_back((const char *)&e);
+    }
+    writeTraces(buffer, digitizerID, globalTimeStamp);
+  }
+
+  void reduce(const jadaq::buffer<Data::StdElement751> *buffer, uint32_t digitizerID,
+              uint64_t globalTimeStamp) {
+    Input &in = input(digitizerID, Data::StdElement751::timeBits);
+    for (const Data::StdElement751 &e : *buffer) {
+      const size_t channels = std::bitset<8>(e.channelMask).count();
+      if (channels == 0)
+        continue;
+      const size_t n = e.waveform.num_samples / channels;
+      const uint64_t time = in.unwrap(e.timeStamp());
+      const char *samples = (const char *)e.waveform.samples;
+      bool keepTrace = false;
+      for (uint16_t channel = 0; channel < 8; ++channel) {
+        if (!(e.channelMask >> channel & 1))
+          continue;
+        const WaveformFeatures::Parameters &p = parameters(in, channel);
+        WaveformFeatures::Window gate = {p.baseline, n};
+        WaveformFeatures::Result r = extract(p, samples, n, gate, gate);
+        add(digitizerID, in, globalTimeStamp,
+            {time, channel, 0, r.baseline, r.amplitude, r.peak, r.rise, r.integral});
+        keepTrace |= keep(in, channel);
+        samples += 2 * n;
+      }
+      if (keepTrace)
+        kept.push_back((const char *)&e);
+    }
+    writeTraces(buffer, digitizerID, globalTimeStamp);
+  }
+
+  template <typename E>
+  void reduce(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    output(buffer, digitizerID, globalTimeStamp);
+  }
+
+public:
+  /* traces is only used if the settings keep traces */
+  DataWriterFeatures(DataWriter &&output_, DataWriter &&traces_, const Settings &settings_)
+      : output(std::move(output_)), traces(std::move(traces_)), settings(settings_),
+        pool(jadaq::buffer_pool<Element>::create(output.bufferSize(), sizeof(Element),
+                                                 sizeof(Data::Header))) {}
+  ~DataWriterFeatures() {
+    for (auto &itr : inputs) {
+      write(itr.first, itr.second);
+      itr.second.out->release();
+    }
+    XTRACE(DATAH, NOTE, "Waveforms reduced to features: %" PRIu64 ", kept: %" PRIu64, reduced,
+           keptTotal);
+  }
+
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t n) {
+    if (!reduces(static_cast<const C *>(nullptr))) {
+      output.addDigitizer<C>(digitizerID, n);
+      return;
+    }
+    output.addDigitizer<jadaq::buffer<Element>>(digitizerID, 0);
+    if (settings.keepsTraces())
+      traces.addDigitizer<C>(digitizerID, n);
+  }
+
+  void split(const std::string &id) {
+    for (auto &itr : inputs)
+      write(itr.first, itr.second);
+    output.split(id);
+    if (settings.keepsTraces())
+      traces.split(id);
+  }
+
+  size_t bufferSize() const { return output.bufferSize(); }
+
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    if (buffer->empty())
+      return;
+    reduce(buffer, digitizerID, globalTimeStamp);
+  }
+};
+
+#endif // JADAQ_DATAWRITERFEATURES_HPP
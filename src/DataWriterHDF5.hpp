@@ -20,30 +20,153 @@
  * @section DESCRIPTION
  * Write data to HDF5 file
  *
+ * Two layouts: a packet table per digitizer and global time stamp (the
+ * original one), or one chunked, extensible dataset per digitizer and
+ * element type, named after the type, with a <type>_index dataset of
+ * (globalTime, first, count) rows into it. The indexed layout keeps the
+ * file metadata small on long runs.
+ *
+ * The column layout splits the elements further into a dataset per field,
+ * so analysis reading a field or two does not read the rest, and each
+ * field compresses on its own.
+ *
+ * The chunked layouts can be compressed. With a ChunkCompressor the chunks
+ * are staged here, compressed on its threads and written with
+ * H5Dwrite_chunk, so the compression does not hold the mutex.
+ *
+ * With filePerDigitizer every digitizer is written to a file of its own,
+ * and on close a master file maps their groups as virtual datasets. The
+ * files have a mutex each only with a thread safe HDF5 - which still
+ * serializes the HDF5 calls themselves, so what overlaps is the staging
+ * and compression. Without one all files - of every writer in the
+ * process - share the HDF5Lock mutex and are written one at a time.
+ *
+ * A split swaps in the next files, opened in advance by a worker thread,
+ * and leaves closing the old ones to the worker. Besides split() from the
+ * acquisition loop, files are split when they reach a size or a number of
+ * elements. The files of a run are listed in a run index. Without a thread
+ * safe HDF5 the worker holds the HDF5Lock mutex while it closes or opens
+ * them, so writes wait for that.
+ *
  */
 
 #ifndef JADAQ_DATAHANDLERHDF5_HPP
 #define JADAQ_DATAHANDLERHDF5_HPP
 
+#include "ChunkCompressor.hpp"
 #include "DataFormat.hpp"
+#include "HDF5Lock.hpp"
+#include "WaveformCodec.hpp"
 #include "container.hpp"
 #include <H5Cpp.h>
 #include <H5PacketTable.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
 #include <map>
+#include <memory>
 #include <mutex>
-#include <set>
+#include <stdexcept>
 #include <string>
+#include <sys/stat.h>
+#include <thread>
 #include <vector>
 
 class DataWriterHDF5 {
+public:
+  /* Tables: a packet table per digitizer and global time stamp.
+   * Indexed: one extensible dataset per digitizer and element type, and an
+   * index of the rows written at each global time stamp.
+   * Columns: like Indexed, but a group per element type with a dataset per
+   * field - N x samples for waveforms. */
+  enum Layout { Tables, Indexed, Columns };
+
+  struct Options {
+    bool compress = false;
+    Layout layout = Tables;
+    size_t chunkBytes = 1 << 20; // the chunked layouts only
+    size_t cacheBytes = 4 << 20; // chunk cache per element type
+    ChunkCompressor::Filter filter = ChunkCompressor::None; // after a byte shuffle
+    int level = 0;
+    unsigned threads = 2; // compressing, 0 to leave it to HDF5 on the writing thread
+    bool filePerDigitizer = false; // and a master file of virtual datasets
+    float flushInterval = 0.0f; // seconds between flushes, 0 for none
+    bool swmr = false;          // readers may open the files while written (chunked layouts)
+    bool split = false;         // split() is called - the next files are opened in advance
+    uint64_t splitBytes = 0;    // split when a file reaches this size, 0 for never
+    uint64_t splitEvents = 0;   // or this many elements
+  };
+
+  /* Why files were closed, in the run index. Open while they are not. */
+  enum Split { Open, Time, Size, Events, End };
+
+  /* One row of an index dataset */
+  struct __attribute__((__packed__)) IndexEntry {
+    uint64_t globalTime;
+    uint64_t first;
+    uint64_t count;
+    static H5::CompType h5type() {
+      H5::CompType datatype(sizeof(IndexEntry));
+      datatype.insertMember("globalTime", HOFFSET(IndexEntry, globalTime), H5::PredType::NATIVE_UINT64);
+      datatype.insertMember("first", HOFFSET(IndexEntry, first), H5::PredType::NATIVE_UINT64);
+      datatype.insertMember("count", HOFFSET(IndexEntry, count), H5::PredType::NATIVE_UINT64);
+      return datatype;
+    }
+  };
+
 private:
+  static constexpr const size_t indexBatch = 256; // index entries written at a time
+
+  /* size bytes at offset of every row, width values of type each. With the
+   * compressor the rows are staged until a chunk is full. */
+  struct Column {
+    H5::DataSet data;
+    H5::DataType type;
+    size_t offset;
+    size_t size;
+    hsize_t width;
+    std::unique_ptr<ChunkCompressor::Chunk> staged;
+  };
+
+  /* The datasets of one element type in the chunked layouts. The columns
+   * are chunked by the same rows, so a chunk of each holds the same events. */
+  struct Series {
+    std::vector<Column> columns;
+    H5::DataSet index;
+    size_t rowSize = 0;
+    hsize_t chunkRows = 0;
+    hsize_t rows = 0;
+    hsize_t indexRows = 0;
+    std::vector<IndexEntry> pending;
+  };
+
+  /* What went to a file, for the split limits and the run index */
+  struct Written {
+    uint64_t elements = 0;
+    uint64_t first = std::numeric_limits<uint64_t>::max(); // global time stamps
+    uint64_t last = 0;
+    void add(const Written &w) {
+      elements += w.elements;
+      first = std::min(first, w.first);
+      last = std::max(last, w.last);
+    }
+  };
+
   struct DigitizerInfo {
     FL_PacketTable *previous = nullptr;
     FL_PacketTable *current = nullptr;
     H5::Group *group = nullptr;
     uint16_t format = Data::ElementType::None;
     uint64_t currentTimeStamp = 0;
+    std::map<uint16_t, Series> series;
     FL_PacketTable *&getTable(uint64_t timeStamp) {
       if (timeStamp == currentTimeStamp)
         return current;
@@ -59,134 +182,1029 @@ private:
       }
     }
   };
+
+  /* How a digitizer's buffers of one type are stored: JADAQ_DATA_TYPE, the
+   * bytes of a row and their HDF5 type */
+  struct Format {
+    uint16_t type;
+    size_t rowSize;
+    std::function<H5::DataType()> rowType;
+  };
+  typedef std::map<uint16_t, Format> Formats;       // by type
+  typedef std::map<uint32_t, Formats> Digitizers;   // by digitizer ID
+
+  typedef std::chrono::steady_clock Clock;
+
+  /* One HDF5 file and everything written to it, guarded by its own mutex
+   * or, without a thread safe HDF5, by that of HDF5Lock */
+  class File {
+  private:
+    std::mutex ownMutex;
+
+  public:
+    File(const Options &options_, std::mutex *sharedMutex = nullptr)
+        : mutex(sharedMutex ? *sharedMutex : ownMutex), options(options_) {
+      if (options.layout != Tables && options.filter != ChunkCompressor::None &&
+          options.threads > 0)
+        compressor.reset(new ChunkCompressor(options.filter, options.level, options.threads));
+    }
+    File(const File &) = delete;
+
+    std::mutex &mutex;
+
+    Written written;
+
+    /* Returns false if the file has been closed by a split. Sets split if
+     * it has reached a split limit. */
+    template <typename C>
+    bool operator()(const C *buffer, uint32_t digitizerID, uint64_t globalTimeStamp,
+                    Split &split) {
+      typedef typename C::value_type E;
+      std::lock_guard<std::mutex> lock(mutex);
+      if (file == nullptr)
+        return false;
+      const Data::ElementType type =
+          options.compress ? Data::packedType(E::type()) : Data::None;
+      if (type != Data::None)
+        writePacked(buffer, type, digitizerID, globalTimeStamp);
+      else
+        write(buffer, digitizerID, globalTimeStamp);
+      written.elements += buffer->size();
+      written.first = std::min(written.first, globalTimeStamp);
+      written.last = std::max(written.last, globalTimeStamp);
+      hsize_t size = 0;
+      if (options.splitEvents > 0 && written.elements >= options.splitEvents)
+        split = Events;
+      else if (options.splitBytes > 0 && H5Fget_filesize(file->getId(), &size) >= 0 &&
+               size >= options.splitBytes)
+        split = Size;
+      return true;
+    }
+
+    /* Make the group and datasets of the digitizer, as none can be made
+     * once SWMR writing has started. Called with the mutex held, like open()
+     * and close(). */
+    void addDigitizer(uint32_t digitizerID, const Formats &formats) {
+      try {
+        DigitizerInfo &info = getDigitizerInfo(digitizerID);
+        for (const auto &itr : formats) {
+          const Format &format = itr.second;
+          setFormat(info, format.type);
+          if (options.layout != Tables)
+            getSeries(info, format.type, format.rowType, format.rowSize);
+        }
+      } catch (H5::Exception &e) {
+        std::cerr << "ERROR: DataWriterHDF5 can not add digitizer " << digitizerID << " to \""
+                  << filename << "\": " << e.getDetailMsg() << std::endl;
+      }
+    }
+
+    void open(const std::string &filename_) {
+      filename = filename_;
+      try {
+        assert(file == nullptr);
+        H5::FileAccPropList access;
+        if (options.swmr)
+          access.setLibverBounds(H5F_LIBVER_LATEST, H5F_LIBVER_LATEST);
+        file = new H5::H5File(filename, H5F_ACC_TRUNC, H5::FileCreatPropList::DEFAULT, access);
+        swmr = false;
+        written = Written();
+        assert(root == nullptr);
+        root = new H5::Group(file->openGroup("/"));
+      } catch (H5::Exception &e) {
+        std::cerr << "ERROR: could not open/create HDF5-file \"" << filename
+                  << "\":" << e.getDetailMsg() << std::endl;
+        throw;
+      }
+    }
+
+    const std::string &getFilename() const { return filename; }
+    bool isOpen() const { return file != nullptr; }
+
+    /* Flush if the flush interval has passed - also when nothing has been
+     * written meanwhile - and return when the next flush is due. SWMR writing
+     * starts with the first flush once started. Called with the mutex held,
+     * on the worker. */
+    Clock::time_point flushIfDue(bool started) {
+      if (Clock::now() >= nextFlush)
+        flush(started);
+      return nextFlush;
+    }
+
+    /* The next files are opened under temporary names */
+    void rename(const std::string &to) {
+      if (std::rename(filename.c_str(), to.c_str()) != 0) {
+        std::cerr << "ERROR: could not rename \"" << filename << "\" to \"" << to << "\""
+                  << std::endl;
+        return;
+      }
+      filename = to;
+    }
+
+  private:
+    const Options &options;
+    std::string filename;
+    std::vector<char> packed;
+    std::vector<char> columnData;
+    std::unique_ptr<ChunkCompressor> compressor;
+
+    H5::H5File *file = nullptr;
+    H5::Group *root = nullptr;
+    std::map<uint32_t, DigitizerInfo> digitizerInfo;
+
+    Clock::time_point nextFlush;
+    bool swmr = false; // SWMR writing started
+
+    DigitizerInfo &getDigitizerInfo(uint32_t digitizerID) {
+      auto itr = digitizerInfo.find(digitizerID);
+      if (itr != digitizerInfo.end()) {
+        return itr->second;
+      } else {
+        DigitizerInfo info;
+        std::string name = groupName(digitizerID);
+        info.group =
+            new H5::Group(file->createGroup(name));
+        digitizerInfo[digitizerID] = std::move(info);
+        return digitizerInfo[digitizerID];
+      }
+    }
+
+    /* The group's JADAQ_DATA_TYPE is that of its first element type */
+    void setFormat(DigitizerInfo &info, uint16_t type) {
+      if (info.format != Data::ElementType::None)
+        return;
+      info.format = type;
+      writeAttribute("JADAQ_DATA_TYPE", *info.group, H5::PredType::NATIVE_UINT16, &info.format);
+    }
+    template<typename H5LOC>
+    void writeAttribute(std::string name, H5LOC& location, const H5::PredType& type, const void* data) const
+    {
+      try {
+        H5::Attribute a = location.createAttribute(name, type, H5::DataSpace(H5S_SCALAR));
+        a.write(type,data);
+        a.close();
+      } catch (H5::Exception& e)
+        {
+          std::cerr << "ERROR: DataWriterHDF5 can not writeAttribute \"" << name << "\"." << std::endl;
+          throw;
+        }
+    }
+
+    /* A chunked dataset of rows of width values of type, extended as rows
+     * are appended */
+    H5::DataSet createExtensible(H5::Group &group, const std::string &name, const H5::DataType &type,
+                                 hsize_t width, hsize_t chunkRows, size_t cacheBytes,
+                                 bool filtered) const {
+      const int rank = width > 1 ? 2 : 1;
+      hsize_t dims[2] = {0, width};
+      hsize_t maxDims[2] = {H5S_UNLIMITED, width};
+      hsize_t chunk[2] = {chunkRows, width};
+      H5::DataSpace space(rank, dims, maxDims);
+      H5::DSetCreatPropList create;
+      create.setChunk(rank, chunk);
+      if (filtered)
+        ChunkCompressor::setFilters(create, options.filter, options.level);
+      H5::DSetAccPropList access;
+      // rows are only appended, so a chunk is done with once it is full (w0 = 1)
+      const size_t chunks = cacheBytes / (chunkRows * width * type.getSize()) + 1;
+      access.setChunkCache(std::max<size_t>(521, 100 * chunks), cacheBytes, 1.0);
+      return group.createDataSet(name, type, space, create, access);
+    }
+
+    static void appendRows(H5::DataSet &dataset, const H5::DataType &type, hsize_t first,
+                           const void *data, hsize_t count, hsize_t width = 1) {
+      const int rank = width > 1 ? 2 : 1;
+      hsize_t size[2] = {first + count, width};
+      hsize_t start[2] = {first, 0};
+      hsize_t block[2] = {count, width};
+      dataset.extend(size);
+      H5::DataSpace fileSpace = dataset.getSpace();
+      fileSpace.selectHyperslab(H5S_SELECT_SET, block, start);
+      H5::DataSpace memSpace(rank, block);
+      dataset.write(data, type, memSpace, fileSpace);
+    }
+
+    static void flushIndex(Series &series) {
+      if (series.pending.empty())
+        return;
+      appendRows(series.index, IndexEntry::h5type(), series.indexRows, series.pending.data(),
+                 series.pending.size());
+      series.indexRows += series.pending.size();
+      series.pending.clear();
+    }
+
+    /* Copy the column out of rows rows */
+    static void gather(const char *data, size_t rows, size_t rowSize, const Column &column,
+                       char *out) {
+      const char *in = data + column.offset;
+      switch (column.size) {
+      case 2:
+        for (size_t r = 0; r < rows; ++r, in += rowSize, out += 2)
+          memcpy(out, in, 2);
+        break;
+      case 4:
+        for (size_t r = 0; r < rows; ++r, in += rowSize, out += 4)
+          memcpy(out, in, 4);
+        break;
+      case 8:
+        for (size_t r = 0; r < rows; ++r, in += rowSize, out += 8)
+          memcpy(out, in, 8);
+        break;
+      default:
+        for (size_t r = 0; r < rows; ++r, in += rowSize, out += column.size)
+          memcpy(out, in, column.size);
+      }
+    }
+
+    /* Copy rows to the staged chunks of the column, starting at row
+     * series.rows, and hand the full ones to the compressor */
+    void stage(Series &series, Column &column, const char *data, size_t rows) {
+      hsize_t row = series.rows;
+      while (rows > 0) {
+        const hsize_t inChunk = row % series.chunkRows;
+        if (!column.staged) {
+          column.staged.reset(new ChunkCompressor::Chunk());
+          column.staged->dataset = column.data.getId();
+          column.staged->offset[0] = row - inChunk;
+          column.staged->offset[1] = 0;
+          column.staged->elementSize = column.type.getSize();
+          column.staged->data.resize(series.chunkRows * column.size);
+        }
+        const size_t n = std::min<hsize_t>(rows, series.chunkRows - inChunk);
+        char *out = column.staged->data.data() + inChunk * column.size;
+        if (column.size == series.rowSize)
+          memcpy(out, data, n * column.size);
+        else
+          gather(data, n, series.rowSize, column, out);
+        if (inChunk + n == series.chunkRows)
+          compressor->submit(std::move(column.staged));
+        data += n * series.rowSize;
+        rows -= n;
+        row += n;
+      }
+    }
+
+    /* Write the compressed chunks - those ready, or with all all of them.
+     * Waits for the oldest chunks while too many are in flight. */
+    void writeCompressed(bool all) {
+      const size_t limit = 4 * compressor->threads();
+      while (true) {
+        const bool wait = all || compressor->pending() > limit;
+        std::unique_ptr<ChunkCompressor::Chunk> chunk = compressor->next(wait);
+        if (!chunk)
+          return;
+        if (H5Dwrite_chunk(chunk->dataset, H5P_DEFAULT, chunk->filterMask, chunk->offset,
+                           chunk->data.size(), chunk->data.data()) < 0)
+          std::cerr << "Error while writing to HDF5 file: "
+                    << "\n\t "
+                    << "HDF5::writeChunk( " << chunk->offset[0] << ", " << chunk->data.size()
+                    << " )" << std::endl;
+      }
+    }
+
+    template <typename RowType>
+    Series &getSeries(DigitizerInfo &info, uint16_t type, RowType rowType, size_t rowSize) {
+      auto itr = info.series.find(type);
+      if (itr != info.series.end()) {
+        if (itr->second.rowSize != rowSize)
+          throw std::runtime_error("DataWriterHDF5: " + Data::typeName(type) +
+                                   " elements changed size from " +
+                                   std::to_string(itr->second.rowSize) + " to " +
+                                   std::to_string(rowSize) + " bytes");
+        return itr->second;
+      }
+      Series &series = info.series[type];
+      const std::string name = Data::typeName(type);
+      const H5::DataType row = rowType();
+      const hsize_t chunkRows = std::max<size_t>(1, options.chunkBytes / rowSize);
+      series.rowSize = rowSize;
+      series.chunkRows = chunkRows;
+      if (options.layout == Columns && row.getClass() == H5T_COMPOUND) {
+        H5::Group group = info.group->createGroup(name);
+        H5::CompType compound(row.getId());
+        for (int i = 0; i < compound.getNmembers(); ++i) {
+          Column column;
+          column.type = compound.getMemberDataType(i);
+          column.offset = compound.getMemberOffset(i);
+          column.size = column.type.getSize();
+          column.width = 1;
+          if (compound.getMemberClass(i) == H5T_ARRAY) {
+            column.type = column.type.getSuper();
+            column.width = column.size / column.type.getSize();
+          }
+          const size_t cacheBytes = std::max<size_t>(chunkRows * column.size,
+                                                     options.cacheBytes * column.size / rowSize);
+          column.data = createExtensible(group, compound.getMemberName(i), column.type,
+                                         column.width, chunkRows, cacheBytes, true);
+          series.columns.push_back(std::move(column));
+        }
+        writeAttribute("JADAQ_DATA_TYPE", group, H5::PredType::NATIVE_UINT16, &type);
+      } else {
+        Column column;
+        column.type = row;
+        column.offset = 0;
+        column.size = rowSize;
+        column.width = 1;
+        column.data = createExtensible(*info.group, name, row, 1, chunkRows, options.cacheBytes,
+                                       true);
+        series.columns.push_back(std::move(column));
+        writeAttribute("JADAQ_DATA_TYPE", column.data, H5::PredType::NATIVE_UINT16, &type);
+      }
+      series.index = createExtensible(*info.group, name + "_index", IndexEntry::h5type(), 1,
+                                      indexBatch, indexBatch * sizeof(IndexEntry), false);
+      return series;
+    }
+
+    /* Make everything written so far visible to readers. The partly filled
+     * chunks of the compressor are written as they are and written again
+     * when full. Starts SWMR writing once started: data is being written,
+     * so every digitizer has been added and has its datasets. */
+  private:
+    void flush(bool started) {
+      try {
+        if (compressor) {
+          for (auto &itr : digitizerInfo) {
+            for (auto &series : itr.second.series) {
+              for (Column &column : series.second.columns) {
+                if (column.staged)
+                  compressor->submit(std::unique_ptr<ChunkCompressor::Chunk>(
+                      new ChunkCompressor::Chunk(*column.staged)));
+              }
+            }
+          }
+          writeCompressed(true);
+        }
+        for (auto &itr : digitizerInfo) {
+          for (auto &series : itr.second.series)
+            flushIndex(series.second);
+        }
+        file->flush(H5F_SCOPE_LOCAL);
+        if (options.swmr && !swmr && started) {
+          if (H5Fstart_swmr_write(file->getId()) >= 0)
+            swmr = true;
+          else // tried again at the next flush
+            std::cerr << "ERROR: DataWriterHDF5 could not start SWMR writing \"" << filename
+                      << "\"" << std::endl;
+        }
+      } catch (H5::Exception &e) {
+        std::cerr << "ERROR: DataWriterHDF5 can not flush \"" << filename
+                  << "\": " << e.getDetailMsg() << std::endl;
+      }
+      scheduleFlush();
+    }
+
+  public:
+    /* From when the file is written to - not when it was opened, which for
+     * the next files of a split is well before */
+    void scheduleFlush() {
+      nextFlush = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                     std::chrono::duration<float>(options.flushInterval));
+    }
+
+  private:
+    /* Append rows of rowSize bytes to the output of the digitizer, type in
+     * JADAQ_DATA_TYPE. rowType() gives the HDF5 type of a row, only asked for
+     * when a table or dataset is created. Called with the mutex held. */
+    template <typename RowType>
+    void store(const char *data, size_t rows, size_t rowSize, uint16_t type, RowType rowType,
+               uint32_t digitizerID, uint64_t globalTimeStamp) {
+      DigitizerInfo &info = getDigitizerInfo(digitizerID);
+      setFormat(info, type);
+      if (options.layout != Tables) {
+        try {
+          Series &series = getSeries(info, type, rowType, rowSize);
+          if (!series.pending.empty() && series.pending.back().globalTime == globalTimeStamp) {
+            series.pending.back().count += rows;
+          } else {
+            if (series.pending.size() >= indexBatch)
+              flushIndex(series);
+            series.pending.push_back({globalTimeStamp, series.rows, rows});
+          }
+          if (compressor) {
+            hsize_t size[2] = {series.rows + rows, 0};
+            for (Column &column : series.columns) {
+              size[1] = column.width;
+              column.data.extend(size);
+              stage(series, column, data, rows);
+            }
+            writeCompressed(false);
+          } else {
+            for (Column &column : series.columns) {
+              const char *values = data;
+              if (series.columns.size() > 1) {
+                columnData.resize(rows * column.size);
+                gather(data, rows, rowSize, column, columnData.data());
+                values = columnData.data();
+              }
+              appendRows(column.data, column.type, series.rows, values, rows, column.width);
+            }
+          }
+          series.rows += rows;
+        } catch (H5::Exception &e) {
+          std::cerr << "Error while writing to HDF5 file: "
+                    << "\n\t "
+                    << "HDF5::append( " << digitizerID << ", " << globalTimeStamp << ", " << rows
+                    << " ): " << e.getDetailMsg() << std::endl;
+        }
+        return;
+      }
+      FL_PacketTable *&table = info.getTable(globalTimeStamp);
+      if (table == nullptr) {
+        /// \todo (char*) cast used to get rid of warning, maybe check this is OK?
+        table = new FL_PacketTable(info.group->getId(), (char *)std::to_string(globalTimeStamp).c_str(),
+                                   rowType().getId(), rows);
+      }
+      if (table->AppendPackets(rows, (void *)data)) // Fuck this is the worst interface ever!
+      {
+        std::cerr << "Error while writing to HDF5 file: "
+                  << "\n\t "
+                  << "HDF5::append( " << digitizerID << ", " << globalTimeStamp
+                  << ", " << rows << " )" << std::endl;
+      }
+    }
+
+    void writeBytes(const char *data, size_t size, uint16_t type, uint32_t digitizerID,
+                    uint64_t globalTimeStamp) {
+      store(data, size, 1, type, []() { return H5::DataType(H5::PredType::NATIVE_UINT8); },
+            digitizerID, globalTimeStamp);
+    }
+
+    /* Waveforms packed by WaveformCodec are stored as a stream of records in
+     * a byte table, the packed type in JADAQ_DATA_TYPE */
+    template <typename C>
+    void writePacked(const C *buffer, uint16_t type, uint32_t digitizerID,
+                     uint64_t globalTimeStamp) {
+      size_t fixed, countOffset;
+      Data::packedLayout(type, fixed, countOffset);
+      packed.resize(buffer->data_size() + buffer->size() * sizeof(uint32_t));
+      char *next = packed.data();
+      for (const auto &e : *buffer)
+        next += WaveformCodec::packRecord((const char *)&e, fixed, countOffset, next);
+      writeBytes(packed.data(), next - packed.data(), type, digitizerID, globalTimeStamp);
+    }
+
+    /* Variable length records are stored as they are, in a byte table */
+    template <typename E>
+    void write(const jadaq::records<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+      writeBytes(buffer->data() + buffer->header_size(), buffer->data_size() - buffer->header_size(),
+                 Data::RecordsBase | E::type(), digitizerID, globalTimeStamp);
+    }
+
+    template <typename E>
+    void write(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+      const char *data = buffer->data() + buffer->header_size();
+      if (!buffer->contiguous()) {
+        packed.resize(buffer->data_size());
+        buffer->serialize(packed.data());
+        data = packed.data();
+      }
+      store(data, buffer->size(), buffer->object_size(), E::type(),
+            [buffer]() { return H5::DataType(buffer->begin()->h5type()); }, digitizerID,
+            globalTimeStamp);
+    }
+
+  public:
+    void close() {
+      assert(file);
+      if (compressor) {
+        // the last chunks are stored whole, the extent hides the rest
+        for (auto &itr : digitizerInfo) {
+          for (auto &series : itr.second.series) {
+            for (Column &column : series.second.columns) {
+              if (column.staged)
+                compressor->submit(std::move(column.staged));
+            }
+          }
+        }
+        writeCompressed(true);
+      }
+      for (auto &itr : digitizerInfo) {
+        for (auto &series : itr.second.series) {
+          try {
+            flushIndex(series.second);
+          } catch (H5::Exception &e) {
+            std::cerr << "ERROR: DataWriterHDF5 can not write the index of "
+                      << Data::typeName(series.first) << ": " << e.getDetailMsg() << std::endl;
+          }
+        }
+        itr.second.series.clear();
+        if (itr.second.current)
+          delete itr.second.current;
+        if (itr.second.previous)
+          delete itr.second.previous;
+        if (itr.second.group)
+          delete itr.second.group;
+      }
+      digitizerInfo.clear();
+      root->close();
+      delete root;
+      root = nullptr;
+      file->close();
+      delete file;
+      file = nullptr;
+    }
+
+  };
+
+  /* The files written at a time - the one file, or one per digitizer.
+   * Replaced as a whole on a split or when a digitizer is added, so writers
+   * look their file up without a lock. */
+  struct Output {
+    std::string name; // run id and part
+    std::shared_ptr<File> shared;
+    std::map<uint32_t, std::shared_ptr<File>> files;
+    std::vector<std::shared_ptr<File>> all() const {
+      std::vector<std::shared_ptr<File>> list;
+      if (shared)
+        list.push_back(shared);
+      for (const auto &itr : files)
+        list.push_back(itr.second);
+      return list;
+    }
+  };
+
   const std::string &pathname;
   const std::string &basename;
+  const size_t bufferSize_;
+  const Options options;
+  std::shared_ptr<const Output> output;
+  std::mutex filesMutex; // adding files, splits, the spare
+  Digitizers digitizers; // added so far, given their datasets in every new file
+  std::atomic<bool> started{false}; // data written - all digitizers are added
+  std::string id;
+  unsigned part = 0;             // of the run id, split by size or events
+  std::shared_ptr<Output> spare; // the next files, opened in advance
+
+  /* Closes the files of a split and opens the next ones, off the
+   * acquisition threads - and flushes the files on time, also the quiet
+   * ones */
+  std::mutex tasksMutex;
+  std::condition_variable tasksChanged;
+  std::deque<std::function<void()>> tasks;
+  bool stop = false;
+  std::thread worker;
+
+  bool splitting() const {
+    return options.split || options.splitBytes > 0 || options.splitEvents > 0;
+  }
+
+  std::string filename(const std::string &name, const std::string &suffix) const {
+    return pathname + basename + name + suffix + ".h5";
+  }
+
+  std::string spareName(const std::string &suffix) const {
+    return pathname + basename + "next" + suffix + ".h5.tmp";
+  }
 
-  H5::H5File *file = nullptr;
-  H5::Group *root = nullptr;
-  std::mutex mutex;
-  std::map<uint32_t, DigitizerInfo> digitizerInfo;
+  std::string indexName() const { return pathname + basename + "index.txt"; }
 
-  DigitizerInfo &getDigitizerInfo(uint32_t digitizerID) {
-    auto itr = digitizerInfo.find(digitizerID);
-    if (itr != digitizerInfo.end()) {
+  static std::string groupName(uint32_t digitizerID) {
+    /// \todo reverting hdf5 name for digitizer, screws up FraPi's matlap code
+    //return std::to_string(digitizerID>>16) + "_" + std::to_string(digitizerID & 0xFFFF);
+    return std::to_string(digitizerID & 0xFFFF);
+  }
+
+  static std::string fileSuffix(uint32_t digitizerID) { return "_d" + groupName(digitizerID); }
+
+  static uint64_t fileSize(const std::string &name) {
+    struct stat s;
+    return stat(name.c_str(), &s) == 0 ? s.st_size : 0;
+  }
+
+  /* A new file with the datasets of the digitizers it is written for, so
+   * the ones that are quiet at first are there before SWMR writing starts */
+  std::shared_ptr<File> openFile(const std::string &name, const Digitizers &ids) {
+    std::shared_ptr<File> f = std::make_shared<File>(
+        options, HDF5Lock::threadsafe ? nullptr : &HDF5Lock::mutex());
+    std::lock_guard<std::mutex> lock(f->mutex);
+    f->open(name);
+    for (const auto &itr : ids)
+      f->addDigitizer(itr.first, itr.second);
+    return f;
+  }
+
+  /* The digitizer of ids alone, for its own file */
+  static Digitizers only(const Digitizers &ids, uint32_t digitizerID) {
+    Digitizers one;
+    auto itr = ids.find(digitizerID);
+    one[digitizerID] = itr != ids.end() ? itr->second : Formats();
+    return one;
+  }
+
+  /* How buffers of type C are stored - the choice of File::operator() */
+  template <typename C> Format format(size_t n) const {
+    typedef typename C::value_type E;
+    const Data::ElementType packed = options.compress ? Data::packedType(E::type()) : Data::None;
+    if (packed != Data::None)
+      return bytes(packed);
+    return rows(static_cast<const C *>(nullptr), n);
+  }
+  static Format bytes(uint16_t type) {
+    return {type, 1, []() { return H5::DataType(H5::PredType::NATIVE_UINT8); }};
+  }
+  template <typename E> static Format rows(const jadaq::records<E> *, size_t) {
+    return bytes(Data::RecordsBase | E::type());
+  }
+  template <typename E> static Format rows(const jadaq::buffer<E> *, size_t n) {
+    return {E::type(), E::size(n), [n]() { return H5::DataType(Data::h5type<E>(n)); }};
+  }
+
+  /* The file of the digitizer in out, which is replaced by the current
+   * output if the digitizer is new */
+  std::shared_ptr<File> file(std::shared_ptr<const Output> &out, uint32_t digitizerID) {
+    if (out->shared)
+      return out->shared;
+    auto itr = out->files.find(digitizerID);
+    if (itr != out->files.end())
       return itr->second;
-    } else {
-      DigitizerInfo info;
-      /// \todo reverting hdf5 name for digitizer, screws up FraPi's matlap code
-      //std::string name = std::to_string(digitizerID>>16) + "_" + std::to_string(digitizerID & 0xFFFF);
-      std::string name = std::to_string(digitizerID & 0xFFFF);
-      info.group =
-          new H5::Group(file->createGroup(name));
-      digitizerInfo[digitizerID] = info;
-      return digitizerInfo[digitizerID];
-    }
-  }
-  template<typename H5LOC>
-  void writeAttribute(std::string name, H5LOC& location, const H5::PredType& type, const void* data) const
-  {
+    out = add(digitizerID);
+    return out->files.at(digitizerID);
+  }
+
+  std::shared_ptr<const Output> add(uint32_t digitizerID) {
+    std::lock_guard<std::mutex> lock(filesMutex);
+    std::shared_ptr<const Output> current = std::atomic_load(&output);
+    if (current->files.count(digitizerID))
+      return current;
+    std::shared_ptr<Output> next = std::make_shared<Output>(*current);
+    next->files[digitizerID] =
+        openFile(filename(next->name, fileSuffix(digitizerID)), only(digitizers, digitizerID));
+    {
+      std::lock_guard<std::mutex> lock(next->files[digitizerID]->mutex);
+      next->files[digitizerID]->scheduleFlush();
+    }
+    std::atomic_store(&output, std::shared_ptr<const Output>(next));
+    return next;
+  }
+
+  /* Swap in the next files - the spare ones if they are ready - and leave
+   * closing the current ones to the worker. Called with filesMutex held. */
+  void rotate(const std::string &nextID, unsigned nextPart, Split reason) {
+    std::shared_ptr<const Output> current = std::atomic_load(&output);
+    std::shared_ptr<Output> next = spare ? spare : std::make_shared<Output>();
+    spare.reset();
+    id = nextID;
+    part = nextPart;
+    next->name = part > 0 ? id + "_p" + std::to_string(part) : id;
+    const bool closed = next->name == current->name;
+    if (closed) {
+      // files of the same names are closed first - writers retry until the
+      // next ones are in. Unlocked again, as without a thread safe HDF5 the
+      // next files share the mutex.
+      std::vector<std::unique_lock<std::mutex>> locks = lockFiles(*current);
+      close(*current, reason);
+    }
+    if (next->shared) {
+      next->shared->rename(filename(next->name, ""));
+      // digitizers added since the spare was opened
+      std::lock_guard<std::mutex> lock(next->shared->mutex);
+      for (const auto &itr : digitizers)
+        next->shared->addDigitizer(itr.first, itr.second);
+    } else if (!options.filePerDigitizer) {
+      next->shared = openFile(filename(next->name, ""), digitizers);
+    }
+    for (const auto &itr : next->files) {
+      itr.second->rename(filename(next->name, fileSuffix(itr.first)));
+      auto known = digitizers.find(itr.first);
+      std::lock_guard<std::mutex> lock(itr.second->mutex);
+      if (known != digitizers.end())
+        itr.second->addDigitizer(itr.first, known->second);
+    }
+    for (const auto &itr : current->files) {
+      if (next->files.count(itr.first) == 0)
+        next->files[itr.first] = openFile(filename(next->name, fileSuffix(itr.first)),
+                                          only(digitizers, itr.first));
+    }
+    for (const std::shared_ptr<File> &f : next->all()) {
+      std::lock_guard<std::mutex> lock(f->mutex);
+      f->scheduleFlush();
+    }
+    std::atomic_store(&output, std::shared_ptr<const Output>(next));
+    schedule([this, current, reason, closed]() {
+      if (!closed)
+        retire(*current, reason);
+      if (splitting())
+        prepare();
+    });
+  }
+
+  /* Split when a file of out has reached a limit, unless out is no longer
+   * current */
+  void splitFull(const std::shared_ptr<const Output> &out, Split reason) {
+    std::lock_guard<std::mutex> lock(filesMutex);
+    if (std::atomic_load(&output) == out)
+      rotate(id, part + 1, reason);
+  }
+
+  /* Open the files of the next split under temporary names. On the worker. */
+  void prepare() {
+    std::shared_ptr<const Output> current;
+    Digitizers ids;
+    {
+      std::lock_guard<std::mutex> lock(filesMutex);
+      if (spare)
+        return;
+      current = std::atomic_load(&output);
+      ids = digitizers;
+    }
+    std::shared_ptr<Output> next = std::make_shared<Output>();
     try {
-      H5::Attribute a = location.createAttribute(name, type, H5::DataSpace(H5S_SCALAR));
-      a.write(type,data);
-      a.close();
-    } catch (H5::Exception& e)
-      {
-        std::cerr << "ERROR: DataWriterHDF5 can not writeAttribute \"" << name << "\"." << std::endl;
-        throw;
+      if (options.filePerDigitizer) {
+        for (const auto &itr : current->files)
+          next->files[itr.first] =
+              openFile(spareName(fileSuffix(itr.first)), only(ids, itr.first));
+      } else {
+        next->shared = openFile(spareName(""), ids);
+      }
+    } catch (H5::Exception &) {
+      discard(*next); // opened at the split instead
+      return;
+    }
+    std::lock_guard<std::mutex> lock(filesMutex);
+    spare = next;
+  }
+
+  static void discard(const Output &out) {
+    for (const std::shared_ptr<File> &f : out.all()) {
+      std::lock_guard<std::mutex> lock(f->mutex);
+      if (f->isOpen())
+        f->close();
+      std::remove(f->getFilename().c_str());
+    }
+  }
+
+  /* Lock every file - each mutex once */
+  static std::vector<std::unique_lock<std::mutex>> lockFiles(const Output &out) {
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (const std::shared_ptr<File> &f : out.all()) {
+      std::mutex *m = &f->mutex;
+      if (std::none_of(locks.begin(), locks.end(),
+                       [m](const std::unique_lock<std::mutex> &l) { return l.mutex() == m; }))
+        locks.emplace_back(*m);
+    }
+    return locks;
+  }
+
+  /* Close the files of a split once no one is writing to them. On the
+   * worker. */
+  void retire(const Output &out, Split reason) {
+    std::vector<std::unique_lock<std::mutex>> locks = lockFiles(out);
+    close(out, reason);
+  }
+
+  /* Close the files, write their master file and record them in the run
+   * index. Called with the files locked - and so HDF5, if not thread safe. */
+  void close(const Output &out, Split reason) {
+    Written written;
+    uint64_t bytes = 0;
+    for (const std::shared_ptr<File> &f : out.all()) {
+      written.add(f->written);
+      f->close();
+      bytes += fileSize(f->getFilename());
+    }
+    if (!out.files.empty())
+      writeMaster(out);
+    if (splitting())
+      record(basename + out.name + ".h5", written, bytes, reason);
+  }
+
+  /* A line of the run index: the file (the master of a file per digitizer),
+   * its first and last global time stamp, elements, bytes and why it was
+   * closed */
+  void record(const std::string &name, const Written &written, uint64_t bytes,
+              Split reason) const {
+    static const char *reasons[] = {"open", "time", "size", "events", "end"};
+    std::ofstream index(indexName(), std::ios::app);
+    index << name << "\t" << (written.elements > 0 ? written.first : 0) << "\t" << written.last
+          << "\t" << written.elements << "\t" << bytes << "\t" << reasons[reason] << "\n";
+    if (!index)
+      std::cerr << "ERROR: could not write the run index \"" << indexName() << "\"" << std::endl;
+  }
+
+  void schedule(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(tasksMutex);
+      tasks.push_back(std::move(task));
+    }
+    tasksChanged.notify_one();
+  }
+
+  /* Flush the current files that are due and return when to look again */
+  Clock::time_point flushFiles() {
+    Clock::time_point next =
+        Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                           std::chrono::duration<float>(options.flushInterval));
+    const bool writing = started;
+    for (const std::shared_ptr<File> &f : std::atomic_load(&output)->all()) {
+      std::lock_guard<std::mutex> lock(f->mutex);
+      if (f->isOpen())
+        next = std::min(next, f->flushIfDue(writing));
+    }
+    return next;
+  }
+
+  void work() {
+    const bool flushing = options.flushInterval > 0.0f;
+    Clock::time_point nextFlush = Clock::now();
+    std::unique_lock<std::mutex> lock(tasksMutex);
+    while (true) {
+      auto ready = [this]() { return stop || !tasks.empty(); };
+      if (flushing)
+        tasksChanged.wait_until(lock, nextFlush, ready);
+      else
+        tasksChanged.wait(lock, ready);
+      if (tasks.empty() && (stop || !flushing))
+        return;
+      std::function<void()> task;
+      if (!tasks.empty()) {
+        task = std::move(tasks.front());
+        tasks.pop_front();
       }
+      lock.unlock();
+      try {
+        if (task)
+          task();
+        if (flushing && Clock::now() >= nextFlush)
+          nextFlush = flushFiles();
+      } catch (H5::Exception &e) {
+        std::cerr << "ERROR: DataWriterHDF5 could not close or open files: " << e.getDetailMsg()
+                  << std::endl;
+      } catch (std::exception &e) {
+        std::cerr << "ERROR: DataWriterHDF5 could not close or open files: " << e.what()
+                  << std::endl;
+      }
+      lock.lock();
+    }
   }
 
-  void open(const std::string &id) {
-    std::string filename = pathname + basename + id + ".h5";
+  static void copyAttributes(H5::H5Object &from, H5::H5Object &to) {
+    for (int i = 0; i < from.getNumAttrs(); ++i) {
+      H5::Attribute in = from.openAttribute((unsigned)i);
+      H5::DataType type = in.getDataType();
+      H5::DataSpace space = in.getSpace();
+      std::vector<char> value(type.getSize() * space.getSimpleExtentNpoints());
+      in.read(type, value.data());
+      to.createAttribute(in.getName(), type, space).write(type, value.data());
+    }
+  }
+
+  /* Give to a virtual dataset for every dataset below from, which is at
+   * path in the file source */
+  static void mirror(H5::Group &from, H5::Group &to, const std::string &source,
+                     const std::string &path) {
+    copyAttributes(from, to);
+    for (hsize_t i = 0; i < from.getNumObjs(); ++i) {
+      const std::string name = from.getObjnameByIdx(i);
+      if (from.childObjType(name) == H5O_TYPE_GROUP) {
+        H5::Group fromGroup = from.openGroup(name);
+        H5::Group toGroup = to.createGroup(name);
+        mirror(fromGroup, toGroup, source, path + "/" + name);
+        continue;
+      }
+      H5::DataSet in = from.openDataSet(name);
+      H5::DataSpace inSpace = in.getSpace();
+      const int rank = inSpace.getSimpleExtentNdims();
+      hsize_t dims[2] = {0, 0};
+      if (rank < 1 || rank > 2)
+        throw std::runtime_error("unexpected rank of " + path + "/" + name);
+      inSpace.getSimpleExtentDims(dims);
+      H5::DataSpace space(rank, dims);
+      H5::DSetCreatPropList create;
+      if (space.getSimpleExtentNpoints() > 0 &&
+          H5Pset_virtual(create.getId(), space.getId(), source.c_str(),
+                         (path + "/" + name).c_str(), space.getId()) < 0)
+        throw std::runtime_error("could not map " + path + "/" + name);
+      H5::DataSet out = to.createDataSet(name, in.getDataType(), space, create);
+      copyAttributes(in, out);
+    }
+  }
+
+  /* The master file of the per digitizer files: their groups as groups of
+   * virtual datasets, so it reads like a single file */
+  void writeMaster(const Output &out) const {
+    const std::string name = filename(out.name, "");
     try {
-      assert(file == nullptr);
-      file = new H5::H5File(filename, H5F_ACC_TRUNC);
-      assert(root == nullptr);
-      root = new H5::Group(file->openGroup("/"));
+      H5::H5File master(name, H5F_ACC_TRUNC);
+      for (const auto &itr : out.files) {
+        const std::string &source = itr.second->getFilename();
+        const std::string group = groupName(itr.first);
+        H5::H5File in(source, H5F_ACC_RDONLY);
+        H5::Group from = in.openGroup(group);
+        H5::Group to = master.createGroup(group);
+        // relative, so the files can be moved together
+        mirror(from, to, source.substr(source.rfind('/') + 1), "/" + group);
+      }
     } catch (H5::Exception &e) {
-      std::cerr << "ERROR: could not open/create HDF5-file \"" << filename
-                << "\":" << e.getDetailMsg() << std::endl;
-      throw;
+      std::cerr << "ERROR: could not write HDF5 master file \"" << name << "\": "
+                << e.getDetailMsg() << std::endl;
+    } catch (std::runtime_error &e) {
+      std::cerr << "ERROR: could not write HDF5 master file \"" << name << "\": " << e.what()
+                << std::endl;
     }
   }
 
-  void close() {
-    assert(file);
-    for (auto &itr : digitizerInfo) {
-      if (itr.second.current)
-        delete itr.second.current;
-      if (itr.second.previous)
-        delete itr.second.previous;
-      if (itr.second.group)
-        delete itr.second.group;
-    }
-    digitizerInfo.clear();
-    root->close();
-    delete root;
-    root = nullptr;
-    file->close();
-    delete file;
-    file = nullptr;
+  static Options makeOptions(bool compress) {
+    Options o;
+    o.compress = compress;
+    return o;
   }
 
 public:
+  /* Each append costs a fixed amount of HDF5 work, so buffers are large -
+   * but with Tables the first one sets the chunk size, which should fit the
+   * default 1 MiB chunk cache */
+  static constexpr const size_t defaultBufferSize = 1 << 20;
+
   DataWriterHDF5(const std::string &pathname_, const std::string &basename_,
-                 const std::string &&id)
-      : pathname(pathname_), basename(basename_) {
-    open(id);
+                 const std::string &&id_, size_t bufferSize, const Options &options_)
+      : pathname(pathname_), basename(basename_), bufferSize_(bufferSize), options(options_),
+        id(id_) {
+    if (options.swmr && options.layout == Tables)
+      throw std::invalid_argument("SWMR writing needs a chunked HDF5 layout");
+    std::shared_ptr<Output> first = std::make_shared<Output>();
+    first->name = id;
+    if (!options.filePerDigitizer)
+      first->shared = openFile(filename(first->name, ""), digitizers);
+    for (const std::shared_ptr<File> &f : first->all())
+      f->scheduleFlush(); // before the worker can see them
+    output = first;
+    if (splitting()) {
+      std::ofstream index(indexName(), std::ios::trunc);
+      index << "# file\tfirst\tlast\telements\tbytes\tsplit\n";
+      schedule([this]() { prepare(); });
+    }
+    worker = std::thread(&DataWriterHDF5::work, this);
   }
 
+  DataWriterHDF5(const std::string &pathname_, const std::string &basename_,
+                 const std::string &&id, size_t bufferSize = defaultBufferSize,
+                 bool compress = false)
+      : DataWriterHDF5(pathname_, basename_, std::move(id), bufferSize, makeOptions(compress)) {}
+
   ~DataWriterHDF5() {
-    mutex.lock(); // Wait if someone is still writing data
-    close();
-    mutex.unlock();
+    {
+      std::lock_guard<std::mutex> lock(filesMutex);
+      std::shared_ptr<const Output> last = std::atomic_load(&output);
+      schedule([this, last]() { retire(*last, End); });
+    }
+    {
+      std::lock_guard<std::mutex> lock(tasksMutex);
+      stop = true;
+    }
+    tasksChanged.notify_one();
+    worker.join(); // after the tasks queued
+    if (spare)
+      discard(*spare);
   }
 
-  void split(const std::string &id) {
-    mutex.lock();
-    close();
-    open(id);
-    mutex.unlock();
+  /* Only swaps the files - the old ones are closed on the worker */
+  void split(const std::string &id_) {
+    std::lock_guard<std::mutex> lock(filesMutex);
+    rotate(id_, 0, Time);
   }
 
-  void addDigitizer(uint32_t digitizerID) {
-    mutex.lock();
-    getDigitizerInfo(digitizerID);
-    mutex.unlock();
+  /* The datasets are made now, in the current files, and in every new one */
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t n) {
+    const Format added = format<C>(n);
+    Formats formats;
+    {
+      std::lock_guard<std::mutex> lock(filesMutex);
+      Formats &known = digitizers[digitizerID];
+      known[added.type] = added;
+      formats = known;
+    }
+    std::shared_ptr<const Output> out = std::atomic_load(&output);
+    while (true) {
+      std::shared_ptr<File> f = file(out, digitizerID);
+      std::lock_guard<std::mutex> lock(f->mutex);
+      if (f->isOpen()) {
+        f->addDigitizer(digitizerID, formats);
+        return;
+      }
+      out = std::atomic_load(&output);
+    }
   }
 
   static bool network() { return false; }
 
-  template <typename E>
-  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID,
+  size_t bufferSize() const { return bufferSize_; }
+
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
                   uint64_t globalTimeStamp) {
     if (buffer->size() < 1)
       return;
-    mutex.lock();
-    DigitizerInfo &info = getDigitizerInfo(digitizerID);
-    if (info.format == Data::ElementType::None){
-      // write data format identifier to file
-      info.format = E::type();
-      writeAttribute("JADAQ_DATA_TYPE", *info.group, H5::PredType::NATIVE_UINT16, &info.format);
-    }
-    FL_PacketTable *&table = info.getTable(globalTimeStamp);
-    if (table == nullptr) {
-      /// \todo (char*) cast used to get rid of warning, maybe check this is OK?
-      table = new FL_PacketTable(
-          info.group->getId(), (char *)std::to_string(globalTimeStamp).c_str(),
-          buffer->begin()->h5type().getId(),
-          buffer->size()); // TODO find a suitable chunk size - last argument
-    }
-    if (table->AppendPackets(
-            buffer->size(),
-            (char *)buffer->data()+sizeof(Data::Header))) // Fuck this is the worst interface ever!
-    {
-      std::cerr << "Error while writing to HDF5 file: "
-                << "\n\t "
-                << "HDF5::write( " << digitizerID << ", " << globalTimeStamp
-                << ", " << buffer->size() << " )" << std::endl;
+    if (!started.load(std::memory_order_relaxed))
+      started = true;
+    Split split = Open;
+    std::shared_ptr<const Output> out = std::atomic_load(&output);
+    // again with the next files if a split closed the file meanwhile
+    while (!(*file(out, digitizerID))(buffer, digitizerID, globalTimeStamp, split)) {
+      std::this_thread::yield();
+      out = std::atomic_load(&output);
     }
-    mutex.unlock();
+    if (split != Open)
+      splitFull(out, split);
   }
 };
 
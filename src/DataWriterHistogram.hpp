@@ -0,0 +1,95 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Fill per channel charge spectra from the DPP list data on its way to
+ * another DataWriter. Other element types are passed on untouched.
+ *
+ * With a DataWriterNull as output only the spectra are kept.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERHISTOGRAM_HPP
+#define JADAQ_DATAWRITERHISTOGRAM_HPP
+
+#include "ChargeHistograms.hpp"
+#include "DataFormat.hpp"
+#include "DataWriter.hpp"
+#include "container.hpp"
+#include <memory>
+#include <string>
+
+class DataWriterHistogram {
+private:
+  DataWriter output;
+  std::shared_ptr<ChargeHistograms> histograms;
+
+  template <typename L>
+  void fill(const jadaq::buffer<L> *buffer, uint32_t digitizerID) {
+    ChargeHistograms::Spectra &spectra = histograms->spectra(digitizerID);
+    for (const L &e : *buffer)
+      spectra.add(e.channel, e.charge);
+    spectra.entries += buffer->size();
+  }
+  template <typename L>
+  void fill(const jadaq::buffer<Data::DPPQDCWaveformElement<L>> *buffer, uint32_t digitizerID) {
+    ChargeHistograms::Spectra &spectra = histograms->spectra(digitizerID);
+    for (const Data::DPPQDCWaveformElement<L> &e : *buffer)
+      spectra.add(e.listElement.channel, e.listElement.charge);
+    spectra.entries += buffer->size();
+  }
+  template <typename L>
+  void fill(const jadaq::records<Data::DPPQDCWaveformElement<L>> *buffer, uint32_t digitizerID) {
+    ChargeHistograms::Spectra &spectra = histograms->spectra(digitizerID);
+    for (const Data::DPPQDCWaveformElement<L> &e : *buffer)
+      spectra.add(e.listElement.channel, e.listElement.charge);
+    spectra.entries += buffer->size();
+  }
+  template <typename L>
+  void fill(const jadaq::buffer<Data::DPPQDCRawWaveformElement<L>> *buffer, uint32_t digitizerID) {
+    ChargeHistograms::Spectra &spectra = histograms->spectra(digitizerID);
+    for (const Data::DPPQDCRawWaveformElement<L> &e : *buffer)
+      spectra.add(e.listElement.channel, e.listElement.charge);
+    spectra.entries += buffer->size();
+  }
+  void fill(const jadaq::buffer<Data::StdElement751> *, uint32_t) {}
+  void fill(const jadaq::buffer<Data::CoincidenceElement> *, uint32_t) {}
+
+public:
+  DataWriterHistogram(DataWriter &&output_, std::shared_ptr<ChargeHistograms> histograms_)
+      : output(std::move(output_)), histograms(histograms_) {}
+
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t n) {
+    output.addDigitizer<C>(digitizerID, n);
+  }
+
+  void split(const std::string &id) { output.split(id); }
+
+  size_t bufferSize() const { return output.bufferSize(); }
+
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    fill(buffer, digitizerID);
+    output(buffer, digitizerID, globalTimeStamp);
+  }
+};
+
+#endif // JADAQ_DATAWRITERHISTOGRAM_HPP
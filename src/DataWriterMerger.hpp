@@ -0,0 +1,309 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Merge the time sorted output of several digitizers into one time ordered
+ * stream for another DataWriter.
+ *
+ * Every digitizer is queued separately with its board time unwrapped to 64
+ * bits and shifted by a per board offset. An event is passed on once every
+ * digitizer has delivered an event at least as late - or has been quiet for
+ * longer than the timeout, so a board without triggers does not hold back
+ * the others. The queues are merged through a heap keyed on the time of
+ * their first event. Consecutive events from the same digitizer are written
+ * as one buffer with that digitizer's ID, so the output DataWriter sees the
+ * usual per digitizer buffers - just in time order.
+ *
+ * The input must be time sorted per digitizer (DataHandler::setSortWindow).
+ * Calls are serialized by a mutex, as every digitizer writes to the merger.
+ *
+ */
+
+#ifndef JADAQ_DATAWRITERMERGER_HPP
+#define JADAQ_DATAWRITERMERGER_HPP
+
+#include "DataFormat.hpp"
+#include "DataWriter.hpp"
+#include "TimeSorter.hpp"
+#include "container.hpp"
+#include "xtrace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+class DataWriterMerger {
+private:
+  typedef std::chrono::steady_clock Clock;
+
+  /* Events from one digitizer waiting to be merged, and the buffer of the
+   * ones currently being written */
+  struct Queue {
+    virtual ~Queue() = default;
+    virtual bool empty() const = 0;
+    virtual int64_t front() const = 0;
+    /* Move the events up to limit - at least one - to the output buffer.
+     * Returns the time of the last one. */
+    virtual int64_t pop(int64_t limit, DataWriter &output) = 0;
+    virtual void write(DataWriter &output) = 0;
+  };
+
+  /* C is the container type - events of variable length records are
+   * queued in slots of the largest one and written as records again */
+  template <typename C> class QueueImplementation : public Queue {
+  private:
+    typedef typename C::value_type E;
+    const uint32_t digitizerID;
+    const int64_t offset;
+    const size_t slot; // bytes per queued event
+    TimeUnwrapper unwrap;
+    std::vector<char> data;
+    std::vector<int64_t> times;
+    size_t head = 0;
+    /* globalTimeStamp of the input buffers - (end, stamp) */
+    std::deque<std::pair<uint64_t, uint64_t>> stamps;
+    uint64_t received = 0;
+    uint64_t popped = 0;
+    std::shared_ptr<jadaq::pool<C>> pool;
+    C *out;
+    uint64_t outStamp = 0;
+
+    /* Queued in the memory layout of a buffer */
+    void insert(const jadaq::buffer<E> *buffer) {
+      const char *begin = buffer->data() + buffer->header_size();
+      data.insert(data.end(), begin, begin + buffer->size() * slot);
+    }
+    void insert(const jadaq::records<E> *buffer) {
+      size_t end = data.size();
+      data.resize(end + buffer->size() * slot);
+      for (auto itr = buffer->begin(); itr != buffer->end(); ++itr, end += slot)
+        memcpy(&data[end], &*itr, itr.size());
+    }
+
+  public:
+    QueueImplementation(uint32_t digitizerID_, int64_t offset_, const C *like,
+                        size_t bufferSize)
+        : digitizerID(digitizerID_), offset(offset_),
+          slot(jadaq::buffer<E>::slot_size(like->object_size())),
+          unwrap(E::timeBits),
+          pool(jadaq::pool<C>::create(bufferSize, like->object_size(),
+                                      sizeof(Data::Header), 1)),
+          out(pool->acquire()) {}
+    ~QueueImplementation() { out->release(); }
+
+    /* Returns the time of the last event */
+    int64_t append(const C *buffer, uint64_t globalTimeStamp) {
+      if (head > 0 && head * 2 >= times.size()) {
+        data.erase(data.begin(), data.begin() + head * slot);
+        times.erase(times.begin(), times.begin() + head);
+        head = 0;
+      }
+      const size_t n = buffer->size();
+      insert(buffer);
+      for (const E &element : *buffer)
+        times.push_back((int64_t)unwrap(element.timeStamp()) + offset);
+      received += n;
+      stamps.emplace_back(received, globalTimeStamp);
+      return times.back();
+    }
+
+    bool empty() const override { return head == times.size(); }
+    int64_t front() const override { return times[head]; }
+
+    int64_t pop(int64_t limit, DataWriter &output) override {
+      int64_t time;
+      do {
+        while (stamps.front().first <= popped)
+          stamps.pop_front();
+        const E &element = *reinterpret_cast<const E *>(&data[head * slot]);
+        if (out->empty())
+          outStamp = stamps.front().second;
+        if (!jadaq::append(*out, element)) {
+          write(output);
+          outStamp = stamps.front().second;
+          jadaq::append(*out, element);
+        }
+        time = times[head++];
+        ++popped;
+      } while (head < times.size() && times[head] <= limit);
+      return time;
+    }
+
+    void write(DataWriter &output) override {
+      if (out->empty())
+        return;
+      output(out, digitizerID, outStamp);
+      out->release();
+      out = pool->acquire();
+    }
+  };
+
+  struct Input {
+    uint32_t digitizerID;
+    Clock::time_point lastSeen;
+    int64_t last = std::numeric_limits<int64_t>::min(); // newest time received
+    std::unique_ptr<Queue> queue;
+  };
+
+  std::mutex mutex;
+  DataWriter output;
+  const Clock::duration timeout;
+  std::map<uint32_t, int64_t> offsets;
+  std::vector<Input> inputs;
+  std::vector<std::pair<int64_t, size_t>> heap;
+  int64_t lastEmitted = std::numeric_limits<int64_t>::min();
+  uint64_t lateCount = 0;
+  uint64_t lateReported = 0;
+
+  Input &input(uint32_t digitizerID) {
+    for (Input &in : inputs) {
+      if (in.digitizerID == digitizerID)
+        return in;
+    }
+    add(digitizerID);
+    return inputs.back();
+  }
+
+  void add(uint32_t digitizerID) {
+    Input in;
+    in.digitizerID = digitizerID;
+    in.lastSeen = Clock::now();
+    inputs.push_back(std::move(in));
+  }
+
+  /* Pass on every event no digitizer still being waited for can precede.
+   * A queue is drained until the next queue in the heap has an earlier event,
+   * so the heap is only touched when the output switches digitizer. */
+  void merge(bool all) {
+    const Clock::time_point now = Clock::now();
+    int64_t bound = std::numeric_limits<int64_t>::max();
+    if (!all) {
+      for (const Input &in : inputs) {
+        bool waiting = (in.queue && !in.queue->empty()) || now - in.lastSeen < timeout;
+        if (waiting)
+          bound = std::min(bound, in.last);
+      }
+    }
+    typedef std::pair<int64_t, size_t> Entry;
+    std::greater<Entry> later;
+    heap.clear();
+    for (size_t i = 0; i < inputs.size(); ++i) {
+      if (inputs[i].queue && !inputs[i].queue->empty())
+        heap.emplace_back(inputs[i].queue->front(), i);
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    Queue *current = nullptr;
+    while (!heap.empty() && heap.front().first <= bound) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      Entry entry = heap.back();
+      heap.pop_back();
+      Queue *queue = inputs[entry.second].queue.get();
+      if (queue != current) {
+        if (current)
+          current->write(output);
+        current = queue;
+      }
+      if (entry.first < lastEmitted)
+        ++lateCount;
+      int64_t limit = heap.empty() ? bound : std::min(bound, heap.front().first);
+      lastEmitted = std::max(lastEmitted, queue->pop(limit, output));
+      if (!queue->empty()) {
+        heap.emplace_back(queue->front(), entry.second);
+        std::push_heap(heap.begin(), heap.end(), later);
+      }
+    }
+    if (current)
+      current->write(output);
+    if (lateCount != lateReported) {
+      if (lateReported == 0)
+        XTRACE(DATAH, WAR, "Events arriving later than the merge timeout - output is not strictly ordered");
+      XTRACE(DATAH, INF, "%d events merged out of order", lateCount - lateReported);
+      lateReported = lateCount;
+    }
+  }
+
+public:
+  DataWriterMerger(DataWriter &&output_, std::chrono::milliseconds timeout_)
+      : output(std::move(output_)), timeout(timeout_) {}
+  ~DataWriterMerger() {
+    std::lock_guard<std::mutex> lock(mutex);
+    merge(true);
+  }
+
+  /* Board time offset in clock ticks, added before merging */
+  void setTimeOffset(uint32_t digitizerID, int64_t offset) {
+    std::lock_guard<std::mutex> lock(mutex);
+    offsets[digitizerID] = offset;
+  }
+
+  /* The merged buffers are of the same type, under the digitizer's ID */
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    input(digitizerID);
+    output.addDigitizer<C>(digitizerID, n);
+  }
+
+  /* Everything queued goes in the files being closed */
+  void split(const std::string &id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    merge(true);
+    output.split(id);
+  }
+
+  /* Merge without new data, so the last events are passed on once the
+   * digitizers go quiet for the timeout - called by the acquisition loop */
+  void tick() {
+    std::lock_guard<std::mutex> lock(mutex);
+    merge(false);
+  }
+
+  /* That of the output - a record must fit an input buffer */
+  size_t bufferSize() const { return output.bufferSize(); }
+
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    if (buffer->empty())
+      return;
+    std::lock_guard<std::mutex> lock(mutex);
+    Input &in = input(digitizerID);
+    if (!in.queue)
+      in.queue.reset(new QueueImplementation<C>(digitizerID, offsets[digitizerID], buffer,
+                                                 output.bufferSize()));
+    QueueImplementation<C> *queue = dynamic_cast<QueueImplementation<C> *>(in.queue.get());
+    if (!queue)
+      throw std::runtime_error("Digitizer changed element type while merging");
+    in.last = std::max(in.last, queue->append(buffer, globalTimeStamp));
+    in.lastSeen = Clock::now();
+    merge(false);
+  }
+
+  /* Events passed on behind a later one */
+  uint64_t late() const { return lateCount; }
+};
+
+#endif // JADAQ_DATAWRITERMERGER_HPP
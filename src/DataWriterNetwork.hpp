@@ -27,11 +27,16 @@
 
 /* Default to jumbo frame sized buffer */
 #include "DataFormat.hpp"
+#include "WaveformCodec.hpp"
 #include "container.hpp"
 #include <boost/asio.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/bind.hpp>
 #include "xtrace.h"
+#include <atomic>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
 
 using boost::asio::ip::udp;
 
@@ -41,11 +46,127 @@ private:
   boost::asio::io_service ioService;
   udp::endpoint remoteEndpoint;
   udp::socket *socket = nullptr;
-  uint32_t seqNum{0};
+  std::atomic<uint32_t> seqNum{0};
+  size_t payload; // bytes per datagram
+  bool compress;
+  std::vector<char> packet; // one datagram
+  std::vector<char> record;
+
+  void send(char *data, size_t size, uint16_t elementType, uint32_t elements,
+            uint32_t digitizerID, uint64_t globalTimeStamp) {
+    Data::Header *header = (Data::Header *)data;
+    header->seqNum = seqNum++;
+    header->runID = runID;
+    header->globalTime = globalTimeStamp;
+    header->digitizerID = digitizerID;
+    header->version = Data::currentVersion;
+    header->elementType = elementType;
+    header->setElements(elements);
+    socket->send_to(boost::asio::buffer(data, size), remoteEndpoint);
+  }
+
+  /* Elements of a buffer larger than a datagram are sent in several */
+  template <typename E>
+  void sendSplit(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    const size_t elementSize = buffer->object_size();
+    const size_t perPacket = (payload - sizeof(Data::Header)) / elementSize;
+    for (size_t first = 0; first < buffer->size(); first += perPacket) {
+      const size_t size = buffer->serialize(packet.data() + sizeof(Data::Header), first, perPacket);
+      send(packet.data(), sizeof(Data::Header) + size, E::type(), (uint32_t)(size / elementSize),
+           digitizerID, globalTimeStamp);
+    }
+  }
+
+  /* Records are sent whole, as many as fit in a datagram */
+  template <typename E>
+  void sendSplit(const jadaq::records<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    const uint16_t type = Data::RecordsBase | E::type();
+    char *const begin = packet.data();
+    char *next = begin + sizeof(Data::Header);
+    uint32_t n = 0;
+    for (auto itr = buffer->begin(); itr != buffer->end(); ++itr) {
+      const size_t size = jadaq::records<E>::record_size(itr.size());
+      if ((size_t)(next - begin) + size > payload) {
+        if (sizeof(Data::Header) + size > payload)
+          throw std::runtime_error("Record does not fit in a datagram");
+        send(begin, next - begin, type, n, digitizerID, globalTimeStamp);
+        next = begin + sizeof(Data::Header);
+        n = 0;
+      }
+      memcpy(next, (const char *)&*itr - jadaq::records<E>::prefix_size, size);
+      next += size;
+      ++n;
+    }
+    if (n > 0)
+      send(begin, next - begin, type, n, digitizerID, globalTimeStamp);
+  }
+
+  /* Sent from the buffer itself unless its elements are padded */
+  template <typename E>
+  void sendWhole(const jadaq::buffer<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    char *data = (char *)buffer->data();
+    if (!buffer->contiguous()) {
+      data = packet.data();
+      buffer->serialize(data + sizeof(Data::Header));
+    }
+    send(data, buffer->data_size(), E::type(), (uint32_t)buffer->size(), digitizerID,
+         globalTimeStamp);
+  }
+  template <typename E>
+  void sendWhole(const jadaq::records<E> *buffer, uint32_t digitizerID, uint64_t globalTimeStamp) {
+    send((char *)buffer->data(), buffer->data_size(), Data::RecordsBase | E::type(),
+         (uint32_t)buffer->size(), digitizerID, globalTimeStamp);
+  }
+
+  /* Packed records are of varying size - a buffer is sent in as many
+   * datagrams as it takes */
+  template <typename C>
+  void sendPacked(const C *buffer, uint16_t type, uint32_t digitizerID,
+                  uint64_t globalTimeStamp) {
+    size_t fixed, countOffset;
+    Data::packedLayout(type, fixed, countOffset);
+    char *const begin = packet.data();
+    char *const end = begin + payload;
+    char *next = begin + sizeof(Data::Header);
+    uint32_t n = 0;
+    for (const auto &e : *buffer) {
+      const char *element = (const char *)&e;
+      uint16_t samples;
+      memcpy(&samples, element + countOffset, sizeof(samples));
+      const size_t max = WaveformCodec::maxRecordSize(fixed, samples);
+      if (next + max <= end) {
+        next += WaveformCodec::packRecord(element, fixed, countOffset, next);
+        ++n;
+        continue;
+      }
+      if (max > record.size())
+        record.resize(max);
+      size_t size = WaveformCodec::packRecord(element, fixed, countOffset, record.data());
+      if (next + size > end) {
+        if (sizeof(Data::Header) + size > payload)
+          throw std::runtime_error("Packed waveform does not fit in a datagram");
+        send(begin, next - begin, type, n, digitizerID, globalTimeStamp);
+        next = begin + sizeof(Data::Header);
+        n = 0;
+      }
+      memcpy(next, record.data(), size);
+      next += size;
+      ++n;
+    }
+    if (n > 0)
+      send(begin, next - begin, type, n, digitizerID, globalTimeStamp);
+  }
 
 public:
-  DataWriterNetwork(const std::string &address, const std::string &port, uint64_t runID_)
-      : runID(runID_) {
+  /* mtu is that of the path to the receiver - 1500 without jumbo frames.
+   * With compress waveform samples are sent packed by WaveformCodec. */
+  DataWriterNetwork(const std::string &address, const std::string &port, uint64_t runID_,
+                    size_t mtu = JUMBO_PAYLOAD, bool compress_ = false)
+      : runID(runID_), payload(mtu - (UDP_HEADER + IP_HEADER)), compress(compress_),
+        packet(payload) {
+    if (mtu < 576 || mtu > 65535) {
+      throw std::invalid_argument("MTU must be between 576 and 65535 bytes");
+    }
     XTRACE(DEBUG, DEB, "DataWriterNetwork() - address %s : %s", address.c_str(), port.c_str());
     try {
       udp::resolver resolver(ioService);
@@ -60,26 +181,30 @@ public:
     }
   }
 
-  void addDigitizer(uint32_t digitizerID) {
+  template <typename C> void addDigitizer(uint32_t, size_t) {
     // TODO: This is where we will send the configuration over TCP
   }
 
   void split(const std::string&) {}
 
-  template <typename E>
-  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizerID,
+  /* Waveform buffers of a few datagrams are packed to about one */
+  static constexpr const size_t packedBuffers = 4;
+
+  size_t bufferSize() const { return compress ? packedBuffers * payload : payload; }
+
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizerID,
                   uint64_t globalTimeStamp) {
-    Data::Header *header = (Data::Header *)buffer->data();
-    header->seqNum = seqNum;
-    seqNum++;
-    header->runID = runID;
-    header->globalTime = globalTimeStamp;
-    header->digitizerID = digitizerID;
-    header->version = Data::currentVersion;
-    header->elementType = E::type();
-    header->numElements = (uint16_t)buffer->size();
-    socket->send_to(boost::asio::buffer(buffer->data(), buffer->data_size()),
-                    remoteEndpoint);
+    typedef typename C::value_type E;
+    if (compress) {
+      const Data::ElementType packed = Data::packedType(E::type());
+      if (packed != Data::None)
+        sendPacked(buffer, packed, digitizerID, globalTimeStamp);
+      else
+        sendSplit(buffer, digitizerID, globalTimeStamp);
+      return;
+    }
+    sendWhole(buffer, digitizerID, globalTimeStamp);
   }
 };
 
@@ -36,6 +36,7 @@ class DataWriterText {
 private:
   const std::string &pathname;
   const std::string &basename;
+  const size_t bufferSize_;
 
   std::fstream *file = nullptr;
   std::mutex mutex;
@@ -56,9 +57,11 @@ private:
   }
 
 public:
+  static constexpr const size_t defaultBufferSize = 1 << 20;
+
   DataWriterText(const std::string &pathname_, const std::string &basename_,
-                 const std::string &&id)
-      : pathname(pathname_), basename(basename_) {
+                 const std::string &&id, size_t bufferSize = defaultBufferSize)
+      : pathname(pathname_), basename(basename_), bufferSize_(bufferSize) {
     open(id);
   }
 
@@ -68,7 +71,7 @@ public:
     mutex.unlock();
   }
 
-  void addDigitizer(uint32_t digitizerID) {
+  template <typename C> void addDigitizer(uint32_t digitizerID, size_t) {
     mutex.lock();
     *file << "# digitizerID: " << digitizerID << std::endl;
     mutex.unlock();
@@ -76,6 +79,8 @@ public:
 
   static bool network() { return false; }
 
+  size_t bufferSize() const { return bufferSize_; }
+
   void split(const std::string &id) {
     mutex.lock();
     close();
@@ -83,9 +88,10 @@ public:
     mutex.unlock();
   }
 
-  template <typename E>
-  void operator()(const jadaq::buffer<E> *buffer, uint32_t digitizer,
+  template <typename C>
+  void operator()(const C *buffer, uint32_t digitizer,
                   uint64_t globalTimeStamp) {
+    typedef typename C::value_type E;
     mutex.lock();
     *file << "#" << PRINTH(digitizer) << " ";
     E::headerOn(*file);
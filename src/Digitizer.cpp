@@ -323,16 +323,14 @@ void Digitizer::initialize(DataWriter& dataWriter)
     readoutBuffer.size = 9000;
     readoutBuffer.data = (char *)malloc(9000);
     uint32_t groups = 16;
-    acqWindowSize = new uint32_t[groups];
-    dataWriter.addDigitizer(digitizerID());
+    acqWindowSize = new uint32_t[groups]();
     dataHandler.initialize<Data::ListElement422>(dataWriter, digitizerID(), groups,
-                                                 waveforms, acqWindowSize);
+                                                 waveforms, acqWindowSize, latency.get());
     return;
   }
 
 
     readoutBuffer = digitizer->mallocReadoutBuffer();
-    dataWriter.addDigitizer(digitizerID());
     // model- and firmware-dependent initialization
     switch (digitizer->familyCode()){
     case CAEN_DGTZ_XX751_FAMILY_CODE:
@@ -361,7 +359,7 @@ void Digitizer::initialize(DataWriter& dataWriter)
             // TODO: initialize acqWindowSize elsewhere for all digitizer types
             acqWindowSize[i] = 0; // no "jitter" expected
           }
-          dataHandler.initialize<Data::StdElement751>(dataWriter,digitizerID(), groups(), waveforms, acqWindowSize);
+          dataHandler.initialize<Data::StdElement751>(dataWriter,digitizerID(), groups(), waveforms, acqWindowSize, latency.get());
           break;
         }
         default:
@@ -390,8 +388,18 @@ void Digitizer::initialize(DataWriter& dataWriter)
             uint32_t groups = this->groups();
             acqWindowSize = new uint32_t[groups];
             extras = bc.extras();
-            if (bc.waveform())
-                waveforms = digitizer->getRecordLength(0);
+            /* Groups may have different record lengths - buffers are sized
+             * for the longest, and waveforms are stored as variable length
+             * records so the shorter ones do not take as much */
+            bool sameLength = true;
+            waveforms = 0;
+            for (uint32_t i = 0; bc.waveform() && i < groups; ++i)
+            {
+                uint32_t length = digitizer->getRecordLength(i);
+                sameLength = sameLength && (i == 0 || length == waveforms);
+                waveforms = std::max(waveforms, length);
+            }
+            dataHandler.setRecords(!sameLength && !rawWaveforms);
             for (uint32_t i = 0; i < groups; ++i)
             {
                 acqWindowSize[i] = std::max({digitizer->getRecordLength(i)*bc.waveform(),
@@ -399,19 +407,26 @@ void Digitizer::initialize(DataWriter& dataWriter)
                       digitizer->getDPPGateWidth(i) - digitizer->getDPPGateOffset(i)+ digitizer->getDPPPreTriggerSize(i)}) * 2; // Lets be conservative :P
             }
 
-            if (waveforms)
+            if (waveforms && rawWaveforms)
+            {
+                if (extras)
+                    dataHandler.initialize<Data::DPPQDCRawWaveformElement<Data::ListElement8222> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize,latency.get());
+                else
+                    dataHandler.initialize<Data::DPPQDCRawWaveformElement<Data::ListElement422> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize,latency.get());
+            }
+            else if (waveforms)
               {
                 if (extras)
-                    dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement8222> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
+                    dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement8222> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize,latency.get());
                 else
-                    dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement422> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
+                    dataHandler.initialize<Data::DPPQDCWaveformElement<Data::ListElement422> >(dataWriter,digitizerID(),groups,waveforms,acqWindowSize,latency.get());
             }
             else if (extras)
             {
-                dataHandler.initialize<Data::ListElement8222>(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
+                dataHandler.initialize<Data::ListElement8222>(dataWriter,digitizerID(),groups,waveforms,acqWindowSize,latency.get());
             } else
             {
-                dataHandler.initialize<Data::ListElement422>(dataWriter,digitizerID(),groups,waveforms,acqWindowSize);
+                dataHandler.initialize<Data::ListElement422>(dataWriter,digitizerID(),groups,waveforms,acqWindowSize,latency.get());
             }
             break;
           }
@@ -459,6 +474,8 @@ bool Digitizer::ready() {
 }
 
 void Digitizer::startAcquisition() {
+  acquisitionStart = std::chrono::steady_clock::now();
+  lastStatusSample = acquisitionStart;
   if (id == 0xaaaabbbb) {
     return;
   }
@@ -470,19 +487,72 @@ void Digitizer::startAcquisition() {
   digitizer->startAcquisition();
 }
 
+Digitizer::Stats Digitizer::getStats() const {
+  Stats stats;
+  stats.bytesRead = counters->bytesRead.load();
+  stats.eventsFound = counters->eventsFound.load();
+  stats.readouts = counters->readouts.load();
+  stats.statusSamples = counters->statusSamples.load();
+  stats.readySamples = counters->readySamples.load();
+  stats.fullSamples = counters->fullSamples.load();
+  stats.overflows = counters->overflows.load();
+  stats.eventsStored = counters->eventsStored.load();
+  stats.fullSeconds = counters->fullMicroseconds.load() / 1e6;
+  double running = std::chrono::duration<double>(std::chrono::steady_clock::now() - acquisitionStart).count();
+  if (running > stats.fullSeconds) {
+    stats.lostTriggers = stats.fullSeconds * stats.eventsFound / (running - stats.fullSeconds);
+  }
+  return stats;
+}
+
+void Digitizer::sampleStatus() {
+  if (id == 0xaaaabbbb || statusInterval.count() == 0) {
+    return;
+  }
+  auto now = std::chrono::steady_clock::now();
+  if (now - lastStatusSample < statusInterval) {
+    return;
+  }
+  caen::Digitizer::AcquisitionStatus status{digitizer->getAcquisitionStatus()};
+  ++counters->statusSamples;
+  if (status.eventReady()) {
+    ++counters->readySamples;
+  }
+  /* Count the whole interval as full - we cannot tell when it filled up */
+  if (status.eventFull()) {
+    ++counters->fullSamples;
+    counters->fullMicroseconds +=
+        std::chrono::duration_cast<std::chrono::microseconds>(now - lastStatusSample).count();
+    if (!boardFull) {
+      ++counters->overflows;
+      XTRACE(DIGIT, NOTE, "Memory full on digitizer %s", name().c_str());
+    }
+  }
+  boardFull = status.eventFull();
+  if (eventStoredAvailable) {
+    try {
+      counters->eventsStored.set(digitizer->getEventStored());
+    } catch (caen::Error &e) {
+      XTRACE(DIGIT, INF, "No event stored register on digitizer %s", name().c_str());
+      eventStoredAvailable = false;
+    }
+  }
+  lastStatusSample = now;
+}
+
 void Digitizer::acquisition() {
   XTRACE(DIGIT, DEB, "Read at most %db data from %s", readoutBuffer.size, name().c_str());
 
   // NULL Digitizer "readout"
   if (id == 0xaaaabbbb) {
     memset(readoutBuffer.data, 0x00, 2048); // emulate readData() function
-    (*(uint32_t *)(readoutBuffer.data +  0)) = 0xa0000030;  // magic value 0xa + size of
+    (*(uint32_t *)(readoutBuffer.data +  0)) = 0xa000000c;  // magic value 0xa + size in words
     (*(uint32_t *)(readoutBuffer.data +  4)) = 0x00000001;  // group mask 1
     (*(uint32_t *)(readoutBuffer.data +  8)) = 0x00000000;  // unused ?
     (*(uint32_t *)(readoutBuffer.data + 12)) = 0x00000000; // unused ?
 
     // Group 0 - channels 0 - 15
-    (*(uint32_t *)(readoutBuffer.data + 16)) = 0x80000020; // MSB 1 + data size 32 bytes
+    (*(uint32_t *)(readoutBuffer.data + 16)) = 0x80000008; // MSB 1 + data size 8 words
     (*(uint32_t *)(readoutBuffer.data + 20)) = 0x60000001; // 0110 0 ....
 
     (*(uint32_t *)(readoutBuffer.data + 24)) = 0x01020304; // Time
@@ -495,28 +565,35 @@ void Digitizer::acquisition() {
     (*(uint32_t *)(readoutBuffer.data + 44)) = 0xf0001000; // subch 15, charge 4096
 
     readoutBuffer.dataSize = 48; // emulate readData() function
-    stats.bytesRead += readoutBuffer.dataSize;
+    counters->bytesRead += readoutBuffer.dataSize;
 
     DPPQDCEventIterator iterator{readoutBuffer};
     size_t events = dataHandler(iterator);
-    stats.eventsFound += events;
+    counters->eventsFound += events;
     //usleep(1000000);
     return;
   }
 
   /* We use slave terminated mode like in the sample from CAEN Digitizer library
    * docs. */
+  uint64_t readStart = TSCTimer::rdtsc();
   digitizer->readData(readoutBuffer, CAEN_DGTZ_SLAVE_TERMINATED_READOUT_MBLT);
+  latency->readout.record(TSCTimer::rdtsc() - readStart);
   uint32_t bytesRead = readoutBuffer.dataSize;
   XTRACE(DIGIT, DEB, "Read %db of acquired data", bytesRead);
-  stats.readouts++;
+  ++counters->readouts;
 
   /* NOTE: check and skip if there's no actual events to handle */
   if (bytesRead < 1) {
     XTRACE(DIGIT, DEB, "No data to read - skip further handling.");
     return;
   }
-  stats.bytesRead += bytesRead;
+  counters->bytesRead += bytesRead;
+  latency->blockSize.record(bytesRead);
+  if (capture) {
+    capture->write(digitizerID(), digitizer->familyCode(), (uint32_t)firmware,
+                   readoutBuffer);
+  }
 
     // model- and firmware-dependent acquisition
     switch (digitizer->familyCode()){
@@ -527,7 +604,7 @@ void Digitizer::acquisition() {
           {
           StdBLTEventIterator iterator{readoutBuffer};
           size_t events = dataHandler(iterator);
-          stats.eventsFound += events;
+          counters->eventsFound += events;
           break;
           }
         default:
@@ -553,7 +630,7 @@ void Digitizer::acquisition() {
           {
             DPPQDCEventIterator iterator{readoutBuffer};
             size_t events = dataHandler(iterator);
-            stats.eventsFound += events;
+            counters->eventsFound += events;
             break;
           }
         case CAEN_DGTZ_NotDPPFirmware:
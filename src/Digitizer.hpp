@@ -30,8 +30,13 @@
 
 #include "FunctionID.hpp"
 #include "caen.hpp"
+#include "Counter.hpp"
 #include "DataHandler.hpp"
 #include "DataWriter.hpp"
+#include "EventFilter.hpp"
+#include "WaveformWindow.hpp"
+#include "LatencyHistogram.hpp"
+#include "ReadoutCapture.hpp"
 #include <atomic>
 #include <boost/thread/thread.hpp>
 #include <chrono>
@@ -42,10 +47,19 @@
 
 class Digitizer {
 public:
+  /* Snapshot of the acquisition counters */
   struct Stats {
     uint64_t bytesRead = 0;
     uint64_t eventsFound = 0;
     uint64_t readouts = 0;
+    /* Board status sampled between readouts */
+    uint64_t statusSamples = 0;
+    uint64_t readySamples = 0; // data waiting on the board
+    uint64_t fullSamples = 0;  // board memory full
+    uint64_t overflows = 0;    // episodes of full memory
+    uint64_t eventsStored = 0; // at the last sample - if the firmware has it
+    double fullSeconds = 0.0;  // estimated time spent with memory full
+    double lostTriggers = 0.0; // estimated from the event rate while not full
   };
 
 private:
@@ -55,11 +69,36 @@ private:
   uint32_t id;
   uint32_t waveforms = 0;
   bool extras = false;
+  bool rawWaveforms = false;
   uint32_t *acqWindowSize = nullptr;
+  std::unique_ptr<StageLatency> latency{new StageLatency}; // outlives dataHandler
+  std::unique_ptr<EventFilter> filter{new EventFilter};    // outlives dataHandler
+  std::unique_ptr<WaveformWindow> window{new WaveformWindow}; // outlives dataHandler
   DataHandler dataHandler;
   std::set<uint32_t> manipulatedRegisters;
   caen::ReadoutBuffer readoutBuffer;
-  Stats stats;
+  ReadoutCapture *capture = nullptr;
+  /* Updated by the acquisition thread, read by the service thread */
+  struct Counters {
+    Counter bytesRead;
+    Counter eventsFound;
+    Counter readouts;
+    Counter statusSamples;
+    Counter readySamples;
+    Counter fullSamples;
+    Counter overflows;
+    Counter eventsStored;
+    Counter fullMicroseconds;
+    std::atomic<bool> active{false}; // being read out
+  };
+  std::unique_ptr<Counters> counters{new Counters};
+  /* Board status sampling */
+  std::chrono::steady_clock::time_point acquisitionStart;
+  std::chrono::steady_clock::time_point lastStatusSample;
+  std::chrono::milliseconds statusInterval{100};
+  bool boardFull = false;
+  bool eventStoredAvailable = true;
+  int64_t timeOffset = 0;
 
 public:
   /* Connection parameters */
@@ -67,7 +106,6 @@ public:
   const int linkNum;
   const int conetNode;
   const uint32_t VMEBaseAddress;
-  bool active = false;
   Digitizer() = delete;
   Digitizer(Digitizer &) = delete;
   Digitizer(Digitizer &&) = default;
@@ -86,6 +124,13 @@ public:
     return digitizer->serialNumber();
   }
   const uint32_t digitizerID() { return id; }
+  /* Read out by the acquisition loop - until it fails */
+  bool active() const { return counters->active.load(std::memory_order_relaxed); }
+  void setActive(bool active) { counters->active.store(active, std::memory_order_relaxed); }
+  /* Standard firmware events rather than DPP list data */
+  bool standardFirmware() const {
+    return id != 0xaaaabbbb && firmware == CAEN_DGTZ_NotDPPFirmware;
+  }
   uint32_t channels() const { return digitizer->channels(); }
   uint32_t groups() const { return digitizer->groups(); }
   void close(); // TODO: Why do we need close() in stead of using a destructor
@@ -97,7 +142,36 @@ public:
   const std::set<uint32_t> &getRegisters() const { return manipulatedRegisters; }
   bool ready();
   void startAcquisition();
-  const Stats &getStats() const { return stats; }
+  Stats getStats() const;
+  /* Read the board status registers if statusInterval has passed since the
+   * last time. Meant to be called between readouts. */
+  void sampleStatus();
+  /* Time sort events within window clock ticks - call before initialize() */
+  void setSortWindow(uint64_t window) { dataHandler.setSortWindow(window); }
+  /* Write sorted events held for msecs - call before initialize() */
+  void setSortHold(int64_t msecs) { dataHandler.setSortHold(msecs); }
+  /* Store DPP-QDC waveform words undecoded - call before initialize() */
+  void setRawWaveforms(bool raw) { rawWaveforms = raw; }
+  /* Zero disables status sampling */
+  void setStatusInterval(std::chrono::milliseconds interval) { statusInterval = interval; }
+  const StageLatency &getLatency() const { return *latency; }
+  /* Software cut on the decoded events - call before initialize() */
+  void addFilterRule(const EventFilter::Rule &rule) {
+    filter->add(rule);
+    dataHandler.setFilter(filter.get());
+  }
+  std::vector<EventFilter::RuleStats> getFilterStats() const { return filter->getStats(); }
+  /* Keep only a window of the DPP-QDC waveforms of channels - call before
+   * initialize() */
+  void setWaveformWindow(uint64_t channels, const WaveformWindow::Window &w) {
+    window->set(channels, w);
+    dataHandler.setWindow(window.get());
+  }
+  /* Added to the board time when merging digitizers - in clock ticks */
+  void setTimeOffset(int64_t offset) { timeOffset = offset; }
+  int64_t getTimeOffset() const { return timeOffset; }
+  /* Dump every raw readout block to capture (for offline benchmarking) */
+  void setCapture(ReadoutCapture *capture_) { capture = capture_; }
   // TODO: Sould we do somthing different than expose these functions?
   void stopAcquisition() {
     if (id == 0xaaaabbbb) {
@@ -0,0 +1,148 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Software cuts on the DPP list data of one digitizer, applied before the
+ * events are buffered.
+ *
+ * Every rule covers a set of channels and either accepts a window of charge
+ * or baseline values or rejects everything. An event is kept if it passes
+ * every rule covering its channel. Each rule is compiled to a channel mask
+ * and an unsigned window compare, and run as one branch free pass over a
+ * batch of decoded values (struct of arrays), which the compiler can
+ * vectorize.
+ *
+ */
+
+#ifndef JADAQ_EVENTFILTER_HPP
+#define JADAQ_EVENTFILTER_HPP
+
+#include "Counter.hpp"
+#include <cstdint>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class EventFilter {
+public:
+  static constexpr const size_t batchSize = 256;
+  static constexpr const int maxChannels = 64;
+
+  enum Field { Charge, Baseline, None };
+
+  struct Rule {
+    std::string name;
+    uint64_t channels = 0; // mask
+    Field field = None;    // None rejects every event on the channels
+    uint16_t low = 0;
+    uint16_t high = 0;
+  };
+
+  /* Events accepted and rejected by a rule - an event failing several
+   * rules is counted as rejected by the first one */
+  struct RuleStats {
+    std::string name;
+    uint64_t accepted;
+    uint64_t rejected;
+  };
+
+  /* Decoded values of up to batchSize events */
+  struct Batch {
+    uint16_t channel[batchSize];
+    uint16_t charge[batchSize];
+    uint16_t baseline[batchSize];
+    uint8_t keep[batchSize];
+  };
+
+  void add(const Rule &rule) {
+    if (rule.field != None && rule.low > rule.high)
+      throw std::invalid_argument("Empty filter window in rule " + rule.name);
+    Instruction in;
+    in.channels = rule.channels;
+    in.field = rule.field;
+    in.low = rule.low;
+    in.span = rule.field == None ? -1 : (int32_t)(rule.high - rule.low);
+    program.push_back(in);
+    rules.push_back(rule);
+    counters.emplace_back();
+  }
+
+  bool empty() const { return program.empty(); }
+  bool needsBaseline() const {
+    for (const Instruction &in : program) {
+      if (in.field == Baseline)
+        return true;
+    }
+    return false;
+  }
+
+  /* Clear keep[] of the first n events of the batch that fail a rule.
+   * Returns the number kept. */
+  size_t operator()(Batch &batch, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+      batch.keep[i] = 1;
+    for (size_t r = 0; r < program.size(); ++r) {
+      const Instruction &in = program[r];
+      const uint16_t *value = in.field == Baseline ? batch.baseline : batch.charge;
+      uint32_t accepted = 0;
+      uint32_t rejected = 0;
+      for (size_t i = 0; i < n; ++i) {
+        const uint16_t channel = batch.channel[i];
+        const uint8_t covered = (uint8_t)((in.channels >> (channel & 63)) & (channel < 64));
+        const uint8_t pass = (int32_t)(uint16_t)(value[i] - in.low) <= in.span;
+        const uint8_t fail = covered & (pass ^ 1);
+        rejected += fail & batch.keep[i];
+        accepted += covered & pass;
+        batch.keep[i] &= fail ^ 1;
+      }
+      counters[r].accepted += accepted;
+      counters[r].rejected += rejected;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i)
+      kept += batch.keep[i];
+    return kept;
+  }
+
+  std::vector<RuleStats> getStats() const {
+    std::vector<RuleStats> stats;
+    for (size_t r = 0; r < rules.size(); ++r)
+      stats.push_back({rules[r].name, counters[r].accepted.load(), counters[r].rejected.load()});
+    return stats;
+  }
+
+private:
+  struct Instruction {
+    uint64_t channels;
+    Field field;
+    uint16_t low;
+    int32_t span; // value - low must be at most span, -1 never passes
+  };
+  struct Counters {
+    Counter accepted;
+    Counter rejected;
+  };
+  std::vector<Instruction> program;
+  std::vector<Rule> rules;
+  std::deque<Counters> counters; // Counter does not move
+};
+
+#endif // JADAQ_EVENTFILTER_HPP
@@ -0,0 +1,60 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * The one lock of every HDF5 call in the process, without a thread safe HDF5.
+ *
+ * A stock HDF5 must not be called from two threads at once - not even on
+ * different files - so the HDF5 writers, their worker threads and the
+ * histogram snapshots all take this lock. With a thread safe build HDF5
+ * serializes itself and an HDF5Lock does nothing.
+ *
+ */
+
+#ifndef JADAQ_HDF5LOCK_HPP
+#define JADAQ_HDF5LOCK_HPP
+
+#include <H5public.h>
+#include <mutex>
+
+class HDF5Lock {
+public:
+#ifdef H5_HAVE_THREADSAFE
+  static constexpr const bool threadsafe = true;
+#else
+  static constexpr const bool threadsafe = false;
+#endif
+
+  static std::mutex &mutex() {
+    static std::mutex m;
+    return m;
+  }
+
+  HDF5Lock() : lock(mutex(), std::defer_lock) {
+    if (!threadsafe)
+      lock.lock();
+  }
+  HDF5Lock(const HDF5Lock &) = delete;
+
+private:
+  std::unique_lock<std::mutex> lock;
+};
+
+#endif // JADAQ_HDF5LOCK_HPP
@@ -0,0 +1,148 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Fixed size log-linear histogram (in the style of HdrHistogram) for
+ * recording latencies and sizes on the acquisition path.
+ *
+ * Values below 2^subBits get a bucket each, above that every power of two
+ * is split in 2^subBits linear sub-buckets, i.e. the relative error is
+ * below 2^-subBits. Recording is a couple of shifts and one relaxed store,
+ * and must only be done from a single thread. Any thread may read.
+ *
+ */
+
+#ifndef JADAQ_LATENCYHISTOGRAM_HPP
+#define JADAQ_LATENCYHISTOGRAM_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+class LatencyHistogram {
+public:
+  static constexpr const unsigned subBits = 5;
+  static constexpr const unsigned maxBits = 40; // larger values are clamped
+  static constexpr const size_t buckets = (maxBits - subBits + 1) << subBits;
+
+  /* Plain copy of the counts that percentiles can be computed from */
+  struct Snapshot {
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t max = 0;
+    Snapshot() : counts(buckets, 0) {}
+    /* Counts recorded since an earlier snapshot. The exact max is lost, so
+     * it is estimated from the highest bucket. */
+    Snapshot since(const Snapshot &earlier) const {
+      Snapshot delta;
+      for (size_t i = 0; i < buckets; ++i) {
+        delta.counts[i] = counts[i] - earlier.counts[i];
+        delta.total += delta.counts[i];
+        if (delta.counts[i])
+          delta.max = highestEquivalent(i);
+      }
+      if (delta.max > max)
+        delta.max = max;
+      return delta;
+    }
+    /* Highest value equivalent to the bucket holding percentile p */
+    uint64_t percentile(double p) const {
+      if (total == 0)
+        return 0;
+      uint64_t rank = (uint64_t)(p / 100.0 * total + 0.5);
+      if (rank < 1)
+        rank = 1;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < buckets; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+          uint64_t v = highestEquivalent(i);
+          return v < max ? v : max;
+        }
+      }
+      return max;
+    }
+  };
+
+  LatencyHistogram() {
+    for (auto &c : counts)
+      c.store(0, std::memory_order_relaxed);
+  }
+  LatencyHistogram(const LatencyHistogram &) = delete;
+
+  static size_t index(uint64_t value) {
+    if (value >> maxBits)
+      return buckets - 1;
+    if (value < (1u << subBits))
+      return (size_t)value;
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned e = msb - subBits;
+    return ((size_t)(e + 1) << subBits) +
+           (size_t)((value >> e) - (1u << subBits));
+  }
+
+  static uint64_t lowestEquivalent(size_t index) {
+    if (index < (1u << subBits))
+      return index;
+    unsigned e = (unsigned)(index >> subBits) - 1;
+    uint64_t m = (1u << subBits) + (index & ((1u << subBits) - 1));
+    return m << e;
+  }
+
+  static uint64_t highestEquivalent(size_t index) {
+    if (index < (1u << subBits))
+      return index;
+    unsigned e = (unsigned)(index >> subBits) - 1;
+    return lowestEquivalent(index) + ((uint64_t)1 << e) - 1;
+  }
+
+  /* Single writer: plain load/store instead of an atomic read-modify-write */
+  void record(uint64_t value) {
+    std::atomic<uint64_t> &c = counts[index(value)];
+    c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    if (value > max.load(std::memory_order_relaxed))
+      max.store(value, std::memory_order_relaxed);
+  }
+
+  Snapshot snapshot() const {
+    Snapshot s;
+    for (size_t i = 0; i < buckets; ++i) {
+      s.counts[i] = counts[i].load(std::memory_order_relaxed);
+      s.total += s.counts[i];
+    }
+    s.max = max.load(std::memory_order_relaxed);
+    return s;
+  }
+
+private:
+  std::atomic<uint64_t> counts[buckets];
+  std::atomic<uint64_t> max{0};
+};
+
+/* Latency of each acquisition stage of one digitizer in TSC ticks */
+struct StageLatency {
+  LatencyHistogram readout;   // readData()
+  LatencyHistogram decode;    // decoding events into jadaq::buffer
+  LatencyHistogram buffer;    // DataHandler buffer rotation
+  LatencyHistogram write;     // each DataWriter call
+  LatencyHistogram blockSize; // bytes per non-empty readout - not a latency
+};
+
+#endif // JADAQ_LATENCYHISTOGRAM_HPP
@@ -0,0 +1,329 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Export acquisition statistics for monitoring.
+ *
+ */
+
+#include "Metrics.hpp"
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include "xtrace.h"
+
+using boost::asio::ip::tcp;
+
+/* One HTTP request/response - GET only, the connection is closed after the
+ * response. A client that does not send its request within the timeout is
+ * dropped so it cannot hold up the server thread. */
+class Metrics::Connection : public std::enable_shared_from_this<Connection> {
+public:
+  static constexpr const size_t maxRequest = 8192;
+
+  Connection(Metrics &metrics_, boost::asio::io_service &ioService)
+      : metrics(metrics_), socket(ioService), timer(ioService), request(maxRequest) {}
+
+  tcp::socket &getSocket() { return socket; }
+
+  void start() {
+    std::shared_ptr<Connection> self = shared_from_this();
+    timer.expires_from_now(boost::posix_time::seconds(5));
+    timer.async_wait([self](const boost::system::error_code &error) {
+      if (!error)
+        self->socket.close();
+    });
+    boost::asio::async_read_until(socket, request, "\r\n\r\n",
+        [self](const boost::system::error_code &error, size_t) {
+          if (error) {
+            self->timer.cancel();
+            return;
+          }
+          self->respond();
+        });
+  }
+
+private:
+  Metrics &metrics;
+  tcp::socket socket;
+  boost::asio::deadline_timer timer;
+  boost::asio::streambuf request;
+  std::string response;
+
+  void respond() {
+    std::istream in(&request);
+    std::string method, path;
+    in >> method >> path;
+    std::string status = "200 OK";
+    std::string type;
+    std::string body;
+    if (method != "GET") {
+      status = "405 Method Not Allowed";
+    } else if (path == "/metrics") {
+      type = "text/plain; version=0.0.4";
+      body = metrics.prometheus();
+    } else if (path == "/stats") {
+      type = "application/json";
+      body = metrics.json();
+    } else if (path == "/histograms" && metrics.histograms) {
+      type = "application/json";
+      body = metrics.histograms->json();
+    } else {
+      status = "404 Not Found";
+    }
+    std::ostringstream out;
+    out << "HTTP/1.0 " << status << "\r\n";
+    if (!type.empty())
+      out << "Content-Type: " << type << "\r\n";
+    out << "Content-Length: " << body.size() << "\r\n"
+        << "Connection: close\r\n\r\n"
+        << body;
+    response = out.str();
+    std::shared_ptr<Connection> self = shared_from_this();
+    boost::asio::async_write(socket, boost::asio::buffer(response),
+        [self](const boost::system::error_code &, size_t) {
+          boost::system::error_code ignored;
+          self->socket.shutdown(tcp::socket::shutdown_both, ignored);
+          self->timer.cancel();
+        });
+  }
+};
+
+Metrics::~Metrics() {
+  if (server.joinable()) {
+    ioService.stop();
+    server.join();
+  }
+}
+
+void Metrics::serve(const std::string &endpoint) {
+  std::string address = "127.0.0.1";
+  std::string port = endpoint;
+  size_t colon = endpoint.rfind(':');
+  if (colon != std::string::npos) {
+    address = endpoint.substr(0, colon);
+    port = endpoint.substr(colon + 1);
+  }
+  tcp::resolver resolver(ioService);
+  tcp::resolver::query query(address, port);
+  tcp::endpoint local = *resolver.resolve(query);
+  acceptor.reset(new tcp::acceptor(ioService));
+  acceptor->open(local.protocol());
+  acceptor->set_option(tcp::acceptor::reuse_address(true));
+  acceptor->bind(local);
+  acceptor->listen();
+  XTRACE(STATS, NOTE, "Serving metrics on http://%s:%s/metrics", address.c_str(), port.c_str());
+  accept();
+  server = std::thread([this]() { ioService.run(); });
+}
+
+void Metrics::accept() {
+  std::shared_ptr<Connection> connection = std::make_shared<Connection>(*this, ioService);
+  acceptor->async_accept(connection->getSocket(),
+      [this, connection](const boost::system::error_code &error) {
+        if (!error) {
+          connection->start();
+        } else {
+          XTRACE(STATS, WAR, "Metrics accept failed: %s", error.message().c_str());
+        }
+        accept();
+      });
+}
+
+void Metrics::logTo(const std::string &filename) {
+  log.open(filename, std::ios::out | std::ios::app);
+  if (!log.good()) {
+    throw std::runtime_error("Could not open stats file: \"" + filename + "\"");
+  }
+}
+
+void Metrics::update(const std::vector<Digitizer> &digitizers, double uptime_) {
+  std::vector<Sample> next(digitizers.size());
+  double time_ = std::chrono::duration<double>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    double interval = uptime_ - uptime;
+    for (size_t i = 0; i < digitizers.size(); ++i) {
+      Sample &sample = next[i];
+      sample.name = digitizers[i].name();
+      sample.active = digitizers[i].active();
+      sample.stats = digitizers[i].getStats();
+      sample.filter = digitizers[i].getFilterStats();
+      Digitizer::Stats old; // zero at start of run
+      if (i < samples.size() && samples[i].name == sample.name)
+        old = samples[i].stats;
+      if (interval > 0.0) {
+        sample.eventRate = (sample.stats.eventsFound - old.eventsFound) / interval;
+        sample.byteRate = (sample.stats.bytesRead - old.bytesRead) / interval;
+        sample.readoutRate = (sample.stats.readouts - old.readouts) / interval;
+      }
+    }
+    samples.swap(next);
+    uptime = uptime_;
+    time = time_;
+  }
+  if (log.is_open()) {
+    log << json() << std::endl;
+  }
+}
+
+/* Label values may contain backslash, double-quote and line feed escaped */
+static std::string escape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if (c == '\n') {
+      out += "\\n";
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+/* JSON strings also need every other control character escaped */
+static std::string jsonEscape(const std::string &s) {
+  std::string out;
+  for (char c : s) {
+    if (c == '\\' || c == '"') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", (unsigned)(unsigned char)c);
+      out += code;
+    } else {
+      out += c;
+    }
+  }
+  return out;
+}
+
+std::string Metrics::prometheus() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ostringstream out;
+  out.precision(15);
+  out << "# HELP jadaq_uptime_seconds Time since acquisition started.\n"
+      << "# TYPE jadaq_uptime_seconds gauge\n"
+      << "jadaq_uptime_seconds " << uptime << "\n";
+  struct Family {
+    const char *name;
+    const char *type;
+    const char *help;
+    double (*value)(const Sample &);
+  };
+  static const Family families[] = {
+      {"jadaq_digitizer_active", "gauge", "Whether the digitizer is still being read out.",
+       [](const Sample &s) { return s.active ? 1.0 : 0.0; }},
+      {"jadaq_events_total", "counter", "Events decoded.",
+       [](const Sample &s) { return (double)s.stats.eventsFound; }},
+      {"jadaq_read_bytes_total", "counter", "Bytes returned by readData().",
+       [](const Sample &s) { return (double)s.stats.bytesRead; }},
+      {"jadaq_readouts_total", "counter", "Calls to readData().",
+       [](const Sample &s) { return (double)s.stats.readouts; }},
+      {"jadaq_board_ready_ratio", "gauge", "Fraction of status samples with data waiting on the board.",
+       [](const Sample &s) { return s.stats.statusSamples ? (double)s.stats.readySamples / s.stats.statusSamples : 0.0; }},
+      {"jadaq_board_events_stored", "gauge", "Events stored on the board at the last status sample.",
+       [](const Sample &s) { return (double)s.stats.eventsStored; }},
+      {"jadaq_board_overflows_total", "counter", "Episodes of full board memory.",
+       [](const Sample &s) { return (double)s.stats.overflows; }},
+      {"jadaq_board_full_seconds_total", "counter", "Estimated time the board memory was full.",
+       [](const Sample &s) { return s.stats.fullSeconds; }},
+      {"jadaq_lost_triggers_estimate", "gauge", "Triggers estimated lost while the board memory was full.",
+       [](const Sample &s) { return s.stats.lostTriggers; }},
+      {"jadaq_event_rate", "gauge", "Events per second since the previous update.",
+       [](const Sample &s) { return s.eventRate; }},
+      {"jadaq_read_byte_rate", "gauge", "Bytes per second since the previous update.",
+       [](const Sample &s) { return s.byteRate; }},
+      {"jadaq_readout_rate", "gauge", "Readouts per second since the previous update.",
+       [](const Sample &s) { return s.readoutRate; }},
+  };
+  for (const Family &family : families) {
+    out << "# HELP " << family.name << " " << family.help << "\n"
+        << "# TYPE " << family.name << " " << family.type << "\n";
+    for (const Sample &sample : samples) {
+      out << family.name << "{digitizer=\"" << escape(sample.name) << "\"} "
+          << family.value(sample) << "\n";
+    }
+  }
+  out << "# HELP jadaq_filter_accepted_total Events on the channels of a filter rule that passed it.\n"
+      << "# TYPE jadaq_filter_accepted_total counter\n";
+  for (const Sample &sample : samples) {
+    for (const EventFilter::RuleStats &rule : sample.filter) {
+      out << "jadaq_filter_accepted_total{digitizer=\"" << escape(sample.name) << "\",rule=\""
+          << escape(rule.name) << "\"} " << rule.accepted << "\n";
+    }
+  }
+  out << "# HELP jadaq_filter_rejected_total Events dropped by a filter rule.\n"
+      << "# TYPE jadaq_filter_rejected_total counter\n";
+  for (const Sample &sample : samples) {
+    for (const EventFilter::RuleStats &rule : sample.filter) {
+      out << "jadaq_filter_rejected_total{digitizer=\"" << escape(sample.name) << "\",rule=\""
+          << escape(rule.name) << "\"} " << rule.rejected << "\n";
+    }
+  }
+  return out.str();
+}
+
+std::string Metrics::json() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::ostringstream out;
+  out.precision(15);
+  Sample total;
+  out << "{\"time\":" << time << ",\"uptime\":" << uptime << ",\"digitizers\":[";
+  for (size_t i = 0; i < samples.size(); ++i) {
+    const Sample &s = samples[i];
+    out << (i ? "," : "") << "{\"name\":\"" << jsonEscape(s.name) << "\""
+        << ",\"active\":" << (s.active ? "true" : "false")
+        << ",\"events\":" << s.stats.eventsFound
+        << ",\"bytes\":" << s.stats.bytesRead
+        << ",\"readouts\":" << s.stats.readouts
+        << ",\"event_rate\":" << s.eventRate
+        << ",\"byte_rate\":" << s.byteRate
+        << ",\"readout_rate\":" << s.readoutRate
+        << ",\"events_stored\":" << s.stats.eventsStored
+        << ",\"overflows\":" << s.stats.overflows
+        << ",\"full_seconds\":" << s.stats.fullSeconds
+        << ",\"lost_triggers\":" << s.stats.lostTriggers << ",\"filter\":[";
+    for (size_t r = 0; r < s.filter.size(); ++r) {
+      out << (r ? "," : "") << "{\"rule\":\"" << jsonEscape(s.filter[r].name) << "\""
+          << ",\"accepted\":" << s.filter[r].accepted
+          << ",\"rejected\":" << s.filter[r].rejected << "}";
+    }
+    out << "]}";
+    total.stats.eventsFound += s.stats.eventsFound;
+    total.stats.bytesRead += s.stats.bytesRead;
+    total.stats.readouts += s.stats.readouts;
+    total.eventRate += s.eventRate;
+    total.byteRate += s.byteRate;
+    total.readoutRate += s.readoutRate;
+  }
+  out << "],\"total\":{\"events\":" << total.stats.eventsFound
+      << ",\"bytes\":" << total.stats.bytesRead
+      << ",\"readouts\":" << total.stats.readouts
+      << ",\"event_rate\":" << total.eventRate
+      << ",\"byte_rate\":" << total.byteRate
+      << ",\"readout_rate\":" << total.readoutRate << "}}";
+  return out.str();
+}
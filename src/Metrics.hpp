@@ -0,0 +1,92 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Export acquisition statistics for monitoring.
+ *
+ * The service thread calls update() periodically. The latest sample is
+ * served over HTTP - Prometheus text format on /metrics, JSON on /stats -
+ * and/or appended to a file as one JSON object per line. The HTTP thread
+ * only ever sees the sample, never the digitizers themselves. Charge
+ * spectra, when filled, are served as JSON on /histograms.
+ *
+ */
+
+#ifndef JADAQ_METRICS_HPP
+#define JADAQ_METRICS_HPP
+
+#include "ChargeHistograms.hpp"
+#include "Digitizer.hpp"
+#include <boost/asio.hpp>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Metrics {
+public:
+  /* Counters of one digitizer and the rates since the previous update */
+  struct Sample {
+    std::string name;
+    bool active = false;
+    Digitizer::Stats stats;
+    double eventRate = 0.0;
+    double byteRate = 0.0;
+    double readoutRate = 0.0;
+    std::vector<EventFilter::RuleStats> filter;
+  };
+
+  Metrics() = default;
+  ~Metrics();
+  Metrics(const Metrics &) = delete;
+
+  /* Start serving on [<address>:]<port> - the address defaults to localhost */
+  void serve(const std::string &endpoint);
+  /* Append every update as a JSON line to filename */
+  void logTo(const std::string &filename);
+  /* Serve the spectra on /histograms - must outlive this */
+  void serveHistograms(const ChargeHistograms *histograms_) { histograms = histograms_; }
+
+  void update(const std::vector<Digitizer> &digitizers, double uptime);
+
+  std::string prometheus() const;
+  std::string json() const;
+
+private:
+  class Connection;
+
+  mutable std::mutex mutex;
+  double uptime = 0.0;
+  double time = 0.0; // seconds since the epoch
+  std::vector<Sample> samples;
+  const ChargeHistograms *histograms = nullptr;
+
+  std::ofstream log;
+
+  boost::asio::io_service ioService;
+  std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor;
+  std::thread server;
+
+  void accept();
+};
+
+#endif // JADAQ_METRICS_HPP
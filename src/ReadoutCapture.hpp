@@ -0,0 +1,102 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Raw capture of digitizer readout blocks exactly as returned by readData().
+ * Used to replay real data through the decoding pipeline in the benchmarks.
+ *
+ * File layout is a sequence of blocks, each prefixed with a BlockHeader.
+ *
+ */
+
+#ifndef JADAQ_READOUTCAPTURE_HPP
+#define JADAQ_READOUTCAPTURE_HPP
+
+#include "caen.hpp"
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class ReadoutCapture {
+public:
+  struct __attribute__((__packed__)) BlockHeader {
+    uint32_t magic;
+    uint32_t digitizerID;
+    uint32_t familyCode;
+    uint32_t firmware;
+    uint32_t size; // bytes of readout data following the header
+  };
+  static constexpr const uint32_t magic = 0x4a414451; // "JADQ"
+
+  struct Block {
+    BlockHeader header;
+    std::vector<char> data;
+  };
+
+  explicit ReadoutCapture(const std::string &filename)
+      : file(filename, std::ios::out | std::ios::binary | std::ios::trunc) {
+    if (!file.good()) {
+      throw std::runtime_error("Could not open readout capture file: \"" +
+                               filename + "\"");
+    }
+  }
+
+  void write(uint32_t digitizerID, uint32_t familyCode, uint32_t firmware,
+             const caen::ReadoutBuffer &buffer) {
+    BlockHeader header{magic, digitizerID, familyCode, firmware,
+                       buffer.dataSize};
+    std::lock_guard<std::mutex> lock(mutex);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(buffer.data, buffer.dataSize);
+  }
+
+  /* Read back all blocks of a capture file */
+  static std::vector<Block> read(const std::string &filename) {
+    std::ifstream in(filename, std::ios::in | std::ios::binary);
+    if (!in.good()) {
+      throw std::runtime_error("Could not open readout capture file: \"" +
+                               filename + "\"");
+    }
+    std::vector<Block> blocks;
+    Block block;
+    while (in.read(reinterpret_cast<char *>(&block.header),
+                   sizeof(block.header))) {
+      if (block.header.magic != magic) {
+        throw std::runtime_error("Corrupt readout capture file: \"" +
+                                 filename + "\"");
+      }
+      block.data.resize(block.header.size);
+      if (!in.read(block.data.data(), block.header.size)) {
+        break; // truncated last block - e.g. jadaq was killed
+      }
+      blocks.push_back(block);
+    }
+    return blocks;
+  }
+
+private:
+  std::ofstream file;
+  std::mutex mutex;
+};
+
+#endif // JADAQ_READOUTCAPTURE_HPP
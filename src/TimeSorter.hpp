@@ -0,0 +1,236 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Bounded window time sorting of the elements from one digitizer.
+ *
+ * The element time stamps (E::timeBits wide) are unwrapped to 64 bits, by
+ * one unwrapper for the digitizer so all groups agree on the time. Elements
+ * are staged until the newest time seen is more than the window ahead of
+ * them, and then emitted in time order, with the unwrapped time - which
+ * is also stored in elements with a 64 bit time field. Each emitted batch
+ * is sorted with an LSD radix sort on (time, index) pairs, so only keys and
+ * indices move until the elements are copied out.
+ *
+ * An element arriving after later times have been emitted cannot be put in
+ * order. It is emitted with the next batch and counted as late - a
+ * window at least as large as the disorder of the input avoids this.
+ *
+ * Staging is bounded: once it holds maxStagingBytes, everything staged is
+ * emitted, so time stamps that stop advancing can not hold events back
+ * without limit.
+ *
+ */
+
+#ifndef JADAQ_TIMESORTER_HPP
+#define JADAQ_TIMESORTER_HPP
+
+#include "DataFormat.hpp"
+#include "container.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <vector>
+
+/* Extends a counter of the given width to 64 bits. A step of less than
+ * half the range forward is taken as the counter moving on (possibly
+ * wrapping), more than that as an out of order value from before the newest. */
+class TimeUnwrapper {
+private:
+  uint64_t mask;
+  uint64_t last = 0;
+  bool seen = false;
+
+public:
+  explicit TimeUnwrapper(unsigned bits)
+      : mask((bits >= 64) ? ~0ull : ((1ull << bits) - 1)) {}
+  uint64_t operator()(uint64_t raw) {
+    if (!seen) {
+      seen = true;
+      last = raw;
+      return raw;
+    }
+    uint64_t forward = (raw - last) & mask;
+    if (forward <= (mask >> 1)) {
+      last += forward;
+      return last;
+    }
+    uint64_t backward = (last - raw) & mask;
+    return last >= backward ? last - backward : 0;
+  }
+};
+
+template <typename E> class TimeSorter {
+public:
+  static constexpr const size_t defaultMaxStagingBytes = 64 << 20;
+
+private:
+  static constexpr const unsigned radixBits = 11;
+
+  struct Key {
+    uint64_t time;
+    uint32_t index;
+  };
+
+  const size_t elementSize;
+  const size_t slotSize; // aligned like the elements of a jadaq::buffer
+  const uint64_t window;
+  const size_t maxStaged; // elements
+  TimeUnwrapper unwrap;
+  uint64_t maxTime = 0;
+  uint64_t lastEmitted = 0;
+  bool emitted = false;
+  uint64_t lateCount = 0;
+  uint64_t overflowCount = 0;
+
+  std::vector<char> staging; // elements in arrival order
+  std::vector<uint64_t> times;
+  size_t count = 0;
+
+  std::vector<Key> ready;
+  std::vector<Key> scratch;
+  std::vector<uint32_t> keep;
+
+  char *slot(size_t i) { return staging.data() + i * slotSize; }
+
+  /* The unwrapped time, where the element has the bits for it */
+  static void setTime(Data::ListElement8222 &e, uint64_t time) { e.time = time; }
+  template <typename L> static void setTime(Data::DPPQDCWaveformElement<L> &e, uint64_t time) {
+    setTime(e.listElement, time);
+  }
+  template <typename L>
+  static void setTime(Data::DPPQDCRawWaveformElement<L> &e, uint64_t time) {
+    setTime(e.listElement, time);
+  }
+  template <typename T> static void setTime(T &, uint64_t) {}
+
+  void grow() {
+    if (count * slotSize == staging.size())
+      staging.resize(staging.empty() ? 64 * slotSize : 2 * staging.size());
+  }
+  void staged(uint64_t time) {
+    times.resize(count + 1);
+    times[count++] = time;
+    if (time > maxTime)
+      maxTime = time;
+  }
+
+  /* LSD radix sort of ready on time - min, only over the bits in use */
+  void sort(uint64_t minTime, uint64_t maxReady) {
+    const uint64_t range = maxReady - minTime;
+    const size_t buckets = size_t(1) << radixBits;
+    scratch.resize(ready.size());
+    std::vector<size_t> histogram(buckets);
+    for (unsigned shift = 0; shift < 64 && (range >> shift) != 0; shift += radixBits) {
+      std::fill(histogram.begin(), histogram.end(), 0);
+      for (const Key &k : ready)
+        ++histogram[((k.time - minTime) >> shift) & (buckets - 1)];
+      size_t sum = 0;
+      for (size_t &h : histogram) {
+        size_t n = h;
+        h = sum;
+        sum += n;
+      }
+      for (const Key &k : ready)
+        scratch[histogram[((k.time - minTime) >> shift) & (buckets - 1)]++] = k;
+      ready.swap(scratch);
+    }
+  }
+
+public:
+  TimeSorter(size_t elementSize_, uint64_t window_,
+             size_t maxStagingBytes = defaultMaxStagingBytes)
+      : elementSize(elementSize_), slotSize(jadaq::buffer<E>::slot_size(elementSize_)),
+        window(window_), maxStaged(std::max<size_t>(1, maxStagingBytes / slotSize)),
+        unwrap(E::timeBits) {}
+
+  template <typename Event> void add(const Event &event, uint16_t group) {
+    grow();
+    E *element = new (reinterpret_cast<E *>(slot(count))) E(event, group);
+    staged(unwrap(element->timeStamp()));
+  }
+
+  /* Stage a copy of an element that is already built */
+  void push(const E &element) {
+    grow();
+    memcpy(slot(count), &element, elementSize);
+    staged(unwrap(element.timeStamp()));
+  }
+
+  /* Emit staged elements in time order through out(const E&, uint64_t
+   * time), time unwrapped. Only those
+   * older than the window unless all is set, or staging is full. Returns
+   * the number emitted. */
+  template <typename F> size_t emit(F out, bool all = false) {
+    if (!all && count >= maxStaged) {
+      all = true;
+      ++overflowCount;
+    }
+    if (count == 0 || (!all && maxTime < window))
+      return 0;
+    const uint64_t watermark =
+        all ? std::numeric_limits<uint64_t>::max() : maxTime - window;
+    ready.clear();
+    keep.clear();
+    uint64_t minTime = std::numeric_limits<uint64_t>::max();
+    uint64_t maxReady = 0;
+    for (size_t i = 0; i < count; ++i) {
+      if (times[i] <= watermark) {
+        ready.push_back(Key{times[i], (uint32_t)i});
+        minTime = std::min(minTime, times[i]);
+        maxReady = std::max(maxReady, times[i]);
+      } else {
+        keep.push_back((uint32_t)i);
+      }
+    }
+    if (ready.empty())
+      return 0;
+    sort(minTime, maxReady);
+    for (const Key &k : ready) {
+      if (emitted && k.time < lastEmitted)
+        ++lateCount;
+      else
+        lastEmitted = k.time;
+      emitted = true;
+      E &element = *reinterpret_cast<E *>(slot(k.index));
+      setTime(element, k.time);
+      out(element, k.time);
+    }
+    /* keep is ascending so the move never overwrites a pending element */
+    for (size_t i = 0; i < keep.size(); ++i) {
+      if (keep[i] != i) {
+        memcpy(slot(i), slot(keep[i]), elementSize);
+        times[i] = times[keep[i]];
+      }
+    }
+    count = keep.size();
+    times.resize(count);
+    return ready.size();
+  }
+
+  size_t pending() const { return count; }
+  uint64_t late() const { return lateCount; }
+  uint64_t overflows() const { return overflowCount; } // staging full
+
+};
+
+#endif // JADAQ_TIMESORTER_HPP
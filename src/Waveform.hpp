@@ -8,6 +8,7 @@
 #include "DPPQDCEvent.hpp"
 #include <H5Cpp.h>
 #include <cstdint>
+#include <cstring>
 #include <iomanip>
 #include <ostream>
 
@@ -41,6 +42,23 @@ static inline std::ostream &operator<<(std::ostream &os, const Interval &i) {
   return os;
 }
 
+    /* Follow a digital probe - bit 12 + S and 28 + S of the two samples in
+     * word ss, number i - setting interval V to its first high stretch */
+    static inline void probe_(Interval& V, uint32_t ss, uint16_t i, unsigned S)
+    {
+        uint32_t v = (ss & (0x10001000u << S));
+        if (V.start == 0xffffu) {
+            if (v) {
+                V.start = (i << 1) | (v >> (28 + S));
+                if (v == 0x1000u << S)
+                    V.end = (i << 1) | 1;
+            }
+        } else {
+            if (v < (0x10001000u << S))
+                V.end = (i << 1) | (v >> (28 + S));
+        }
+    }
+
     struct __attribute__ ((__packed__)) DPPQDCWaveform
     {
         uint16_t num_samples;
@@ -55,6 +73,34 @@ static inline std::ostream &operator<<(std::ostream &os, const Interval &i) {
         {
             event.waveform(*this);
         }
+        /* Unpack count mixed-mode words as read out, each holding two 12 bit
+         * samples and their digital probes. words need not be aligned. */
+        void decode(const void* words, size_t count)
+        {
+            const char* in = static_cast<const char*>(words);
+            uint16_t trigger_ = 0xFFFF;
+            Interval gate_ = {0xffff, 0xffff};
+            Interval holdoff_ = {0xffff, 0xffff};
+            Interval over_ = {0xffff, 0xffff};
+            for (uint16_t i = 0; i < count; ++i) {
+                uint32_t ss;
+                memcpy(&ss, in + i * sizeof(ss), sizeof(ss));
+                samples[i << 1] = (uint16_t)(ss & 0x0fff);
+                samples[i << 1 | 1] = (uint16_t)((ss >> 16) & 0x0fff);
+                // trigger
+                if (uint32_t t = (ss & 0x20002000)) {
+                    trigger_ = (i << 1) | (t >> 29);
+                }
+                probe_(gate_, ss, i, 0);
+                probe_(holdoff_, ss, i, 2);
+                probe_(over_, ss, i, 3);
+            }
+            num_samples = (uint16_t)(count << 1);
+            trigger = trigger_;
+            gate = gate_;
+            holdoff = holdoff_;
+            overthreshold = over_;
+        }
         void printOn(std::ostream& os) const
         {
             os << PRINTD(num_samples) << " " << PRINTD(trigger) << " " << PRINTD(gate) << " " <<
@@ -76,7 +122,7 @@ static inline std::ostream &operator<<(std::ostream &os, const Interval &i) {
           datatype.insertMember("gate", HOFFSET(DPPQDCWaveform, gate) + offset, Interval::h5type());
           datatype.insertMember("holdoff", HOFFSET(DPPQDCWaveform, holdoff) + offset, Interval::h5type());
           datatype.insertMember("overthreshold", HOFFSET(DPPQDCWaveform, overthreshold) + offset, Interval::h5type());
-            static const hsize_t n[1] = {num_samples};
+            const hsize_t n[1] = {num_samples};
             datatype.insertMember("samples", HOFFSET(DPPQDCWaveform, samples) + offset, H5::ArrayType(H5::PredType::NATIVE_UINT16,1,n));
         }
         static size_t size(size_t samples) { return sizeof(DPPQDCWaveform) + sizeof(uint16_t)*samples; }
@@ -117,7 +163,7 @@ static inline std::ostream &operator<<(std::ostream &os, const Interval &i) {
         void insertMembers(H5::CompType& datatype, size_t offset) const
         {
             datatype.insertMember("num_samples", HOFFSET(StdWaveform, num_samples) + offset, H5::PredType::NATIVE_UINT16);
-            static const hsize_t n[1] = {num_samples};
+            const hsize_t n[1] = {num_samples};
             datatype.insertMember("samples", HOFFSET(StdWaveform, samples) + offset, H5::ArrayType(H5::PredType::NATIVE_UINT16,1,n));
         }
       static size_t size(size_t samples) { return sizeof(uint16_t) + sizeof(uint16_t)*samples; }
@@ -0,0 +1,238 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Lossless packing of waveform samples.
+ *
+ * The first sample is stored as is. The differences between consecutive
+ * samples are zigzag coded (small negative values become small positive
+ * ones) and bit packed in blocks of 16, each block prefixed by one byte
+ * with the number of bits of its largest value. A slowly varying 12 bit
+ * trace packs to a few bits per sample.
+ *
+ * A packed element (record) is the element up to its samples, a 32 bit
+ * size and the packed samples. If packing would not save anything the
+ * samples are stored as they are and the top bit of the size is set.
+ *
+ * No dependencies - the reader library uses it as well.
+ *
+ */
+
+#ifndef JADAQ_WAVEFORMCODEC_HPP
+#define JADAQ_WAVEFORMCODEC_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace WaveformCodec {
+
+static constexpr const size_t block = 16;
+static constexpr const size_t chunk = 16 * block;
+static constexpr const uint32_t raw = 0x80000000; // record size flag
+
+/* Worst case packed size of n samples */
+static inline size_t maxPackedSize(size_t n) {
+  return n == 0 ? 0 : 2 + (n - 1 + block - 1) / block * (1 + 2 * block);
+}
+
+static inline unsigned bitWidth(uint16_t value) {
+  return value == 0 ? 0 : 32 - __builtin_clz(value);
+}
+
+/* Bit packing of one block of values of width bits to 2 * width bytes,
+ * little endian. One function per width, so all shifts are constants. */
+template <unsigned width> static inline void packBits(const uint16_t *in, uint8_t *out) {
+  uint64_t words[5] = {0, 0, 0, 0, 0};
+  for (unsigned i = 0; i < block; ++i) {
+    const unsigned bit = i * width;
+    words[bit / 64] |= (uint64_t)in[i] << (bit % 64);
+    if (bit % 64 + width > 64)
+      words[bit / 64 + 1] |= (uint64_t)in[i] >> (64 - bit % 64) % 64;
+  }
+  memcpy(out, words, 2 * width);
+}
+
+template <unsigned width> static inline void unpackBits(const uint8_t *in, uint16_t *out) {
+  const uint64_t mask = (1u << width) - 1;
+  uint64_t words[5] = {0, 0, 0, 0, 0};
+  memcpy(words, in, 2 * width);
+  for (unsigned i = 0; i < block; ++i) {
+    const unsigned bit = i * width;
+    uint64_t value = words[bit / 64] >> (bit % 64);
+    if (bit % 64 + width > 64)
+      value |= words[bit / 64 + 1] << (64 - bit % 64) % 64;
+    out[i] = (uint16_t)(value & mask);
+  }
+}
+
+typedef void (*PackBits)(const uint16_t *, uint8_t *);
+typedef void (*UnpackBits)(const uint8_t *, uint16_t *);
+static const PackBits packBlock[17] = {
+    packBits<0>,  packBits<1>,  packBits<2>,  packBits<3>,  packBits<4>,  packBits<5>,
+    packBits<6>,  packBits<7>,  packBits<8>,  packBits<9>,  packBits<10>, packBits<11>,
+    packBits<12>, packBits<13>, packBits<14>, packBits<15>, packBits<16>};
+static const UnpackBits unpackBlock[17] = {
+    unpackBits<0>,  unpackBits<1>,  unpackBits<2>,  unpackBits<3>,  unpackBits<4>,
+    unpackBits<5>,  unpackBits<6>,  unpackBits<7>,  unpackBits<8>,  unpackBits<9>,
+    unpackBits<10>, unpackBits<11>, unpackBits<12>, unpackBits<13>, unpackBits<14>,
+    unpackBits<15>, unpackBits<16>};
+
+/* Pack n samples - which need not be aligned - to out. Returns the number
+ * of bytes written, or 0 if that would be more than limit. */
+static inline size_t pack(const void *samples, size_t n, uint8_t *out, size_t limit) {
+  if (n == 0 || limit < 2)
+    return 0;
+  const char *in = static_cast<const char *>(samples);
+  uint8_t *p = out;
+  memcpy(p, in, 2);
+  p += 2;
+  /* Deltas of a chunk of samples at a time, in plain loops the compiler
+   * can vectorize */
+  for (size_t first = 1; first < n; first += chunk) {
+    const size_t count = n - first < chunk ? n - first : chunk;
+    uint16_t zigzag[chunk];
+    for (size_t i = 0; i < count; ++i) {
+      uint16_t previous, sample;
+      memcpy(&previous, in + 2 * (first + i - 1), 2);
+      memcpy(&sample, in + 2 * (first + i), 2);
+      const uint16_t delta = (uint16_t)(sample - previous);
+      zigzag[i] = (uint16_t)((delta << 1) ^ (uint16_t)-(delta >> 15));
+    }
+    const size_t padded = (count + block - 1) / block * block;
+    for (size_t i = count; i < padded; ++i)
+      zigzag[i] = 0;
+    for (size_t b = 0; b < padded; b += block) {
+      uint16_t any = 0;
+      for (size_t i = 0; i < block; ++i)
+        any |= zigzag[b + i];
+      const unsigned width = bitWidth(any);
+      if ((size_t)(p - out) + 1 + 2 * width > limit)
+        return 0;
+      *p++ = (uint8_t)width;
+      packBlock[width](zigzag + b, p);
+      p += 2 * width;
+    }
+  }
+  return p - out;
+}
+
+/* Unpack n samples from size bytes. Returns false if the input is short
+ * or corrupt. */
+static inline bool unpack(const uint8_t *in, size_t size, void *samples, size_t n) {
+  if (n == 0)
+    return true;
+  if (size < 2)
+    return false;
+  char *out = static_cast<char *>(samples);
+  const uint8_t *p = in;
+  const uint8_t *end = in + size;
+  uint16_t previous;
+  memcpy(&previous, p, 2);
+  memcpy(out, p, 2);
+  p += 2;
+  for (size_t first = 1; first < n; first += chunk) {
+    const size_t count = n - first < chunk ? n - first : chunk;
+    const size_t padded = (count + block - 1) / block * block;
+    uint16_t v[chunk];
+    for (size_t b = 0; b < padded; b += block) {
+      if (p == end)
+        return false;
+      const unsigned width = *p++;
+      if (width > 16 || (size_t)(end - p) < 2 * width)
+        return false;
+      unpackBlock[width](p, v + b);
+      p += 2 * width;
+    }
+    for (size_t i = 0; i < padded; ++i)
+      v[i] = (uint16_t)((v[i] >> 1) ^ (uint16_t)-(v[i] & 1));
+    for (size_t i = 0; i < count; ++i) {
+      previous = (uint16_t)(previous + v[i]);
+      v[i] = previous;
+    }
+    memcpy(out + 2 * first, v, 2 * count);
+  }
+  return true;
+}
+
+/* Worst case record size of an element with fixed bytes before n samples */
+static inline size_t maxRecordSize(size_t fixed, size_t n) {
+  return fixed + sizeof(uint32_t) + 2 * n;
+}
+
+/* Pack the element at element - fixed bytes with the sample count at
+ * countOffset, followed by the samples. Returns the record size. */
+static inline size_t packRecord(const char *element, size_t fixed, size_t countOffset, char *out) {
+  uint16_t n;
+  memcpy(&n, element + countOffset, 2);
+  memcpy(out, element, fixed);
+  const char *samples = element + fixed;
+  uint8_t *packed = reinterpret_cast<uint8_t *>(out + fixed + sizeof(uint32_t));
+  // only packed if that saves something
+  uint32_t size = (uint32_t)pack(samples, n, packed, 2 * (size_t)n - 1);
+  uint32_t field = size;
+  if (size == 0) {
+    size = 2 * (uint32_t)n;
+    memcpy(packed, samples, size);
+    field = size | raw;
+  }
+  memcpy(out + fixed, &field, sizeof(field));
+  return fixed + sizeof(uint32_t) + size;
+}
+
+/* Size of the record at in, 0 if it does not fit in size bytes */
+static inline size_t recordSize(const char *in, size_t size, size_t fixed) {
+  if (size < fixed + sizeof(uint32_t))
+    return 0;
+  uint32_t field;
+  memcpy(&field, in + fixed, sizeof(field));
+  size_t record = fixed + sizeof(uint32_t) + (field & ~raw);
+  return record <= size ? record : 0;
+}
+
+/* Unpack the record at in to the element layout. The element must have
+ * room for the samples. Returns the record size, 0 on error. */
+static inline size_t unpackRecord(const char *in, size_t size, size_t fixed, size_t countOffset,
+                                  char *element, size_t elementSize) {
+  size_t record = recordSize(in, size, fixed);
+  if (record == 0)
+    return 0;
+  uint16_t n;
+  uint32_t field;
+  memcpy(&n, in + countOffset, 2);
+  memcpy(&field, in + fixed, sizeof(field));
+  if (fixed + 2 * (size_t)n > elementSize)
+    return 0;
+  memcpy(element, in, fixed);
+  const uint8_t *packed = reinterpret_cast<const uint8_t *>(in + fixed + sizeof(uint32_t));
+  char *samples = element + fixed;
+  if (field & raw) {
+    if ((field & ~raw) != 2 * (uint32_t)n)
+      return 0;
+    memcpy(samples, packed, 2 * (size_t)n);
+  } else if (!unpack(packed, field, samples, n)) {
+    return 0;
+  }
+  return record;
+}
+
+} // namespace WaveformCodec
+
+#endif // JADAQ_WAVEFORMCODEC_HPP
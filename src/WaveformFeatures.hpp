@@ -0,0 +1,155 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Pulse features of a waveform: baseline, amplitude, peak position, rise
+ * time and the baseline subtracted integral over the gate.
+ *
+ * The samples are first copied to an aligned scratch array - inverted for
+ * negative pulses, so every kernel below looks for a positive pulse - and
+ * the sums and the peak search are plain loops the compiler vectorizes.
+ *
+ */
+
+#ifndef JADAQ_WAVEFORMFEATURES_HPP
+#define JADAQ_WAVEFORMFEATURES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace WaveformFeatures {
+
+struct Parameters {
+  unsigned baseline = 16; // samples before the gate averaged for the baseline
+  unsigned riseLow = 10;  // rise time from riseLow to riseHigh percent of the amplitude
+  unsigned riseHigh = 90;
+  bool negative = true;   // pulse polarity
+  unsigned traces = 0;    // keep 1 in traces full waveforms, 0 for none
+};
+
+struct Result {
+  uint16_t baseline;
+  uint16_t amplitude;
+  uint16_t peak;
+  uint16_t rise; // 1/16 samples
+  int32_t integral;
+};
+
+/* Sample window [begin, end) */
+struct Window {
+  size_t begin;
+  size_t end;
+};
+
+static inline uint32_t sum(const uint16_t *s, size_t begin, size_t end) {
+  uint32_t total = 0;
+  for (size_t i = begin; i < end; ++i)
+    total += s[i];
+  return total;
+}
+
+static inline size_t peak(const uint16_t *s, size_t begin, size_t end) {
+  uint16_t top = 0;
+  for (size_t i = begin; i < end; ++i)
+    top = s[i] > top ? s[i] : top;
+  size_t i = begin;
+  while (i < end && s[i] != top)
+    ++i;
+  return i;
+}
+
+/* Position, in 1/16 samples, where the leading edge before the peak
+ * crosses level (16 x sample value) */
+static inline uint32_t crossing(const uint16_t *s, size_t begin, size_t top, uint32_t level) {
+  size_t i = top;
+  while (i > begin && 16u * s[i - 1] >= level)
+    --i;
+  if (i == begin)
+    return 16 * (uint32_t)begin;
+  const uint32_t below = 16u * s[i - 1];
+  const uint32_t above = 16u * s[i];
+  return 16 * (uint32_t)(i - 1) + 16 * (level - below) / (above - below);
+}
+
+class Extractor {
+private:
+  std::vector<uint16_t> scratch;
+
+public:
+  /* samples need not be aligned. gate is clipped to the waveform; the
+   * baseline is taken from the samples before it, or from the first ones
+   * if the gate opens at the start. The peak is searched for in peakWindow. */
+  Result operator()(const Parameters &p, const void *samples, size_t n, Window gate,
+                    Window peakWindow) {
+    Result r = {0, 0, 0, 0, 0};
+    if (n == 0)
+      return r;
+    if (scratch.size() < n)
+      scratch.resize(n);
+    uint16_t *s = scratch.data();
+    memcpy(s, samples, 2 * n);
+    if (p.negative) {
+      for (size_t i = 0; i < n; ++i)
+        s[i] = (uint16_t)~s[i];
+    }
+    gate.end = gate.end < n ? gate.end : n;
+    gate.begin = gate.begin < gate.end ? gate.begin : gate.end;
+    Window base;
+    if (gate.begin > 0) {
+      base.end = gate.begin;
+      base.begin = gate.begin > p.baseline ? gate.begin - p.baseline : 0;
+    } else {
+      base.begin = 0;
+      base.end = p.baseline < n ? p.baseline : n;
+    }
+    const uint32_t baseSum = sum(s, base.begin, base.end);
+    const uint32_t baseLength = (uint32_t)(base.end - base.begin);
+    const uint32_t baseline = baseLength ? (baseSum + baseLength / 2) / baseLength : 0;
+
+    const uint64_t gateLength = gate.end - gate.begin;
+    const int64_t gateBase = baseLength ? ((int64_t)baseSum * gateLength + baseLength / 2) / baseLength : 0;
+    int64_t integral = (int64_t)sum(s, gate.begin, gate.end) - gateBase;
+    integral = integral > INT32_MAX ? INT32_MAX : integral < INT32_MIN ? INT32_MIN : integral;
+
+    peakWindow.end = peakWindow.end < n ? peakWindow.end : n;
+    if (peakWindow.begin >= peakWindow.end)
+      peakWindow = {0, n};
+    const size_t top = peak(s, peakWindow.begin, peakWindow.end);
+    const uint32_t amplitude = s[top] > baseline ? s[top] - baseline : 0;
+    uint32_t rise = 0;
+    if (amplitude > 0) {
+      const uint32_t low = 16 * baseline + 16 * amplitude * p.riseLow / 100;
+      const uint32_t high = 16 * baseline + 16 * amplitude * p.riseHigh / 100;
+      rise = crossing(s, peakWindow.begin, top, high) - crossing(s, peakWindow.begin, top, low);
+    }
+    r.baseline = (uint16_t)(p.negative ? ~baseline : baseline);
+    r.amplitude = (uint16_t)amplitude;
+    r.peak = (uint16_t)top;
+    r.rise = (uint16_t)(rise < 0xffff ? rise : 0xffff);
+    r.integral = (int32_t)integral;
+    return r;
+  }
+};
+
+} // namespace WaveformFeatures
+
+#endif // JADAQ_WAVEFORMFEATURES_HPP
@@ -0,0 +1,114 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Cut DPP-QDC waveforms to a window around the trigger or the gate opening
+ * before they are buffered.
+ *
+ * Every channel has its own window of pre samples before and post samples
+ * after its anchor. Elements of one digitizer share a size, so all of its
+ * waveforms are stored with as many samples as the longest window - the
+ * shorter ones are extended after the anchor. A window is moved inside the
+ * trace rather than cut at its ends. Trigger and interval positions are
+ * made relative to the window.
+ *
+ */
+
+#ifndef JADAQ_WAVEFORMWINDOW_HPP
+#define JADAQ_WAVEFORMWINDOW_HPP
+
+#include "Waveform.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+class WaveformWindow {
+public:
+  static constexpr const size_t maxChannels = 64;
+
+  enum Anchor { Trigger, Gate };
+
+  struct Window {
+    Anchor anchor = Trigger;
+    uint16_t pre = 0;
+    uint16_t post = 0;
+    size_t length() const { return (size_t)pre + post; }
+  };
+
+  /* Later windows replace earlier ones on the same channels */
+  void set(uint64_t channels, const Window &window) {
+    for (size_t c = 0; c < maxChannels; ++c) {
+      if (channels >> c & 1) {
+        windows[c] = window;
+        covered |= 1ull << c;
+      }
+    }
+    if (window.length() > longest)
+      longest = window.length();
+  }
+
+  bool empty() const { return covered == 0; }
+
+  /* Samples stored per waveform for traces of n samples */
+  size_t samples(size_t n) const { return empty() || longest > n ? n : longest; }
+
+  /* Cut the waveform to the window of its channel in place. Channels
+   * without a window keep their first samples. */
+  void operator()(uint16_t channel, DPPQDCWaveform &waveform) const {
+    const size_t n = waveform.num_samples;
+    const size_t length = samples(n);
+    if (length == n)
+      return;
+    size_t start = 0;
+    if (channel < maxChannels && (covered >> channel & 1)) {
+      const Window &w = windows[channel];
+      uint16_t anchor = w.anchor == Gate ? waveform.gate.start : waveform.trigger;
+      if (anchor == 0xffff) // not in this trace, try the other one
+        anchor = w.anchor == Gate ? waveform.trigger : waveform.gate.start;
+      if (anchor != 0xffff)
+        start = anchor > w.pre ? anchor - w.pre : 0;
+      if (start + length > n)
+        start = n - length;
+    }
+    memmove(waveform.samples, waveform.samples + start, 2 * length);
+    waveform.num_samples = (uint16_t)length;
+    waveform.trigger = rebase(waveform.trigger, start, length);
+    waveform.gate = rebase(waveform.gate, start, length);
+    waveform.holdoff = rebase(waveform.holdoff, start, length);
+    waveform.overthreshold = rebase(waveform.overthreshold, start, length);
+  }
+
+private:
+  Window windows[maxChannels];
+  uint64_t covered = 0;
+  size_t longest = 0;
+
+  /* Position relative to the window start, clamped to the window */
+  static uint16_t rebase(uint16_t position, size_t start, size_t length) {
+    if (position == 0xffff)
+      return position;
+    return position < start ? 0 : (uint16_t)std::min<size_t>(position - start, length);
+  }
+  static Interval rebase(Interval interval, size_t start, size_t length) {
+    return {rebase(interval.start, start, length), rebase(interval.end, start, length)};
+  }
+};
+
+#endif // JADAQ_WAVEFORMWINDOW_HPP
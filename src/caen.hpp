@@ -1706,6 +1706,10 @@ public:
 
   virtual uint32_t getEventSize() { throw Error(CAEN_DGTZ_FunctionNotAllowed); }
 
+  virtual uint32_t getEventStored() {
+    throw Error(CAEN_DGTZ_FunctionNotAllowed);
+  }
+
   virtual uint32_t getFanSpeedControl() {
     throw Error(CAEN_DGTZ_FunctionNotAllowed);
   }
@@ -2625,6 +2629,23 @@ public:
     return value;
   }
 
+  /**
+   * @brief Get EventStored
+   *
+   * This register contains the number of events currently stored in
+   * the Output Buffer.
+   *
+   * Get the low-level EventStored in line with register docs.
+   *
+   * @returns
+   * Number of stored events.
+   */
+  uint32_t getEventStored() override {
+    uint32_t value;
+    errorHandler(CAEN_DGTZ_ReadRegister(handle_, 0x812C, &value));
+    return value;
+  }
+
   /**
    * @brief Get FanSpeedControl mask
    *
@@ -3681,6 +3702,21 @@ public:
         return mask;
       }
 
+      /**
+       * @brief Get EventStored
+       *
+       * This register contains the number of events currently stored
+       * in the Output Buffer.
+       *
+       * @returns
+       * Number of stored events.
+       */
+      uint32_t getEventStored() override {
+        uint32_t value;
+        errorHandler(CAEN_DGTZ_ReadRegister(handle_, 0x812C, &value));
+        return value;
+      }
+
       // TODO: many register-level functions are missing in the 751 implementation; they can likely be easily transferred from the 740 class if needed
     };
 
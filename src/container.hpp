@@ -27,24 +27,50 @@
 #ifndef JADAQ_CONTAINER_HPP
 #define JADAQ_CONTAINER_HPP
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace jadaq {
+template <typename C> class pool;
+template <typename T> class buffer;
+template <typename T> class records;
+template <typename T> using buffer_pool = pool<buffer<T>>;
+template <typename T> using records_pool = pool<records<T>>;
+
+/* Fixed size elements. Each element starts on an alignment boundary, so
+ * their fields are naturally aligned in memory whatever the element size;
+ * the data as written (network, HDF5) has the elements back to back, see
+ * serialize(). raw_size is that serialized size, header included. */
 template <typename T> class buffer {
 private:
+  friend class pool<buffer<T>>;
+  size_t const element_size;
+  size_t const element_stride; // element_size rounded up to alignment
   char *const data_raw;   // pointer to the raw allocated data
   char *const data_begin; // pointer to where we begin inserting elements
   char *const data_end;   // pointer to end of data
-  size_t const element_size;
   char *next; // past end pointer
+  /* Set while handed out by a pool - the buffer goes back when released */
+  std::shared_ptr<buffer_pool<T>> owner;
   void check_length() const {
-    if (next + element_size > data_end) {
+    if (full()) {
       throw std::length_error{"Out of storage space."};
     }
   }
+  static size_t allocation(size_t raw_size, size_t object_size, size_t header_size) {
+    const size_t elements = raw_size > header_size ? (raw_size - header_size) / object_size : 0;
+    return header_size + elements * slot_size(object_size);
+  }
 
 public:
+  typedef T value_type;
+  static constexpr const size_t alignment = 8;
+
   template <typename IT>
   class iterator_ : public std::iterator<std::forward_iterator_tag, IT> {
     using base = std::iterator<std::forward_iterator_tag, IT>;
@@ -83,8 +109,10 @@ public:
   typedef iterator_<const T> const_iterator;
 
   buffer(size_t raw_size, size_t object_size, size_t header_size)
-      : data_raw(new char[raw_size]), data_begin(data_raw + header_size),
-        data_end(data_raw + raw_size), element_size(object_size),
+      : element_size(object_size), element_stride(slot_size(object_size)),
+        data_raw(new char[allocation(raw_size, object_size, header_size)]),
+        data_begin(data_raw + header_size),
+        data_end(data_raw + allocation(raw_size, object_size, header_size)),
         next(data_begin) {}
 
   buffer(size_t raw_size, size_t object_size)
@@ -104,52 +132,92 @@ public:
 
   ~buffer() { delete[] data_raw; }
 
+  /* Serialized bytes of one object of object_size */
+  static size_t stride(size_t object_size) { return object_size; }
+  /* Bytes of memory one object of object_size takes */
+  static size_t slot_size(size_t object_size) {
+    return (object_size + alignment - 1) & ~(alignment - 1);
+  }
+
   void push_back(const T &v) {
     check_length();
-    *next = v;
     memcpy(next, &v, element_size);
-    next += element_size;
+    next += element_stride;
   }
   template <typename... Args> void emplace_back(Args &&... args) {
     check_length();
     new (reinterpret_cast<T *>(next)) T(args...);
-    next += element_size;
+    next += element_stride;
   }
 
   void clear() { next = data_begin; }
 
-  iterator begin() { return iterator{data_begin, element_size}; }
+  iterator begin() { return iterator{data_begin, element_stride}; }
 
   const_iterator begin() const {
-    return const_iterator{data_begin, element_size};
+    return const_iterator{data_begin, element_stride};
   }
 
-  iterator end() { return iterator{next, element_size}; }
+  iterator end() { return iterator{next, element_stride}; }
 
-  const_iterator end() const { return const_iterator{next, element_size}; }
+  const_iterator end() const { return const_iterator{next, element_stride}; }
 
+  /* The header followed by the elements in memory layout */
   char *data() { return data_raw; }
 
   const char *data() const { return data_raw; }
 
-  size_t data_size() const noexcept { return next - data_raw; }
+  /* Serialized size, header included */
+  size_t data_size() const noexcept { return header_size() + size() * element_size; }
 
-  size_t data_capacity() const noexcept { return data_end - data_raw; }
+  size_t data_capacity() const noexcept { return header_size() + capacity() * element_size; }
 
   size_t header_size() const noexcept { return data_begin - data_raw; }
 
-  size_t size() const { return (next - data_begin) / element_size; }
+  size_t object_size() const noexcept { return element_size; }
 
-  size_t capacity() const { return (data_end - data_begin) / element_size; }
+  size_t size() const { return (next - data_begin) / element_stride; }
+
+  size_t capacity() const { return (data_end - data_begin) / element_stride; }
 
   size_t max_size() const noexcept { return capacity(); }
 
   bool empty() const noexcept { return next == data_begin; }
 
-  void setElements(size_t n) { next = (data_begin + element_size * n); }
+  bool full() const noexcept { return next + element_stride > data_end; }
+
+  /* True if the memory layout is the serialized one - no padding */
+  bool contiguous() const noexcept { return element_stride == element_size; }
+
+  /* Write n elements from first back to back to out. Returns the bytes
+   * written. */
+  size_t serialize(char *out, size_t first = 0, size_t n = SIZE_MAX) const {
+    n = std::min(n, size() - first);
+    const char *in = data_begin + first * element_stride;
+    if (contiguous() || n == 0) {
+      memcpy(out, in, n * element_size);
+      return n * element_size;
+    }
+    /* Whole slots a word at a time - the padding copied along lands on the
+     * start of the next element, which is copied after it */
+    const size_t words = element_stride / sizeof(uint64_t);
+    for (size_t i = 0; i + 1 < n; ++i) {
+      const char *from = in + i * element_stride;
+      char *to = out + i * element_size;
+      for (size_t w = 0; w < words; ++w) {
+        uint64_t word;
+        memcpy(&word, from + w * sizeof(word), sizeof(word));
+        memcpy(to + w * sizeof(word), &word, sizeof(word));
+      }
+    }
+    memcpy(out + (n - 1) * element_size, in + (n - 1) * element_stride, element_size);
+    return n * element_size;
+  }
+
+  void setElements(size_t n) { next = (data_begin + element_stride * n); }
 
   void copy(const buffer<T> &other) {
-    memcpy(data_raw, other.data_raw, other.data_size());
+    memcpy(data_raw, other.data_raw, other.next - other.data_raw);
     setElements(other.size());
   }
 
@@ -157,6 +225,241 @@ public:
     copy(other);
     return *this;
   }
+
+  /* Return the buffer to the pool it was acquired from. A buffer that is
+   * not from a pool stays with whoever made it. */
+  void release() {
+    std::shared_ptr<buffer_pool<T>> pool = std::move(owner);
+    if (pool)
+      pool->recycle(this);
+  }
+};
+
+/* Variable length records of T, for elements whose size varies from event
+ * to event. Every record is a 32 bit payload size, 32 bits of padding and
+ * the payload, padded to a multiple of 8 bytes - so with an 8 byte aligned
+ * header every record is 8 byte aligned. The padding is zeroed.
+ *
+ * object_size is the largest payload. Appending does not throw: a record
+ * that does not fit is refused, check capacity_remaining() or fits(). */
+template <typename T> class records {
+private:
+  friend class pool<records<T>>;
+  char *const data_raw;
+  char *const data_begin;
+  char *const data_end;
+  size_t const max_object_size;
+  char *next;
+  size_t count = 0;
+  std::shared_ptr<records_pool<T>> owner;
+
+  /* Space for a record of payload bytes, nullptr if it does not fit */
+  char *allocate(size_t payload) {
+    if (!fits(payload))
+      return nullptr;
+    const size_t record = record_size(payload);
+    uint32_t prefix[2] = {(uint32_t)payload, 0};
+    memcpy(next, prefix, prefix_size);
+    memset(next + prefix_size + payload, 0, record - prefix_size - payload);
+    char *p = next + prefix_size;
+    next += record;
+    ++count;
+    return p;
+  }
+
+public:
+  typedef T value_type;
+  static constexpr const size_t alignment = 8;
+  static constexpr const size_t prefix_size = 8;
+
+  static size_t record_size(size_t payload) {
+    return (prefix_size + payload + alignment - 1) & ~(alignment - 1);
+  }
+  /* Bytes taken by one object of object_size */
+  static size_t stride(size_t object_size) { return record_size(object_size); }
+
+  template <typename IT>
+  class iterator_ : public std::iterator<std::forward_iterator_tag, IT> {
+    using base = std::iterator<std::forward_iterator_tag, IT>;
+    using typename base::pointer;
+    using typename base::reference;
+    char *ptr;
+
+  public:
+    iterator_() : ptr(nullptr) {}
+    explicit iterator_(char *p) : ptr(p) {}
+
+    iterator_ operator++(int) /* postfix */
+    {
+      iterator_ tmp{ptr};
+      ptr += record_size(size());
+      return tmp;
+    }
+
+    iterator_ operator++() /* prefix */
+    {
+      ptr += record_size(size());
+      return *this;
+    }
+
+    /* Payload bytes of the record */
+    size_t size() const {
+      uint32_t payload;
+      memcpy(&payload, ptr, sizeof(payload));
+      return payload;
+    }
+
+    reference operator*() const { return reinterpret_cast<reference>(*(ptr + prefix_size)); }
+
+    pointer operator->() const { return reinterpret_cast<pointer>(ptr + prefix_size); }
+
+    bool operator==(const iterator_ &rhs) const { return ptr == rhs.ptr; }
+
+    bool operator!=(const iterator_ &rhs) const { return ptr != rhs.ptr; }
+  };
+  typedef iterator_<T> iterator;
+  typedef iterator_<const T> const_iterator;
+
+  records(size_t raw_size, size_t object_size, size_t header_size)
+      : data_raw(new char[raw_size]), data_begin(data_raw + header_size),
+        data_end(data_raw + raw_size), max_object_size(object_size),
+        next(data_begin) {}
+
+  ~records() { delete[] data_raw; }
+
+  /* Largest payload that still fits */
+  size_t capacity_remaining() const noexcept {
+    const size_t left = data_end - next;
+    return left < prefix_size ? 0 : (left - prefix_size) & ~(alignment - 1);
+  }
+
+  bool fits(size_t payload) const noexcept { return payload <= capacity_remaining(); }
+
+  /* Copy payload bytes of v - false if they do not fit */
+  bool push_back(const T &v, size_t payload) {
+    char *p = allocate(payload);
+    if (p)
+      memcpy(p, &v, payload);
+    return p != nullptr;
+  }
+  /* Sized by the element itself */
+  bool push_back(const T &v) { return push_back(v, v.bytes()); }
+
+  /* Construct a T of payload bytes in place - false if it does not fit */
+  template <typename... Args> bool emplace_back(size_t payload, Args &&... args) {
+    char *p = allocate(payload);
+    if (p)
+      new (reinterpret_cast<T *>(p)) T(args...);
+    return p != nullptr;
+  }
+
+  void clear() {
+    next = data_begin;
+    count = 0;
+  }
+
+  iterator begin() { return iterator{data_begin}; }
+
+  const_iterator begin() const { return const_iterator{data_begin}; }
+
+  iterator end() { return iterator{next}; }
+
+  const_iterator end() const { return const_iterator{next}; }
+
+  char *data() { return data_raw; }
+
+  const char *data() const { return data_raw; }
+
+  size_t data_size() const noexcept { return next - data_raw; }
+
+  size_t data_capacity() const noexcept { return data_end - data_raw; }
+
+  size_t header_size() const noexcept { return data_begin - data_raw; }
+
+  size_t object_size() const noexcept { return max_object_size; }
+
+  size_t size() const { return count; }
+
+  bool empty() const noexcept { return count == 0; }
+
+  bool full() const noexcept { return !fits(max_object_size); }
+
+  /* Returned to its pool like buffer */
+  void release() {
+    std::shared_ptr<records_pool<T>> pool = std::move(owner);
+    if (pool)
+      pool->recycle(this);
+  }
+};
+
+/* Append v to either kind of container - false if it is full */
+template <typename T> bool append(buffer<T> &c, const T &v) {
+  if (c.full())
+    return false;
+  c.push_back(v);
+  return true;
+}
+template <typename T> bool append(records<T> &c, const T &v) { return c.push_back(v); }
+
+/* Recycles containers (buffer or records) of one size so filling and
+ * writing them does not allocate once the pool has grown to the number of
+ * containers in flight. Containers may be acquired and released on
+ * different threads. */
+template <typename C>
+class pool : public std::enable_shared_from_this<pool<C>> {
+private:
+  const size_t raw_size;
+  const size_t object_size;
+  const size_t header_size;
+  mutable std::mutex mutex;
+  std::vector<C *> free;
+  size_t allocated_ = 0;
+
+  pool(size_t raw_size_, size_t object_size_, size_t header_size_)
+      : raw_size(raw_size_), object_size(object_size_),
+        header_size(header_size_) {}
+
+public:
+  static std::shared_ptr<pool> create(size_t raw_size, size_t object_size,
+                                      size_t header_size, size_t reserve = 0) {
+    std::shared_ptr<pool> p(new pool(raw_size, object_size, header_size));
+    for (size_t i = 0; i < reserve; ++i)
+      p->free.push_back(new C(raw_size, object_size, header_size));
+    p->allocated_ = reserve;
+    return p;
+  }
+  ~pool() {
+    for (C *b : free)
+      delete b;
+  }
+
+  /* An empty container, until release()d */
+  C *acquire() {
+    C *b;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (free.empty()) {
+        b = new C(raw_size, object_size, header_size);
+        ++allocated_;
+      } else {
+        b = free.back();
+        free.pop_back();
+      }
+    }
+    b->clear();
+    b->owner = this->shared_from_this();
+    return b;
+  }
+
+  void recycle(C *b) {
+    std::lock_guard<std::mutex> lock(mutex);
+    free.push_back(b);
+  }
+
+  size_t allocated() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return allocated_;
+  }
 };
 }
 #endif // JADAQ_CONTAINER_HPP
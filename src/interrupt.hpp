@@ -28,9 +28,12 @@
 #include <csignal>
 
 volatile sig_atomic_t interrupt = 0;
+volatile sig_atomic_t dumpTrace = 0; // SIGUSR1 - dump the trace buffers
 
 static void handler(int s) { interrupt = s; }
 
+static void dumpHandler(int) { dumpTrace = 1; }
+
 static void setup_interrupt_handler() {
   struct sigaction sigIntHandler;
   sigIntHandler.sa_handler = handler;
@@ -41,4 +44,14 @@ static void setup_interrupt_handler() {
   sigaction(SIGHUP, &sigIntHandler, NULL);
 }
 
+/* Installed first thing, so a dump can be asked for while the digitizers
+ * are being configured */
+static void setup_dump_handler() {
+  struct sigaction sigDumpHandler;
+  sigDumpHandler.sa_handler = dumpHandler;
+  sigemptyset(&sigDumpHandler.sa_mask);
+  sigDumpHandler.sa_flags = SA_RESTART;
+  sigaction(SIGUSR1, &sigDumpHandler, NULL);
+}
+
 #endif // JADAQ_INTERRUPT_H
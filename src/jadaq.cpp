@@ -27,12 +27,21 @@
 #include "Configuration.hpp"
 #include "DataHandler.hpp"
 #include "DataWriter.hpp"
+#include "DataWriterCoincidence.hpp"
+#include "DataWriterFeatures.hpp"
 #include "DataWriterHDF5.hpp"
+#include "DataWriterHistogram.hpp"
+#include "DataWriterMerger.hpp"
 #include "DataWriterNetwork.hpp"
 #include "DataWriterText.hpp"
 #include "Digitizer.hpp"
 //#include "Timer.hpp"
 #include "interrupt.hpp"
+#include "LatencyHistogram.hpp"
+#include "Metrics.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <boost/program_options.hpp>
 #include <chrono>
 #include <iostream>
@@ -49,6 +58,8 @@
 
 namespace po = boost::program_options;
 
+typedef std::array<LatencyHistogram::Snapshot, 5> LatencySnapshot;
+
 struct {
   bool textout = false;
   bool hdf5out = false;
@@ -63,27 +74,80 @@ struct {
   std::string *network = nullptr;
   std::string *port = nullptr;
   std::string *outConfigFile = nullptr;
+  std::string *captureFile = nullptr;
+  std::string *metrics = nullptr;
+  std::string *statsFile = nullptr;
+  float metricsInterval = 1.0f;
+  float traceSeconds = 10.0f;
+  int statusInterval = 100;
+  uint64_t sortWindow = 0;
+  int mergeTimeout = 0;
+  size_t batch = 0; // 0 for the writer default
+  size_t mtu = JUMBO_PAYLOAD;
+  bool compress = false;
+  DataWriterHDF5::Options hdf5;
+  bool rawWaveforms = false;
+  float histogramInterval = 0.0f; // seconds between snapshots, 0 for no histograms
+  size_t histogramBins = ChargeHistograms::defaultBins;
+  bool histogramOnly = false;
+  std::string histogramFile;
+  std::string traceFile;
+  std::string tracesBasename; // kept waveforms of the feature extraction
   std::vector<std::string> configFile;
 } conf;
 
 struct {
-  bool timeout{false};
+  std::atomic<bool> timeout{false};
+  std::atomic<bool> stop{false}; // set by main to end the service thread
   std::vector<Digitizer> * digarr;
+  Metrics *metrics = nullptr;
+  ChargeHistograms *histograms = nullptr;
 } application_control;
 
-static void printStats(const std::vector<Digitizer> &digitizers, uint32_t elapsedms, uint64_t time) {
-  static uint64_t oldevents=0;
-  static uint64_t oldbytes=0;
-  static uint64_t oldreadouts=0;
+/* Totals at the previous printStats() that the rates are computed from */
+struct StatsState {
+  uint64_t events = 0;
+  uint64_t bytes = 0;
+  uint64_t readouts = 0;
+  std::vector<LatencySnapshot> latency;
+};
+
+static LatencySnapshot snapshot(const StageLatency &latency) {
+  return {{latency.readout.snapshot(), latency.decode.snapshot(), latency.buffer.snapshot(),
+           latency.write.snapshot(), latency.blockSize.snapshot()}};
+}
+
+static LatencySnapshot since(const LatencySnapshot &now, const LatencySnapshot &earlier) {
+  LatencySnapshot delta;
+  for (size_t i = 0; i < now.size(); ++i)
+    delta[i] = now[i].since(earlier[i]);
+  return delta;
+}
+
+static void printLatency(FILE *out, const std::string &name, const LatencySnapshot &latency) {
+  static const char *stages[] = {"readout", "decode", "buffer", "write", "block size"};
+  const double us = 1.0 / (TSCTimer::ticksPerNs() * 1000.0);
+  fprintf(out, "   LATENCY %-10s        Count        p50        p99      p99.9        max\n", name.c_str());
+  for (size_t i = 0; i < latency.size(); ++i) {
+    const LatencyHistogram::Snapshot &s = latency[i];
+    const double scale = (i < 4) ? us : 1.0;
+    fprintf(out, "     %-10s %15" PRIu64 " %10.1f %10.1f %10.1f %10.1f %s\n", stages[i], s.total,
+            s.percentile(50.0) * scale, s.percentile(99.0) * scale, s.percentile(99.9) * scale,
+            s.max * scale, (i < 4) ? "us" : "bytes");
+  }
+}
+
+static void printStats(const std::vector<Digitizer> &digitizers, uint32_t elapsedms, uint64_t time,
+                       StatsState &old) {
   uint64_t eventsFound = 0;
   uint64_t bytesRead = 0;
   uint64_t readouts = 0;
   printf("  Status after %ld seconds runtime:\n", time/1000);
   printf("   DIGITIZER                        Events                  Bytes                       Readouts\n");
   for (const Digitizer &digitizer : digitizers) {
-    const Digitizer::Stats &stats = digitizer.getStats();
+    const Digitizer::Stats stats = digitizer.getStats();
     printf("     %-10s: %6s    %15" PRIu64 "           %15" PRIu64 "           %15" PRIu64 "\n",
-           digitizer.name().c_str(), digitizer.active ? "ALIVE!" : "DEAD!",
+           digitizer.name().c_str(), digitizer.active() ? "ALIVE!" : "DEAD!",
            stats.eventsFound, stats.bytesRead, stats.readouts);
     eventsFound += stats.eventsFound;
     bytesRead += stats.bytesRead;
@@ -92,32 +156,115 @@ static void printStats(const std::vector<Digitizer> &digitizers, uint32_t elapse
   printf("     Total                 %15" PRIu64 "           %15" PRIu64 "           %15" PRIu64"\n",
          eventsFound, bytesRead, readouts);
   printf("     Total Rates           %15ld/s         %15ld/s         %15ld/s\n\n",
-         (eventsFound - oldevents)*1000/elapsedms,
-         (bytesRead - oldbytes)*1000/elapsedms,
-         (readouts - oldreadouts)*1000/elapsedms);
-  oldevents = eventsFound;
-  oldbytes = bytesRead;
-  oldreadouts = readouts;
+         (eventsFound - old.events)*1000/elapsedms,
+         (bytesRead - old.bytes)*1000/elapsedms,
+         (readouts - old.readouts)*1000/elapsedms);
+  old.events = eventsFound;
+  old.bytes = bytesRead;
+  old.readouts = readouts;
+  /* Board memory as seen by the periodic status samples */
+  bool boardHeader = false;
+  for (const Digitizer &digitizer : digitizers) {
+    const Digitizer::Stats stats = digitizer.getStats();
+    if (stats.statusSamples == 0)
+      continue;
+    if (!boardHeader) {
+      printf("   BOARD                           Stored      Ready       Full  Overflows   Full time  Lost (est.)\n");
+      boardHeader = true;
+    }
+    printf("     %-10s             %10" PRIu64 " %9.1f%% %9.1f%% %10" PRIu64 " %10.3fs %12.0f\n",
+           digitizer.name().c_str(), stats.eventsStored,
+           100.0 * stats.readySamples / stats.statusSamples,
+           100.0 * stats.fullSamples / stats.statusSamples,
+           stats.overflows, stats.fullSeconds, stats.lostTriggers);
+  }
+  /* Software filter counters */
+  bool filterHeader = false;
+  for (const Digitizer &digitizer : digitizers) {
+    for (const EventFilter::RuleStats &rule : digitizer.getFilterStats()) {
+      if (!filterHeader) {
+        printf("   FILTER                 RULE               Accepted           Rejected\n");
+        filterHeader = true;
+      }
+      printf("     %-20s %-12s %15" PRIu64 "    %15" PRIu64 "\n", digitizer.name().c_str(),
+             rule.name.c_str(), rule.accepted, rule.rejected);
+    }
+  }
+  /* Latency percentiles over the last interval */
+  old.latency.resize(digitizers.size());
+  for (size_t i = 0; i < digitizers.size(); ++i) {
+    LatencySnapshot latency = snapshot(digitizers[i].getLatency());
+    printLatency(stdout, digitizers[i].name(), since(latency, old.latency[i]));
+    old.latency[i] = latency;
+  }
+  printf("\n");
   fflush(stdout);
 }
 
 
 
+/* Dumps the traces on SIGUSR1 from before the digitizers are configured
+ * until main returns */
+class TraceDumper {
+public:
+  TraceDumper() : thread([this]() { run(); }) {}
+  ~TraceDumper() {
+    stop = true;
+    thread.join();
+  }
+
+private:
+  std::atomic<bool> stop{false};
+  std::thread thread;
+
+  void run() {
+    while (!stop) {
+      if (dumpTrace) {
+        dumpTrace = 0;
+        FILE *out = fopen(conf.traceFile.c_str(), "a");
+        if (out) {
+          XTRACE(MAIN, NOTE, "Dumping last %.0f seconds of trace to %s", conf.traceSeconds, conf.traceFile.c_str());
+          TraceDump(out, conf.traceSeconds);
+          fclose(out);
+        } else {
+          XTRACE(MAIN, ERR, "Could not open trace dump file %s", conf.traceFile.c_str());
+        }
+      }
+      usleep(5000);
+    }
+  }
+};
+
 void service_thread() {
   XTRACE(MAIN, INF, "Starting service thread");
   SteadyTimer stoptimer;
   SteadyTimer stattimer;
+  SteadyTimer metricstimer;
+  SteadyTimer histogramtimer;
+  StatsState statsState;
 
-  while (1) {
+  while (!application_control.stop) {
     if (stoptimer.elapsedms() >= (uint64_t) conf.time * 1e3) {
       application_control.timeout = true;
       return;
     }
 
     if (stattimer.elapsedms() >= (uint64_t) conf.stats * 1e3) {
-      printStats(*application_control.digarr, stattimer.elapsedus()/1000, stoptimer.elapsedms());
+      printStats(*application_control.digarr, stattimer.elapsedus()/1000, stoptimer.elapsedms(), statsState);
       stattimer.reset();
     }
+    if (application_control.metrics && metricstimer.elapsedms() >= conf.metricsInterval * 1e3) {
+      application_control.metrics->update(*application_control.digarr, stoptimer.elapsedus() / 1e6);
+      metricstimer.reset();
+    }
+    if (application_control.histograms && histogramtimer.elapsedms() >= conf.histogramInterval * 1e3) {
+      try {
+        application_control.histograms->write(conf.histogramFile);
+      } catch (std::runtime_error &e) {
+        XTRACE(MAIN, ERR, "%s", e.what());
+      }
+      histogramtimer.reset();
+    }
     usleep(5000);
   }
 
@@ -137,6 +284,10 @@ int main(int argc, const char *argv[]) {
         "Stop acquisition after <seconds> seconds")
        ("split,s", po::value<float>()->value_name("<seconds>")->default_value(conf.split),
         "Split output file every <seconds> seconds")
+       ("split_size", po::value<uint64_t>()->value_name("<bytes>")->default_value(conf.hdf5.splitBytes),
+        "Split HDF5 output files when they reach <bytes> bytes (0 for never)")
+       ("split_events", po::value<uint64_t>()->value_name("<count>")->default_value(conf.hdf5.splitEvents),
+        "Split HDF5 output files after <count> events (0 for never)")
        ("hdf5,H", po::bool_switch(&conf.hdf5out), "Output to hdf5 file.")
        ("stats",  po::value<int>()->value_name("<seconds>")->default_value(conf.stats),
         "Print statistics every <seconds> seconds")
@@ -148,8 +299,60 @@ int main(int argc, const char *argv[]) {
         "Send data over network - address to bind to.")
        ("port,P", po::value<std::string>()->value_name("<port>")->default_value("9000"),
         "Network port to bind to if sending over network")
+       ("mtu", po::value<size_t>()->value_name("<bytes>")->default_value(conf.mtu),
+        "MTU of the network path - each packet fills one (1500 without jumbo frames)")
+       ("batch", po::value<size_t>()->value_name("<bytes>")->default_value(conf.batch),
+        "Size of the output buffers passed to the file or null writer (0 for the writer default)")
+       ("hdf5_layout", po::value<std::string>()->value_name("<layout>")->default_value("tables"),
+        "HDF5 layout: tables (a table per digitizer and time stamp), indexed (a dataset per digitizer and type, indexed by time stamp) or columns (indexed, with a dataset per field)")
+       ("hdf5_chunk", po::value<size_t>()->value_name("<bytes>")->default_value(conf.hdf5.chunkBytes),
+        "Chunk size of the indexed and columns HDF5 layouts")
+       ("hdf5_cache", po::value<size_t>()->value_name("<bytes>")->default_value(conf.hdf5.cacheBytes),
+        "Chunk cache per element type of the indexed and columns HDF5 layouts - at least one chunk")
+       ("hdf5_deflate", po::value<int>()->value_name("<level>")->default_value(0),
+        "Shuffle and deflate the chunks of the indexed and columns HDF5 layouts at <level> 1-9 (0 to disable)")
+       ("hdf5_zstd", po::value<int>()->value_name("<level>")->default_value(0),
+        "Shuffle and zstd compress the chunks at <level> 1-22 instead (0 to disable, readers need the HDF5 zstd plugin)")
+       ("hdf5_per_digitizer", po::bool_switch(&conf.hdf5.filePerDigitizer),
+        "Write an HDF5 file per digitizer, and a master file of virtual datasets when they are closed")
+       ("hdf5_swmr", po::bool_switch(&conf.hdf5.swmr),
+        "Write HDF5 in SWMR mode, so readers can open the files while they grow (indexed and columns layouts)")
+       ("hdf5_flush", po::value<float>()->value_name("<seconds>")->default_value(conf.hdf5.flushInterval),
+        "Flush the HDF5 files every <seconds> seconds (0 for never, 1 with --hdf5_swmr)")
+       ("hdf5_threads", po::value<unsigned>()->value_name("<count>")->default_value(conf.hdf5.threads),
+        "Threads compressing HDF5 chunks (0 to compress in HDF5 on the writing thread)")
+       ("compress", po::bool_switch(&conf.compress),
+        "Pack waveform samples losslessly in HDF5 and network output")
+       ("raw-waveforms", po::bool_switch(&conf.rawWaveforms),
+        "Store DPP-QDC waveforms as read out - decoded by the reader library")
        ("config_out", po::value<std::string>()->value_name("<file>"),
         "Read back device(s) configuration and write to <file>")
+       ("capture", po::value<std::string>()->value_name("<file>"),
+        "Dump raw readout blocks to <file> for replay in jadaq-microbench")
+       ("metrics", po::value<std::string>()->value_name("<[address:]port>"),
+        "Serve statistics over HTTP in Prometheus format (address defaults to 127.0.0.1)")
+       ("stats_file", po::value<std::string>()->value_name("<file>"),
+        "Append statistics to <file> as JSON lines")
+       ("metrics_interval", po::value<float>()->value_name("<seconds>")->default_value(conf.metricsInterval),
+        "Update metrics and stats file every <seconds> seconds")
+       ("sort", po::value<uint64_t>()->value_name("<ticks>")->default_value(conf.sortWindow),
+        "Time sort events per digitizer, reordering within <ticks> clock ticks (0 to disable)")
+       ("merge", po::value<int>()->value_name("<ms>")->default_value(conf.mergeTimeout),
+        "Merge all digitizers into one time ordered stream, waiting at most <ms> milliseconds for a quiet digitizer (0 to disable, needs --sort)")
+       ("histogram", po::value<float>()->value_name("<seconds>")->default_value(conf.histogramInterval),
+        "Fill per channel charge spectra and write them every <seconds> seconds (0 to disable)")
+       ("histogram_bins", po::value<size_t>()->value_name("<bins>")->default_value(conf.histogramBins),
+        "Bins per charge spectrum - a power of two up to 65536")
+       ("histogram_only", po::bool_switch(&conf.histogramOnly),
+        "Only fill the charge spectra - no event output (snapshots every 10 seconds unless --histogram is given)")
+       ("status_interval", po::value<int>()->value_name("<ms>")->default_value(conf.statusInterval),
+        "Sample board status registers every <ms> milliseconds (0 to disable)")
+       ("trace_level", po::value<std::string>()->value_name("<level>"),
+        "Record traces up to <level> (ALW, CRI, ERR, WAR, NOTE, INF, DEB or 1-7) - default INF")
+       ("trace_mask", po::value<std::string>()->value_name("<mask>"),
+        "Record traces from the groups in <mask> only (hex) - default all")
+       ("trace_seconds", po::value<float>()->value_name("<seconds>")->default_value(conf.traceSeconds),
+        "Dump the last <seconds> of traces on SIGUSR1")
        ("config", po::value<std::vector<std::string>>()->value_name("<file>"),
         "Configuration file");
 
@@ -181,6 +384,39 @@ int main(int argc, const char *argv[]) {
     if (vm.count("config_out")) {
       conf.outConfigFile = new std::string(vm["config_out"].as<std::string>());
     }
+    if (vm.count("capture")) {
+      conf.captureFile = new std::string(vm["capture"].as<std::string>());
+    }
+    if (vm.count("metrics")) {
+      conf.metrics = new std::string(vm["metrics"].as<std::string>());
+    }
+    if (vm.count("stats_file")) {
+      conf.statsFile = new std::string(vm["stats_file"].as<std::string>());
+    }
+    conf.metricsInterval = vm["metrics_interval"].as<float>();
+    if (vm.count("trace_level")) {
+      static const char *levels[] = {"ALW", "CRI", "ERR", "WAR", "NOTE", "INF", "DEB"};
+      std::string level = vm["trace_level"].as<std::string>();
+      unsigned int value = 0;
+      for (unsigned int i = 0; i < 7; ++i) {
+        if (level == levels[i] || level == std::to_string(i + 1))
+          value = i + 1;
+      }
+      if (value == 0)
+        throw po::invalid_option_value(level);
+      TraceSetLevel(value);
+    }
+    if (vm.count("trace_mask")) {
+      TraceSetMask((unsigned int)std::stoul(vm["trace_mask"].as<std::string>(), nullptr, 16));
+    }
+    conf.traceSeconds = vm["trace_seconds"].as<float>();
+    conf.statusInterval = vm["status_interval"].as<int>();
+    conf.sortWindow = vm["sort"].as<uint64_t>();
+    conf.mergeTimeout = vm["merge"].as<int>();
+    if (conf.mergeTimeout > 0 && conf.sortWindow == 0) {
+      std::cerr << "--merge needs time sorted digitizers - use --sort as well." << std::endl;
+      return -1;
+    }
     conf.path = new std::string(vm["path"].as<std::string>());
     conf.basename = new std::string(vm["basename"].as<std::string>());
     // add trailing slash to path (if given)
@@ -189,7 +425,69 @@ int main(int argc, const char *argv[]) {
     conf.events = vm["events"].as<int>();
     conf.time = vm["time"].as<int>();
     conf.split = vm["split"].as<float>();
+    conf.hdf5.split = conf.split > 0.0f;
+    conf.hdf5.splitBytes = vm["split_size"].as<uint64_t>();
+    conf.hdf5.splitEvents = vm["split_events"].as<uint64_t>();
     conf.stats = vm["stats"].as<int>();
+    conf.mtu = vm["mtu"].as<size_t>();
+    conf.histogramInterval = vm["histogram"].as<float>();
+    conf.histogramBins = vm["histogram_bins"].as<size_t>();
+    if (conf.histogramOnly && conf.histogramInterval <= 0.0f)
+      conf.histogramInterval = 10.0f;
+    conf.batch = vm["batch"].as<size_t>();
+    if (conf.mtu < 576 || conf.mtu > 65535) {
+      std::cerr << "--mtu must be between 576 and 65535 bytes." << std::endl;
+      return -1;
+    }
+    if (conf.batch != 0 && conf.batch < 4096) {
+      std::cerr << "--batch must be at least 4096 bytes." << std::endl;
+      return -1;
+    }
+    conf.hdf5.compress = conf.compress;
+    const std::string layout = vm["hdf5_layout"].as<std::string>();
+    if (layout == "indexed")
+      conf.hdf5.layout = DataWriterHDF5::Indexed;
+    else if (layout == "columns")
+      conf.hdf5.layout = DataWriterHDF5::Columns;
+    else if (layout != "tables")
+      throw po::invalid_option_value(layout);
+    conf.hdf5.chunkBytes = vm["hdf5_chunk"].as<size_t>();
+    conf.hdf5.cacheBytes = vm["hdf5_cache"].as<size_t>();
+    conf.hdf5.flushInterval = vm["hdf5_flush"].as<float>();
+    if (conf.hdf5.swmr) {
+      if (conf.hdf5.layout == DataWriterHDF5::Tables) {
+        std::cerr << "--hdf5_swmr needs --hdf5_layout indexed or columns." << std::endl;
+        return -1;
+      }
+      if (conf.hdf5.flushInterval <= 0.0f)
+        conf.hdf5.flushInterval = 1.0f;
+    }
+    const int deflate = vm["hdf5_deflate"].as<int>();
+    const int zstd = vm["hdf5_zstd"].as<int>();
+    conf.hdf5.threads = vm["hdf5_threads"].as<unsigned>();
+    if (deflate < 0 || deflate > 9 || zstd < 0 || zstd > 22 || (deflate > 0 && zstd > 0)) {
+      std::cerr << "Use one of --hdf5_deflate (1-9) and --hdf5_zstd (1-22)." << std::endl;
+      return -1;
+    }
+    if ((deflate > 0 || zstd > 0) && conf.hdf5.layout == DataWriterHDF5::Tables) {
+      std::cerr << "--hdf5_deflate and --hdf5_zstd need --hdf5_layout indexed or columns." << std::endl;
+      return -1;
+    }
+    if (deflate > 0) {
+      conf.hdf5.filter = ChunkCompressor::Deflate;
+      conf.hdf5.level = deflate;
+    } else if (zstd > 0) {
+      if (!ChunkCompressor::available(ChunkCompressor::Zstd) || conf.hdf5.threads == 0) {
+        std::cerr << "--hdf5_zstd needs jadaq built with zstd and --hdf5_threads above 0." << std::endl;
+        return -1;
+      }
+      conf.hdf5.filter = ChunkCompressor::Zstd;
+      conf.hdf5.level = zstd;
+    }
+    if (conf.hdf5.chunkBytes == 0 || conf.hdf5.cacheBytes < conf.hdf5.chunkBytes) {
+      std::cerr << "--hdf5_cache must hold at least one --hdf5_chunk." << std::endl;
+      return -1;
+    }
 
     if (vm.count("network")) {
       conf.network = new std::string(vm["network"].as<std::string>());
@@ -209,6 +507,10 @@ int main(int argc, const char *argv[]) {
 
   // prepare a run number
   runno runNumber;
+  const std::string firstRun = runNumber.toString();
+  conf.traceFile = *conf.path + *conf.basename + firstRun + ".trace";
+  setup_dump_handler();
+  TraceDumper traceDumper;
 
   /* Read-in and write resulting digitizer configuration */
   std::string configFileName = conf.configFile[0];
@@ -245,8 +547,9 @@ int main(int argc, const char *argv[]) {
   //  XTRACE(MAIN, WAR, "No run number found at path '%s' (will be set to zero)", (*conf.path).c_str());
   //}
   // copy over configuration file
+  conf.histogramFile = *conf.path + *conf.basename + firstRun + ".hist.h5";
   std::stringstream dstName;
-  dstName << *conf.path << *conf.basename << runNumber.toString() << ".cfg";
+  dstName << *conf.path << *conf.basename << firstRun << ".cfg";
   std::ifstream  src(configFileName, std::ios::binary);
   std::ofstream  dst(dstName.str(), std::ios::binary);
   dst << src.rdbuf();
@@ -271,38 +574,143 @@ int main(int argc, const char *argv[]) {
 
   // TODO: move DataHandler creation to factory method in DataHandlerGeneric
   DataWriter dataWriter;
+  const bool splitting = conf.split > 0.0f || conf.hdf5.splitBytes > 0 || conf.hdf5.splitEvents > 0;
 
-  if (conf.hdf5out) {
+  if (conf.histogramOnly) {
+    XTRACE(MAIN, NOTE, "Histogram only - no event output");
+    dataWriter = new DataWriterNull(conf.batch ? conf.batch : DataWriterHDF5::defaultBufferSize);
+  } else if (conf.hdf5out) {
     XTRACE(MAIN, NOTE, "Creating DataWriter for HDF5");
-    std::string extension = conf.split > 0.0f ? runNumber.toString() : "";
-    dataWriter = new DataWriterHDF5(*conf.path, *conf.basename, extension.c_str());
+    std::string extension = splitting ? runNumber.toString() : "";
+    dataWriter = new DataWriterHDF5(*conf.path, *conf.basename, extension.c_str(),
+                                    conf.batch ? conf.batch : DataWriterHDF5::defaultBufferSize,
+                                    conf.hdf5);
   } else if (conf.network != nullptr) {
     XTRACE(MAIN, NOTE, "Creating DataWriter for UDP");
-    dataWriter = new DataWriterNetwork(*conf.network, *conf.port, runNumber.value());
+    dataWriter = new DataWriterNetwork(*conf.network, *conf.port, runNumber.value(), conf.mtu,
+                                       conf.compress);
   } else if (conf.nullout) {
     XTRACE(MAIN, WAR, "Creating (dummy) DataWriter for to /dev/null");
-    dataWriter = new DataWriterNull();
+    dataWriter = new DataWriterNull(conf.batch ? conf.batch : Data::maxBufferSize);
   } else {
     std::cerr << "No valid data handler." << std::endl;
     return -1;
   }
+  if (configuration.hasCoincidence() && !conf.histogramOnly) {
+    if (conf.sortWindow == 0 || (digitizers.size() > 1 && conf.mergeTimeout == 0)) {
+      std::cerr << "Coincidences need time ordered data - use --sort and (for more than one digitizer) --merge." << std::endl;
+      return -1;
+    }
+    for (Digitizer &digitizer : digitizers) {
+      if (digitizer.standardFirmware()) {
+        std::cerr << "Coincidences need DPP list data - " << digitizer.name()
+                  << " runs standard firmware." << std::endl;
+        return -1;
+      }
+    }
+    XTRACE(MAIN, NOTE, "Building coincidences");
+    DataWriterCoincidence *builder = new DataWriterCoincidence(std::move(dataWriter),
+                                                               configuration.getCoincidence());
+    for (Digitizer &digitizer : digitizers)
+      builder->setTimeOffset(digitizer.digitizerID(), digitizer.getTimeOffset());
+    dataWriter = builder;
+  }
+  DataWriterMerger *merger = nullptr; // owned by dataWriter
+  if (conf.mergeTimeout > 0 && !conf.histogramOnly) {
+    XTRACE(MAIN, NOTE, "Merging digitizers into one time ordered stream");
+    merger = new DataWriterMerger(std::move(dataWriter),
+                                                    std::chrono::milliseconds(conf.mergeTimeout));
+    for (Digitizer &digitizer : digitizers)
+      merger->setTimeOffset(digitizer.digitizerID(), digitizer.getTimeOffset());
+    dataWriter = merger;
+  }
+  if (configuration.hasFeatures() && !conf.histogramOnly) {
+    XTRACE(MAIN, NOTE, "Reducing waveforms to pulse features");
+    const DataWriterFeatures::Settings &settings = configuration.getFeatures();
+    DataWriter traces;
+    if (!settings.keepsTraces()) {
+      traces = new DataWriterNull(Data::maxBufferSize);
+    } else if (conf.hdf5out) {
+      conf.tracesBasename = *conf.basename + "traces-";
+      std::string extension = splitting ? runNumber.toString() : "";
+      traces = new DataWriterHDF5(*conf.path, conf.tracesBasename, extension.c_str(),
+                                  conf.batch ? conf.batch : DataWriterHDF5::defaultBufferSize,
+                                  conf.hdf5);
+    } else if (conf.network != nullptr) {
+      traces = new DataWriterNetwork(*conf.network, *conf.port, runNumber.value(), conf.mtu,
+                                     conf.compress);
+    } else {
+      traces = new DataWriterNull(conf.batch ? conf.batch : Data::maxBufferSize);
+    }
+    dataWriter = new DataWriterFeatures(std::move(dataWriter), std::move(traces), settings);
+  }
+  std::shared_ptr<ChargeHistograms> histograms;
+  if (conf.histogramInterval > 0.0f) {
+    XTRACE(MAIN, NOTE, "Filling charge spectra - written to %s", conf.histogramFile.c_str());
+    try {
+      histograms = std::make_shared<ChargeHistograms>(ChargeHistograms::defaultChannels,
+                                                      conf.histogramBins);
+    } catch (std::invalid_argument &e) {
+      std::cerr << e.what() << std::endl;
+      return -1;
+    }
+    dataWriter = new DataWriterHistogram(std::move(dataWriter), histograms);
+    application_control.histograms = histograms.get();
+  }
+  /* Before the boards are started - nothing stops them if this fails */
+  std::unique_ptr<Metrics> metrics;
+  if (conf.metrics || conf.statsFile) {
+    try {
+      metrics.reset(new Metrics());
+      if (conf.metrics)
+        metrics->serve(*conf.metrics);
+      if (conf.statsFile)
+        metrics->logTo(*conf.statsFile);
+    } catch (std::exception &e) {
+      std::cerr << "Could not set up metrics: " << e.what() << std::endl;
+      return -1;
+    }
+    metrics->serveHistograms(histograms.get());
+    application_control.metrics = metrics.get();
+  }
   XTRACE(MAIN, INF, "Starting Acquisition");
 
+  std::unique_ptr<ReadoutCapture> capture;
+  if (conf.captureFile) {
+    XTRACE(MAIN, NOTE, "Capturing raw readout data to %s", conf.captureFile->c_str());
+    capture.reset(new ReadoutCapture(*conf.captureFile));
+  }
+
+  /* Every digitizer is set up before the first is started, as nothing
+   * stops the started ones if setting up another fails */
+  for (Digitizer &digitizer : digitizers) {
+    XTRACE(MAIN, INF, "Initialize digitizer %s", digitizer.name().c_str());
+    digitizer.setCapture(capture.get());
+    digitizer.setStatusInterval(std::chrono::milliseconds(conf.statusInterval));
+    digitizer.setSortWindow(conf.sortWindow);
+    if (merger)
+      digitizer.setSortHold(std::max(conf.mergeTimeout / 2, 1));
+    digitizer.setRawWaveforms(conf.rawWaveforms);
+    try {
+      digitizer.initialize(dataWriter);
+    } catch (std::exception &e) {
+      std::cerr << "Could not set up digitizer " << digitizer.name() << ": " << e.what()
+                << std::endl;
+      return -1;
+    }
+  }
   for (Digitizer &digitizer : digitizers) {
     XTRACE(MAIN, INF, "Start acquisition on digitizer %s", digitizer.name().c_str());
-    digitizer.initialize(dataWriter);
     digitizer.startAcquisition();
-    digitizer.active = true;
+    digitizer.setActive(true);
   }
 
   /* Set up interrupt handler */
   setup_interrupt_handler();
 
   /// setup stop timer and stat timer thread
-  std::thread support(service_thread);
-  support.detach();
-
   application_control.digarr = &digitizers;
+  std::thread support(service_thread);
 
 
   XTRACE(MAIN, INF, "Running acquisition loop - Ctrl-C to interrupt");
@@ -319,12 +727,14 @@ int main(int argc, const char *argv[]) {
     readouts = 0;
     alive = 0;
     for (Digitizer &digitizer : digitizers) {
-      if (digitizer.active) {
+      if (digitizer.active()) {
         try {
           /* wait a certain amount of time between acquisition attempts to avoid
            potential hickups on the link */
           // NOTE: introduced to address issue #18, value determined experimentally
           // TODO: make this value configurable
+          // sample board status (rate limited) in what would otherwise be idle time
+          digitizer.sampleStatus();
           int gracePeriod = 750 - readoutTimer.elapsedus(); // microseconds
           if (gracePeriod > 50) {std::this_thread::sleep_for(std::chrono::microseconds(gracePeriod));}
           else {
@@ -336,13 +746,15 @@ int main(int argc, const char *argv[]) {
           alive++;
         } catch (caen::Error &e) {
           XTRACE(MAIN, ERR, "ERROR: unexpected exception during acquisition: %s (%d)", e.what(), e.code());
-          digitizer.active = false;
+          digitizer.setActive(false);
         }
       }
       // accumulative stats for all digitizers
       eventsFound += digitizer.getStats().eventsFound;
       readouts += digitizer.getStats().readouts;
     }
+    if (merger)
+      merger->tick();
     if (conf.split > 0.0f) {
       if (splitTimer.timeus()/1000000 >= conf.split) {
         dataWriter.split((++runNumber).toString());
@@ -368,6 +780,11 @@ int main(int argc, const char *argv[]) {
   }
 
   auto elapsed = acquisitionTimer.timeus();
+  application_control.stop = true;
+  support.join();
+  if (metrics) {
+    metrics->update(digitizers, elapsed / 1e6);
+  }
   for (Digitizer &digitizer : digitizers) {
     XTRACE(MAIN, INF, "Stop acquisition on digitizer %s", digitizer.name().c_str());
     try{
@@ -377,6 +794,21 @@ int main(int argc, const char *argv[]) {
     }
   }
   XTRACE(MAIN, ALW, "Acquisition complete - shutting down.");
+  /* Latency percentiles for the whole run */
+  std::stringstream latencyName;
+  latencyName << *conf.path << *conf.basename << firstRun << ".latency";
+  FILE *latencyFile = fopen(latencyName.str().c_str(), "w");
+  if (!latencyFile) {
+    XTRACE(MAIN, WAR, "Could not write latency summary to '%s'", latencyName.str().c_str());
+  }
+  for (const Digitizer &digitizer : digitizers) {
+    LatencySnapshot latency = snapshot(digitizer.getLatency());
+    printLatency(stdout, digitizer.name(), latency);
+    if (latencyFile)
+      printLatency(latencyFile, digitizer.name(), latency);
+  }
+  if (latencyFile)
+    fclose(latencyFile);
   /* Clean up after all digitizers: buffers, etc. */
   for (Digitizer &digitizer : digitizers) {
     try{
@@ -386,6 +818,13 @@ int main(int argc, const char *argv[]) {
     }
   }
   digitizers.clear();
+  if (histograms) {
+    try {
+      histograms->write(conf.histogramFile);
+    } catch (std::runtime_error &e) {
+      XTRACE(MAIN, ERR, "%s", e.what());
+    }
+  }
 
   XTRACE(MAIN, ALW, "Acquisition ran for %.2f seconds.", elapsed/1000000.0);
   XTRACE(MAIN, ALW, "Collecting %u events.", eventsFound);
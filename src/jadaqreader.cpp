@@ -0,0 +1,129 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Reader library for jadaq data.
+ *
+ */
+
+#include "jadaqreader.h"
+#include "DataFormat.hpp"
+#include "WaveformCodec.hpp"
+#include "container.hpp"
+
+typedef jadaq::records<char> Records;
+
+static bool isRecords(uint16_t type) {
+  return type == Data::RecordsWaveform422 || type == Data::RecordsWaveform8222;
+}
+
+/* A record of a records type: the payload size, padding, the element and
+ * padding to 8 bytes */
+static size_t recordsSize(const char *in, size_t size, size_t &payload) {
+  if (size < Records::prefix_size)
+    return 0;
+  uint32_t field;
+  memcpy(&field, in, sizeof(field));
+  payload = field;
+  size_t record = Records::record_size(payload);
+  return record <= size ? record : 0;
+}
+
+/* A raw element: the list element, the sample count and the sample words */
+static size_t rawSize(size_t list, const char *in, size_t size) {
+  if (size < list + sizeof(uint16_t))
+    return 0;
+  uint16_t samples;
+  memcpy(&samples, in + list, sizeof(samples));
+  size_t record = list + sizeof(uint16_t) + sizeof(uint16_t) * samples;
+  return record <= size ? record : 0;
+}
+
+static size_t rawUnpack(size_t list, const char *in, size_t size, char *element,
+                        size_t elementSize) {
+  size_t record = rawSize(list, in, size);
+  if (record == 0)
+    return 0;
+  uint16_t samples;
+  memcpy(&samples, in + list, sizeof(samples));
+  if (list + DPPQDCWaveform::size(samples) > elementSize)
+    return 0;
+  memcpy(element, in, list);
+  reinterpret_cast<DPPQDCWaveform *>(element + list)->decode(in + list + sizeof(uint16_t),
+                                                             samples / 2);
+  return record;
+}
+
+uint16_t jadaq_unpacked_type(uint16_t type) {
+  size_t fixed, countOffset;
+  if (Data::packedLayout(type, fixed, countOffset))
+    return type & ~Data::PackedBase;
+  if (Data::rawLayout(type, fixed))
+    return type & ~Data::RawBase;
+  if (isRecords(type))
+    return type & ~Data::RecordsBase;
+  return Data::None;
+}
+
+size_t jadaq_record_size(uint16_t type, const void *in, size_t size) {
+  size_t fixed, countOffset;
+  if (Data::packedLayout(type, fixed, countOffset))
+    return WaveformCodec::recordSize(static_cast<const char *>(in), size, fixed);
+  if (Data::rawLayout(type, fixed))
+    return rawSize(fixed, static_cast<const char *>(in), size);
+  size_t payload;
+  if (isRecords(type))
+    return recordsSize(static_cast<const char *>(in), size, payload);
+  return 0;
+}
+
+size_t jadaq_unpacked_size(uint16_t type, const void *in, size_t size) {
+  size_t fixed, countOffset;
+  if (isRecords(type))
+    return recordsSize(static_cast<const char *>(in), size, fixed) ? fixed : 0;
+  if (Data::rawLayout(type, countOffset))
+    fixed = countOffset + sizeof(DPPQDCWaveform);
+  else if (!Data::packedLayout(type, fixed, countOffset))
+    return 0;
+  if (size < countOffset + sizeof(uint16_t))
+    return 0;
+  uint16_t samples;
+  memcpy(&samples, static_cast<const char *>(in) + countOffset, sizeof(samples));
+  return fixed + sizeof(uint16_t) * samples;
+}
+
+size_t jadaq_unpack(uint16_t type, const void *in, size_t size, void *element,
+                    size_t element_size) {
+  size_t fixed, countOffset;
+  if (Data::packedLayout(type, fixed, countOffset))
+    return WaveformCodec::unpackRecord(static_cast<const char *>(in), size, fixed, countOffset,
+                                       static_cast<char *>(element), element_size);
+  if (Data::rawLayout(type, fixed))
+    return rawUnpack(fixed, static_cast<const char *>(in), size, static_cast<char *>(element),
+                     element_size);
+  if (isRecords(type)) {
+    size_t record = recordsSize(static_cast<const char *>(in), size, fixed);
+    if (record == 0 || fixed > element_size)
+      return 0;
+    memcpy(element, static_cast<const char *>(in) + Records::prefix_size, fixed);
+    return record;
+  }
+  return 0;
+}
@@ -0,0 +1,63 @@
+/**
+ * jadaq (Just Another DAQ)
+ * Copyright (C) 2018  Troels Blum <troels@blum.dk>
+ *
+ * @file
+ * @author Troels Blum <troels@blum.dk>
+ * @section LICENSE
+ * This program is free software: you can redistribute it and/or modify
+ *        it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ *         but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * @section DESCRIPTION
+ * Reader library for jadaq data: decodes the elements of packed waveform
+ * types (Data::PackedBase), of raw DPP-QDC waveform types (Data::RawBase)
+ * and of variable length records (Data::RecordsBase) in network packets or
+ * HDF5 files back to the element layout of the unpacked type. Plain C, so
+ * it can be loaded from Python (ctypes) or Matlab.
+ *
+ * A packed buffer is a stream of records of varying size: take each
+ * record's unpacked size, unpack it and advance by the bytes consumed.
+ * Raw elements and variable length records are unpacked the same way, one
+ * element at a time.
+ *
+ */
+
+#ifndef JADAQ_JADAQREADER_H
+#define JADAQ_JADAQREADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The element type a packed, raw or records type unpacks to, 0 (None) for other types */
+uint16_t jadaq_unpacked_type(uint16_t type);
+
+/* Bytes of the record at in, 0 if it is incomplete or type is not packed, raw or records */
+size_t jadaq_record_size(uint16_t type, const void *in, size_t size);
+
+/* Bytes the record at in unpacks to, 0 on error */
+size_t jadaq_unpacked_size(uint16_t type, const void *in, size_t size);
+
+/* Unpack the record at in to element, which has room for element_size
+ * bytes. Returns the bytes consumed from in, 0 on error. */
+size_t jadaq_unpack(uint16_t type, const void *in, size_t size, void *element,
+                    size_t element_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // JADAQ_JADAQREADER_H
@@ -4,6 +4,7 @@
 
 #include <chrono>
 #include <cstdint>
+#include <thread>
 
 /// read time stamp counter - runs at processer Hz
 class TSCTimer {
@@ -19,14 +20,30 @@ void reset(void) { timestamp_count = rdtsc(); }
 ///
 uint64_t timetsc(void) { return (rdtsc() - timestamp_count); }
 
+///
+static unsigned long long rdtsc(void) {
+  unsigned hi, lo;
+  __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+  return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
+}
+
+/// TSC ticks per nanosecond - calibrated against the steady clock on first use
+static double ticksPerNs(void) {
+  static const double ticks = []() {
+    auto t0 = std::chrono::steady_clock::now();
+    unsigned long long c0 = rdtsc();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    unsigned long long c1 = rdtsc();
+    auto t1 = std::chrono::steady_clock::now();
+    return (c1 - c0) /
+           (double)std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0)
+               .count();
+  }();
+  return ticks;
+}
+
 private:
   uint64_t timestamp_count;
-
-  unsigned long long rdtsc(void) {
-    unsigned hi, lo;
-    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
-    return ((unsigned long long)lo) | (((unsigned long long)hi) << 32);
-  }
 };
 
 
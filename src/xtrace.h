@@ -5,14 +5,33 @@
 ///
 /// \brief Trace macros with masks and levels
 ///
+/// Every enabled trace is recorded in binary form - call site, TSC and the
+/// raw arguments - into a ring buffer owned by the calling thread. Nothing
+/// is formatted until the rings are dumped with TraceDump(). Traces at
+/// TracePrintLevel or more severe are in addition printed immediately.
+///
+/// TRC_MASK/TRC_LEVEL select what is compiled in, TraceSetMask() and
+/// TraceSetLevel() what is recorded at runtime.
+///
 //===----------------------------------------------------------------------===//
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <libgen.h>
+#include <memory>
+#include <mutex>
 #include <stdarg.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "timer.h"
 
 /// Add trace groups below - must be powers of two
 // clang-format off
@@ -49,7 +68,10 @@ const unsigned int TRC_L_DEB  = 7;
 
 #define TRC_MASK TRC_M_ALL
 //#define TRC_MASK TRC_G_EVENT
-#define TRC_LEVEL TRC_L_WAR
+#define TRC_LEVEL TRC_L_DEB
+
+/// Traces at this level or below are printed as well as recorded
+const unsigned int TracePrintLevel = TRC_L_WAR;
 
 
 inline int Trace(int const LineNumber, char const *File, const char* GroupName,  const char* SeverityName, const char *Format, ...) {
@@ -66,7 +88,314 @@ inline int Trace(int const LineNumber, char const *File, const char* GroupName,
   return 0;
 }
 
+/// Everything known about a trace at compile time - one static per XTRACE
+struct TraceSite {
+  int LineNumber;
+  const char *File;
+  const char *GroupName;
+  const char *SeverityName;
+  unsigned int Group;
+  unsigned int Level;
+  const char *Format;
+};
+
+/// One recorded trace. Strings are copied (truncated) as the pointers may
+/// not outlive the call.
+struct TraceEntry {
+  static const size_t MaxArgs = 8;
+  static const size_t StringBytes = 160;
+  enum : uint8_t { Signed, Unsigned, Double, String, Pointer };
+
+  std::atomic<uint64_t> Seq; // odd while being written
+  const TraceSite *Site;
+  uint64_t Tsc;
+  uint8_t Types[MaxArgs];
+  uint8_t Offsets[MaxArgs]; // of String arguments in Strings
+  union {
+    int64_t I;
+    uint64_t U;
+    double D;
+    const void *P;
+  } Args[MaxArgs];
+  char Strings[StringBytes];
+};
+
+/// Single writer ring of trace entries. Readers use the per entry sequence
+/// number to skip entries overwritten while being copied.
+struct TraceRing {
+  static const size_t Entries = 1 << 14; // power of two
+  int Thread;
+  bool Exited = false; // guarded by TraceState::Mutex
+  std::atomic<uint64_t> Head{0};
+  std::unique_ptr<TraceEntry[]> Ring{new TraceEntry[Entries]};
+  explicit TraceRing(int Thread_) : Thread(Thread_) {
+    for (size_t i = 0; i < Entries; ++i)
+      Ring[i].Seq.store(0, std::memory_order_relaxed);
+  }
+};
+
+struct TraceState {
+  std::atomic<unsigned int> Mask{TRC_M_ALL};
+  std::atomic<unsigned int> Level{TRC_L_INF};
+  static const size_t KeptExited = 8; // rings of exited threads not yet dumped
+  std::mutex Mutex; // guards Rings
+  std::vector<std::unique_ptr<TraceRing>> Rings;
+  int Threads = 0;
+  // Wall clock at a known TSC for converting entry timestamps
+  uint64_t EpochTsc = TSCTimer::rdtsc();
+  std::chrono::system_clock::time_point Epoch = std::chrono::system_clock::now();
+};
+
+inline TraceState &TraceGlobal() {
+  static TraceState State;
+  return State;
+}
+
+inline void TraceSetMask(unsigned int Mask) {
+  TraceGlobal().Mask.store(Mask, std::memory_order_relaxed);
+}
+
+inline void TraceSetLevel(unsigned int Level) {
+  TraceGlobal().Level.store(Level, std::memory_order_relaxed);
+}
+
+inline bool TraceEnabled(unsigned int Group, unsigned int Level) {
+  TraceState &State = TraceGlobal();
+  return Level <= State.Level.load(std::memory_order_relaxed) &&
+         (Group & State.Mask.load(std::memory_order_relaxed));
+}
+
+/// Free the rings of exited threads but the Keep most recent. Called with
+/// State.Mutex held.
+inline void TraceFreeExited(TraceState &State, size_t Keep) {
+  size_t Exited = std::count_if(State.Rings.begin(), State.Rings.end(),
+                                [](const std::unique_ptr<TraceRing> &R) { return R->Exited; });
+  for (auto R = State.Rings.begin(); R != State.Rings.end() && Exited > Keep;) {
+    if ((*R)->Exited) {
+      R = State.Rings.erase(R);
+      --Exited;
+    } else {
+      ++R;
+    }
+  }
+}
+
+/// Marks the ring of its thread when the thread exits. The ring is kept
+/// until it has been dumped - or KeptExited newer threads have exited.
+struct TraceRingOwner {
+  TraceRing *Ring = nullptr;
+  ~TraceRingOwner() {
+    if (!Ring)
+      return;
+    TraceState &State = TraceGlobal();
+    std::lock_guard<std::mutex> Lock(State.Mutex);
+    Ring->Exited = true;
+    TraceFreeExited(State, TraceState::KeptExited);
+  }
+};
+
+inline TraceRing *TraceNewRing() {
+  static thread_local TraceRingOwner Owner;
+  TraceState &State = TraceGlobal();
+  std::lock_guard<std::mutex> Lock(State.Mutex);
+  State.Rings.emplace_back(new TraceRing(State.Threads++));
+  Owner.Ring = State.Rings.back().get();
+  return Owner.Ring;
+}
+
+inline TraceRing &TraceLocalRing() {
+  static thread_local TraceRing *Ring = nullptr;
+  if (!Ring)
+    Ring = TraceNewRing();
+  return *Ring;
+}
+
+// Store one argument - integers and enums, floating point, strings, pointers
+template <typename T>
+inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+TraceStore(TraceEntry &E, size_t i, size_t &, T Arg) {
+  if (std::is_signed<T>::value) {
+    E.Types[i] = TraceEntry::Signed;
+    E.Args[i].I = (int64_t)Arg;
+  } else {
+    E.Types[i] = TraceEntry::Unsigned;
+    E.Args[i].U = (uint64_t)Arg;
+  }
+}
+
+template <typename T>
+inline typename std::enable_if<std::is_floating_point<T>::value>::type
+TraceStore(TraceEntry &E, size_t i, size_t &, T Arg) {
+  E.Types[i] = TraceEntry::Double;
+  E.Args[i].D = Arg;
+}
+
+inline void TraceStore(TraceEntry &E, size_t i, size_t &Used, const char *Arg) {
+  E.Types[i] = TraceEntry::String;
+  E.Args[i].P = Arg; // for %p
+  if (Used >= TraceEntry::StringBytes) {
+    E.Offsets[i] = TraceEntry::StringBytes - 1; // out of room - empty string
+    return;
+  }
+  E.Offsets[i] = (uint8_t)Used;
+  size_t n = Arg ? strnlen(Arg, TraceEntry::StringBytes - 1 - Used) : 0;
+  if (n)
+    memcpy(E.Strings + Used, Arg, n);
+  E.Strings[Used + n] = '\0';
+  Used += n + 1;
+}
+
+inline void TraceStore(TraceEntry &E, size_t i, size_t &Used, char *Arg) {
+  TraceStore(E, i, Used, (const char *)Arg);
+}
+
+template <typename T>
+inline void TraceStore(TraceEntry &E, size_t i, size_t &, T *Arg) {
+  E.Types[i] = TraceEntry::Pointer;
+  E.Args[i].P = Arg;
+}
+
+inline void TraceStoreAll(TraceEntry &, size_t, size_t &) {}
+
+template <typename T, typename... Rest>
+inline void TraceStoreAll(TraceEntry &E, size_t i, size_t &Used, T Arg, Rest... Args) {
+  TraceStore(E, i, Used, Arg);
+  TraceStoreAll(E, i + 1, Used, Args...);
+}
+
+template <typename... Args>
+inline int TraceRecord(const TraceSite *Site, Args... args) {
+  static_assert(sizeof...(Args) <= TraceEntry::MaxArgs, "Too many XTRACE arguments");
+  TraceRing &R = TraceLocalRing();
+  uint64_t Head = R.Head.load(std::memory_order_relaxed);
+  TraceEntry &E = R.Ring[Head & (TraceRing::Entries - 1)];
+  E.Seq.store(2 * Head + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  E.Site = Site;
+  E.Tsc = TSCTimer::rdtsc();
+  E.Strings[TraceEntry::StringBytes - 1] = '\0';
+  size_t Used = 0;
+  TraceStoreAll(E, 0, Used, args...);
+  E.Seq.store(2 * Head + 2, std::memory_order_release);
+  R.Head.store(Head + 1, std::memory_order_release);
+  if (Site->Level <= TracePrintLevel)
+    Trace(Site->LineNumber, Site->File, Site->GroupName, Site->SeverityName, Site->Format, args...);
+  return 0;
+}
+
+/// Render an entry by walking the format and printing each conversion with
+/// the recorded argument cast to the type the conversion expects
+inline std::string TraceFormat(const TraceSite &Site, const TraceEntry &E) {
+  std::string Out;
+  const char *f = Site.Format;
+  size_t Arg = 0;
+  char Buf[256];
+  while (*f) {
+    if (*f != '%') {
+      Out += *f++;
+      continue;
+    }
+    if (f[1] == '%') {
+      Out += '%';
+      f += 2;
+      continue;
+    }
+    const char *Start = f++;
+    while (*f && strchr("-+ #0123456789.", *f))
+      ++f;
+    while (*f && strchr("hlLqjzt", *f))
+      ++f;
+    if (!*f)
+      break;
+    char Conv = *f++;
+    std::string Spec(Start, f);
+    if (Arg >= TraceEntry::MaxArgs)
+      break;
+    const auto &A = E.Args[Arg];
+    uint8_t Type = E.Types[Arg++];
+    // Integers are widened to 64 bits for the conversion
+    if (strchr("di", Conv) || strchr("ouxXc", Conv)) {
+      Spec.erase(std::remove_if(Spec.begin(), Spec.end(),
+                                [](char c) { return strchr("hlLqjzt", c) != nullptr; }),
+                 Spec.end());
+      Spec.insert(Spec.size() - 1, "ll");
+      if (Conv == 'c')
+        Spec = "%c";
+      long long V = (Type == TraceEntry::Double) ? (long long)A.D : (long long)A.I;
+      snprintf(Buf, sizeof(Buf), Spec.c_str(), V);
+    } else if (strchr("eEfFgGaA", Conv)) {
+      double V = (Type == TraceEntry::Double) ? A.D : (double)A.I;
+      snprintf(Buf, sizeof(Buf), Spec.c_str(), V);
+    } else if (Conv == 's') {
+      snprintf(Buf, sizeof(Buf), Spec.c_str(),
+               Type == TraceEntry::String ? E.Strings + E.Offsets[Arg - 1] : "(?)");
+    } else if (Conv == 'p') {
+      snprintf(Buf, sizeof(Buf), Spec.c_str(), A.P);
+    } else {
+      snprintf(Buf, sizeof(Buf), "%s", Spec.c_str());
+    }
+    Out += Buf;
+  }
+  return Out;
+}
+
+/// Format everything recorded during the last Seconds, oldest first
+inline void TraceDump(FILE *Out, double Seconds) {
+  TraceState &State = TraceGlobal();
+  std::vector<std::pair<int, TraceEntry *>> Copies;
+  std::vector<std::unique_ptr<TraceEntry>> Storage;
+  const double TicksPerNs = TSCTimer::ticksPerNs();
+  const uint64_t Now = TSCTimer::rdtsc();
+  const uint64_t Window = (uint64_t)(Seconds * 1e9 * TicksPerNs);
+  {
+    std::lock_guard<std::mutex> Lock(State.Mutex);
+    for (auto &R : State.Rings) {
+      uint64_t Head = R->Head.load(std::memory_order_acquire);
+      uint64_t Count = Head < TraceRing::Entries ? Head : (uint64_t)TraceRing::Entries;
+      for (uint64_t n = Head - Count; n < Head; ++n) {
+        TraceEntry &E = R->Ring[n & (TraceRing::Entries - 1)];
+        uint64_t Seq = E.Seq.load(std::memory_order_acquire);
+        if (Seq != 2 * n + 2)
+          continue; // overwritten since we read Head
+        std::unique_ptr<TraceEntry> Copy(new TraceEntry);
+        Copy->Site = E.Site;
+        Copy->Tsc = E.Tsc;
+        memcpy(Copy->Types, E.Types, sizeof(E.Types));
+        memcpy(Copy->Offsets, E.Offsets, sizeof(E.Offsets));
+        memcpy(Copy->Args, E.Args, sizeof(E.Args));
+        memcpy(Copy->Strings, E.Strings, sizeof(E.Strings));
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (E.Seq.load(std::memory_order_relaxed) != Seq)
+          continue;
+        if (Now - Copy->Tsc > Window)
+          continue;
+        Copies.emplace_back(R->Thread, Copy.get());
+        Storage.push_back(std::move(Copy));
+      }
+    }
+    TraceFreeExited(State, 0); // dumped
+  }
+  std::sort(Copies.begin(), Copies.end(),
+            [](const std::pair<int, TraceEntry *> &a, const std::pair<int, TraceEntry *> &b) {
+              return a.second->Tsc < b.second->Tsc;
+            });
+  const double Epoch = std::chrono::duration<double>(State.Epoch.time_since_epoch()).count();
+  for (auto &C : Copies) {
+    const TraceSite &Site = *C.second->Site;
+    double Time = Epoch + ((int64_t)(C.second->Tsc - State.EpochTsc)) / (TicksPerNs * 1e9);
+    char *File = strdup(Site.File);
+    fprintf(Out, "%.6f %2d %-4s %-20s %5d %-7s - %s\n", Time, C.first, Site.SeverityName,
+            basename(File), Site.LineNumber, Site.GroupName, TraceFormat(Site, *C.second).c_str());
+    free(File);
+  }
+  fflush(Out);
+}
+
 #define XTRACE(Group, Level, Format, ...) \
-   (void) ( ((TRC_L_##Level <= TRC_LEVEL) && (TRC_MASK & TRC_G_##Group)) \
-   ? Trace(__LINE__, __FILE__, #Group, #Level, Format, ##__VA_ARGS__) \
+   (void) ( ((TRC_L_##Level <= TRC_LEVEL) && (TRC_MASK & TRC_G_##Group) && \
+             TraceEnabled(TRC_G_##Group, TRC_L_##Level)) \
+   ? TraceRecord([]() -> const TraceSite * { \
+         static const TraceSite Site{__LINE__, __FILE__, #Group, #Level, \
+                                     TRC_G_##Group, TRC_L_##Level, Format}; \
+         return &Site; }(), ##__VA_ARGS__) \
    : 0)